@@ -3,15 +3,17 @@
 // the GNU General Public License Version 3 in the root directory of this
 // project.
 
+#include "Logging.hpp"
 #include "RtspClientsMap.hpp"
 #include "rtsp_server.hpp"
 #include <chrono>
 #include <cstdio>
-#include <iostream>
+#include <cstdlib>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/videoio.hpp>
+#include <string>
 #include <wpinet/EventLoopRunner.h>
 
 using Clock = std::chrono::steady_clock;
@@ -20,10 +22,10 @@ using Ms = std::chrono::duration<double, std::milli>;
 
 static double ms_since(TimePoint t0) { return Ms(Clock::now() - t0).count(); }
 
-std::atomic_bool run{true};
+std::atomic_bool stop{false};
 void stop_main(int s) {
   printf("Caught signal %d\n", s);
-  run = false;
+  stop = true;
 }
 
 void RunLifecam() {
@@ -47,23 +49,34 @@ void RunLifecam() {
     cap.set(cv::CAP_PROP_CONTRAST, 32);     // balanced
 
     while (!cap.isOpened()) {
-      std::cout << "Waiting for camera to open..." << std::endl;
+      LOG_INFO("Waiting for camera to open...");
       std::this_thread::sleep_for(std::chrono::seconds(1));
 
-      if (!run) {
+      if (stop) {
         return;
       }
     }
 
     const int width = cap.get(cv::CAP_PROP_FRAME_WIDTH);
     const int height = cap.get(cv::CAP_PROP_FRAME_HEIGHT);
-    std::cout << "Source: " << width << "x" << height << "\n\n";
-
-    std::cout << "=== Pipeline ===\n";
+    LOG_INFO("Source: {}x{}", width, height);
+
+    // Drawn on the encode workers, not here
+    SetCameraStreamOverlay(
+        "lifecam",
+        {
+            {.text = "{time}", .origin = {10, 30}, .color = {0, 255, 0}},
+            {.text = "This text is red",
+             .origin = {10, 70},
+             .color = {0, 0, 255}},
+            {.text = "This text is blue",
+             .origin = {10, 100},
+             .color = {255, 0, 0}},
+        });
 
     int frame_idx = 0;
 
-    while (run) {
+    while (!stop) {
       auto t_start = Clock::now();
 
       cap >> frame;
@@ -71,58 +84,106 @@ void RunLifecam() {
       // cv::IMREAD_COLOR);
 
       if (frame.empty()) {
-        std::cerr << "Failed to grab frame" << std::endl;
+        LOG_WARN_EVERY(1000, "Failed to grab frame");
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
         continue;
       }
 
-      auto now = std::chrono::system_clock::now();
-      auto duration = now.time_since_epoch();
-      auto millis =
-          std::chrono::duration_cast<std::chrono::milliseconds>(duration)
-              .count();
-      auto seconds = millis / 1000;
-      auto ms = millis % 1000;
-
-      time_t time_t_now = seconds;
-      struct tm *tm_info = localtime(&time_t_now);
-      char timestamp_str[32];
-      snprintf(timestamp_str, sizeof(timestamp_str), "%02d:%02d:%02d.%03ld",
-               tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec, ms);
-
-      cv::putText(frame, timestamp_str, cv::Point(10, 30),
-                  cv::FONT_HERSHEY_SIMPLEX, 1.0, cv::Scalar(0, 255, 0), 2,
-                  cv::LINE_AA);
-      cv::putText(frame, "This text is red", cv::Point(10, 70),
-                  cv::FONT_HERSHEY_SIMPLEX, 1.0, cv::Scalar(0, 0, 255), 2,
-                  cv::LINE_AA);
-      cv::putText(frame, "This text is blue", cv::Point(10, 100),
-                  cv::FONT_HERSHEY_SIMPLEX, 1.0, cv::Scalar(255, 0, 0), 2,
-                  cv::LINE_AA);
-
       const double grab_ms = ms_since(t_start);
 
       auto t_conv = Clock::now();
       PublishCameraFrame("lifecam", frame);
       const double conv_ms = ms_since(t_conv);
 
+      // Timestamped by the log
       if (frame_idx % 30 == 0)
-        std::cout << timestamp_str << "," << grab_ms << "," << conv_ms << ","
-                  << frame.cols << "x" << frame.rows << "\n";
+        LOG_INFO("{:.3f},{:.3f},{}x{}", grab_ms, conv_ms, frame.cols,
+                 frame.rows);
 
       ++frame_idx;
     }
   } catch (const std::exception &e) {
-    std::cerr << "FATAL: " << e.what() << std::endl;
+    LOG_ERROR("{}", e.what());
+  }
+}
+
+// Play a recording to the lifecam stream instead of the camera
+int RunReplay(const std::string &path, const ReplaySettings &settings) {
+  try {
+    const FrameRecording recording(path);
+    LOG_INFO("Replaying {} frames ({} s) from {} {}", recording.size(),
+             recording.duration_us() / 1e6, path,
+             settings.real_time ? "in real time" : "as fast as possible");
+
+    const auto stats = ReplayRecording("lifecam", recording, settings, stop);
+    std::printf("Replayed %llu frames in %.2f s: %.1f fps, %llu late\n",
+                static_cast<unsigned long long>(stats.frames), stats.seconds,
+                stats.seconds > 0 ? stats.frames / stats.seconds : 0.0,
+                static_cast<unsigned long long>(stats.late));
+    return 0;
+  } catch (const std::exception &e) {
+    LOG_ERROR("{}", e.what());
+    return 1;
   }
 }
 
-int main() {
+static void Usage(const char *argv0) {
+  std::fprintf(stderr,
+               "usage: %s [--record <file>] [--replay <file> [--fast] "
+               "[--loop]] [--io-loops <n>] [--verbose]\n"
+               "  --record    write every frame published to <file>\n"
+               "  --replay    publish <file> instead of opening the camera\n"
+               "  --fast      replay each frame once the last is encoded,\n"
+               "              rather than at the recorded frame rate\n"
+               "  --loop      replay until interrupted\n"
+               "  --io-loops  RTSP server I/O threads (default %d)\n"
+               "  --verbose   also log every RTSP request and response\n",
+               argv0, DEFAULT_RTSP_LOOPS);
+}
+
+int main(int argc, char **argv) {
+  std::string record_path;
+  std::string replay_path;
+  ReplaySettings replay;
+  int io_loops = DEFAULT_RTSP_LOOPS;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--record" && has_value) {
+      record_path = argv[++i];
+    } else if (arg == "--replay" && has_value) {
+      replay_path = argv[++i];
+    } else if (arg == "--fast") {
+      replay.real_time = false;
+    } else if (arg == "--loop") {
+      replay.loop = true;
+    } else if (arg == "--io-loops" && has_value) {
+      io_loops = std::atoi(argv[++i]);
+    } else if (arg == "--verbose") {
+      SetLogLevel(LogLevel::VERBOSE);
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+
   // signal handler
   signal(SIGINT, stop_main);
   signal(SIGTERM, stop_main);
 
-  StartRtspServerLoop();
+  StartRtspServerLoop(io_loops);
+
+  if (!record_path.empty() &&
+      !StartCameraStreamRecording("lifecam", record_path))
+    return 1;
+
+  int ret = 0;
+  if (!replay_path.empty())
+    ret = RunReplay(replay_path, replay);
+  else
+    RunLifecam();
 
-  RunLifecam();
+  // Finishes the file, so it doesn't have to be recovered
+  StopCameraStreamRecording("lifecam");
+  return ret;
 }
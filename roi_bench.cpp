@@ -0,0 +1,224 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+// Compares region-of-interest encoding against plain encoding at the same
+// bitrate, using libx265 so it runs anywhere. Encodes the clip twice, decodes
+// it again, and reports bitrate and luma PSNR inside and outside the ROI.
+//
+//   roi_bench <video> <x,y,w,h> [bitrate_bps] [quality_offset] [frames]
+//
+// e.g. roi_bench match.mp4 800,300,320,240 2000000 -0.5 600
+
+#include "FfmpegRtpPipe.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static std::string averr(int ret) {
+  char buf[AV_ERROR_MAX_STRING_SIZE] = {};
+  av_strerror(ret, buf, sizeof(buf));
+  return {buf};
+}
+
+// Sum of squared luma error over some set of pixels
+struct ErrorSum {
+  double sse = 0;
+  int64_t pixels = 0;
+
+  double psnr() const {
+    if (pixels == 0)
+      return 0;
+    const double mse = sse / pixels;
+    return mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : 99;
+  }
+};
+
+struct Result {
+  int64_t bytes = 0;
+  int frames = 0;
+  ErrorSum full, inside, outside;
+};
+
+static void Accumulate(const cv::Mat &ref, const AVFrame *decoded,
+                       const cv::Rect &roi, Result &result) {
+  for (int y = 0; y < ref.rows; y++) {
+    const uint8_t *a = ref.ptr<uint8_t>(y);
+    const uint8_t *b = decoded->data[0] + y * decoded->linesize[0];
+    for (int x = 0; x < ref.cols; x++) {
+      const double d = static_cast<double>(a[x]) - b[x];
+      auto &region = roi.contains(cv::Point(x, y)) ? result.inside : result.outside;
+      region.sse += d * d;
+      region.pixels++;
+    }
+  }
+  result.full.sse = result.inside.sse + result.outside.sse;
+  result.full.pixels = result.inside.pixels + result.outside.pixels;
+  result.frames++;
+}
+
+// Encode and decode every frame, scoring the luma in and out of `measured`
+static Result Run(const std::vector<cv::Mat> &frames, int bitrate, double fps,
+                  const cv::Rect &measured,
+                  std::span<const RegionOfInterest> rois) {
+  const int width = frames[0].cols;
+  const int height = frames[0].rows;
+
+  // Same knobs FfmpegRtpPipeline uses for x265 in CBR
+  const AVCodec *codec = avcodec_find_encoder_by_name("libx265");
+  if (!codec)
+    throw std::runtime_error("libx265 encoder not found");
+  AVCodecContext *enc = avcodec_alloc_context3(codec);
+  enc->width = width;
+  enc->height = height;
+  enc->time_base = {1, 90000};
+  enc->framerate = {static_cast<int>(std::lround(fps * 1000)), 1000};
+  enc->pix_fmt = AV_PIX_FMT_YUV420P;
+  enc->bit_rate = bitrate;
+  enc->rc_max_rate = bitrate;
+  enc->rc_buffer_size = static_cast<int>(bitrate / fps);
+  enc->gop_size = 30;
+  AVDictionary *opts = nullptr;
+  av_dict_set(&opts, "preset", "ultrafast", 0);
+  av_dict_set(&opts, "tune", "zerolatency", 0);
+  int ret = avcodec_open2(enc, codec, &opts);
+  av_dict_free(&opts);
+  if (ret < 0)
+    throw std::runtime_error("avcodec_open2 (encoder): " + averr(ret));
+
+  const AVCodec *decoder = avcodec_find_decoder(AV_CODEC_ID_HEVC);
+  AVCodecContext *dec = avcodec_alloc_context3(decoder);
+  ret = avcodec_open2(dec, decoder, nullptr);
+  if (ret < 0)
+    throw std::runtime_error("avcodec_open2 (decoder): " + averr(ret));
+
+  AVFrame *in = av_frame_alloc();
+  AVFrame *out = av_frame_alloc();
+  AVPacket *pkt = av_packet_alloc();
+  in->format = AV_PIX_FMT_YUV420P;
+  in->width = width;
+  in->height = height;
+
+  // Reference luma for each frame, matched to decoder output by pts
+  std::vector<cv::Mat> luma(frames.size());
+  Result result;
+
+  auto drain_decoder = [&] {
+    while (avcodec_receive_frame(dec, out) == 0) {
+      if (out->pts >= 0 && out->pts < static_cast<int64_t>(luma.size()))
+        Accumulate(luma[out->pts], out, measured, result);
+      av_frame_unref(out);
+    }
+  };
+  auto drain_encoder = [&] {
+    while (avcodec_receive_packet(enc, pkt) == 0) {
+      result.bytes += pkt->size;
+      avcodec_send_packet(dec, pkt);
+      av_packet_unref(pkt);
+      drain_decoder();
+    }
+  };
+
+  cv::Mat yuv;
+  for (size_t i = 0; i < frames.size(); i++) {
+    cv::cvtColor(frames[i], yuv, cv::COLOR_BGR2YUV_I420);
+    luma[i] = yuv.rowRange(0, height).clone();
+
+    const int luma_size = width * height;
+    in->data[0] = yuv.data;
+    in->data[1] = yuv.data + luma_size;
+    in->data[2] = yuv.data + luma_size + luma_size / 4;
+    in->linesize[0] = width;
+    in->linesize[1] = width / 2;
+    in->linesize[2] = width / 2;
+    in->pts = static_cast<int64_t>(i);
+    AttachRegionsOfInterest(in, rois);
+
+    ret = avcodec_send_frame(enc, in);
+    if (ret < 0)
+      throw std::runtime_error("avcodec_send_frame: " + averr(ret));
+    drain_encoder();
+  }
+  avcodec_send_frame(enc, nullptr);
+  drain_encoder();
+  avcodec_send_packet(dec, nullptr);
+  drain_decoder();
+
+  av_packet_free(&pkt);
+  av_frame_free(&out);
+  av_frame_free(&in);
+  avcodec_free_context(&dec);
+  avcodec_free_context(&enc);
+  return result;
+}
+
+static void Print(const char *name, const Result &r, double fps) {
+  const double kbps =
+      r.frames ? r.bytes * 8.0 * fps / r.frames / 1000.0 : 0.0;
+  std::printf("%-8s %6d %10.1f %10.2f %10.2f %10.2f\n", name, r.frames, kbps,
+              r.full.psnr(), r.inside.psnr(), r.outside.psnr());
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::fprintf(stderr, "usage: %s <video> <x,y,w,h> [bitrate_bps] "
+                         "[quality_offset] [frames]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  cv::Rect rect;
+  if (std::sscanf(argv[2], "%d,%d,%d,%d", &rect.x, &rect.y, &rect.width,
+                  &rect.height) != 4) {
+    std::fprintf(stderr, "bad roi '%s', want x,y,w,h\n", argv[2]);
+    return 1;
+  }
+  const int bitrate = argc > 3 ? std::atoi(argv[3]) : 2'000'000;
+  const float offset = argc > 4 ? std::strtof(argv[4], nullptr) : -0.5f;
+  const int max_frames = argc > 5 ? std::atoi(argv[5]) : 300;
+
+  cv::VideoCapture cap(argv[1]);
+  if (!cap.isOpened()) {
+    std::fprintf(stderr, "couldn't open %s\n", argv[1]);
+    return 1;
+  }
+  double fps = cap.get(cv::CAP_PROP_FPS);
+  if (!(fps > 0))
+    fps = 30;
+
+  std::vector<cv::Mat> frames;
+  cv::Mat frame;
+  while (static_cast<int>(frames.size()) < max_frames && cap.read(frame)) {
+    // I420 wants even dimensions
+    frames.push_back(
+        frame(cv::Rect(0, 0, frame.cols & ~1, frame.rows & ~1)).clone());
+  }
+  if (frames.empty()) {
+    std::fprintf(stderr, "no frames in %s\n", argv[1]);
+    return 1;
+  }
+  rect &= cv::Rect(0, 0, frames[0].cols, frames[0].rows);
+
+  std::printf("%dx%d, %zu frames @ %.1f fps, %d bps, roi %dx%d+%d+%d "
+              "offset %.2f\n\n",
+              frames[0].cols, frames[0].rows, frames.size(), fps, bitrate,
+              rect.width, rect.height, rect.x, rect.y, offset);
+  std::printf("%-8s %6s %10s %10s %10s %10s\n", "mode", "frames", "kbps",
+              "psnr", "psnr_roi", "psnr_rest");
+
+  try {
+    Print("plain", Run(frames, bitrate, fps, rect, {}), fps);
+
+    const RegionOfInterest roi{rect, offset};
+    Print("roi", Run(frames, bitrate, fps, rect, {&roi, 1}), fps);
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "FATAL: %s\n", e.what());
+    return 1;
+  }
+}
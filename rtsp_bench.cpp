@@ -0,0 +1,356 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+// Control plane latency under load. Connects more and more simulated RTSP
+// clients to a running server, each sending a keepalive every 100 ms like a
+// real player does, and reports how long the server takes to answer as the
+// client count grows. The first `watchers` clients also SETUP and PLAY the
+// stream, so the server is sending media to them at the same time.
+//
+//   rtsp_bench <host> [stream] [watchers] [max_clients] [seconds_per_step]
+//
+// e.g. rtsp_bench 10.0.0.11 lifecam 8 800 5
+//
+// With the server's connections spread over several I/O loops (see
+// StartRtspServerLoop), p99 should stay about where it was with one client.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <netdb.h>
+#include <random>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int RTSP_PORT = 5801;
+constexpr auto KEEPALIVE_INTERVAL = std::chrono::milliseconds(100);
+
+struct Client {
+  enum class State {
+    CONNECTING,
+    DESCRIBE,
+    SETUP,
+    PLAY,
+    IDLE,
+    WAITING,
+    FAILED
+  };
+
+  int fd = -1;
+  // Where a watcher's RTP and RTCP go. Never read; the kernel drops what
+  // doesn't fit.
+  int rtp_fd = -1;
+  int rtcp_fd = -1;
+  int rtp_port = 0;
+
+  bool watcher = false;
+  State state = State::CONNECTING;
+  std::string in;
+  int cseq = 0;
+  std::string session;
+  Clock::time_point sent_at;
+  Clock::time_point next_at;
+
+  ~Client() {
+    for (int f : {fd, rtp_fd, rtcp_fd}) {
+      if (f >= 0)
+        close(f);
+    }
+  }
+};
+
+static int BindUdp(int port) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// An even/odd port pair, since the server sends RTCP to the RTP port + 1
+static bool BindMediaPorts(Client &c, std::mt19937 &rng) {
+  for (int attempt = 0; attempt < 64; attempt++) {
+    const int port = 30000 + 2 * (rng() % 10000);
+    c.rtp_fd = BindUdp(port);
+    if (c.rtp_fd < 0)
+      continue;
+    c.rtcp_fd = BindUdp(port + 1);
+    if (c.rtcp_fd >= 0) {
+      c.rtp_port = port;
+      return true;
+    }
+    close(c.rtp_fd);
+    c.rtp_fd = -1;
+  }
+  return false;
+}
+
+class Bench {
+public:
+  Bench(const sockaddr_in &server, std::string url)
+      : server_(server), url_(std::move(url)), epoll_(epoll_create1(0)) {}
+  ~Bench() { close(epoll_); }
+
+  bool connect_client(bool watcher) {
+    auto c = std::make_unique<Client>();
+    c->watcher = watcher;
+    if (watcher && !BindMediaPorts(*c, rng_))
+      return false;
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+      return false;
+    if (connect(c->fd, reinterpret_cast<const sockaddr *>(&server_),
+                sizeof(server_)) != 0 &&
+        errno != EINPROGRESS)
+      return false;
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c.get();
+    epoll_ctl(epoll_, EPOLL_CTL_ADD, c->fd, &ev);
+    clients_.push_back(std::move(c));
+    return true;
+  }
+
+  // Run everyone for a while, and return the keepalive round trips (ms)
+  // answered in that time
+  std::vector<double> run(Clock::duration length) {
+    latencies_.clear();
+    const auto end = Clock::now() + length;
+    epoll_event events[256];
+    while (Clock::now() < end) {
+      const int n = epoll_wait(epoll_, events, 256, 1);
+      for (int i = 0; i < n; i++) {
+        auto &c = *static_cast<Client *>(events[i].data.ptr);
+        if (c.state == Client::State::CONNECTING &&
+            (events[i].events & EPOLLOUT))
+          on_connected(c);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          on_readable(c);
+      }
+
+      const auto now = Clock::now();
+      for (auto &c : clients_) {
+        if (c->state == Client::State::IDLE && c->next_at <= now)
+          send_keepalive(*c);
+      }
+    }
+    return latencies_;
+  }
+
+  size_t clients() const { return clients_.size(); }
+  int failures() const { return failures_; }
+
+private:
+  void send_request(Client &c, const std::string &method,
+                    const std::string &headers) {
+    const std::string request = method + " " + url_ + " RTSP/1.0\r\nCSeq: " +
+                                std::to_string(++c.cseq) + "\r\n" + headers +
+                                "\r\n";
+    if (send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(request.size()))
+      fail(c);
+    c.sent_at = Clock::now();
+  }
+
+  void send_keepalive(Client &c) {
+    c.state = Client::State::WAITING;
+    if (c.session.empty())
+      send_request(c, "OPTIONS", "");
+    else
+      send_request(c, "GET_PARAMETER", "Session: " + c.session + "\r\n");
+  }
+
+  void on_connected(Client &c) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &c;
+    epoll_ctl(epoll_, EPOLL_CTL_MOD, c.fd, &ev);
+
+    if (c.watcher) {
+      c.state = Client::State::DESCRIBE;
+      send_request(c, "DESCRIBE", "Accept: application/sdp\r\n");
+    } else {
+      // Spread keepalives out over the interval
+      c.state = Client::State::IDLE;
+      c.next_at = Clock::now() + std::chrono::microseconds(
+                                     rng_() % std::chrono::microseconds(
+                                                  KEEPALIVE_INTERVAL)
+                                                  .count());
+    }
+  }
+
+  void on_readable(Client &c) {
+    if (c.state == Client::State::FAILED)
+      return;
+    char buf[4096];
+    const ssize_t got = recv(c.fd, buf, sizeof(buf), 0);
+    if (got <= 0) {
+      if (got == 0 || errno != EAGAIN)
+        fail(c);
+      return;
+    }
+    c.in.append(buf, got);
+
+    while (c.state != Client::State::FAILED) {
+      const size_t end = c.in.find("\r\n\r\n");
+      if (end == std::string::npos)
+        return;
+      size_t length = end + 4;
+      const std::string head = c.in.substr(0, end);
+      if (auto at = head.find("Content-Length:"); at != std::string::npos)
+        length += std::strtoul(head.c_str() + at + 15, nullptr, 10);
+      if (c.in.size() < length)
+        return;
+      c.in.erase(0, length);
+      on_response(c, head);
+    }
+  }
+
+  void on_response(Client &c, const std::string &head) {
+    if (head.compare(0, 12, "RTSP/1.0 200") != 0) {
+      std::fprintf(stderr, "Request failed: %s\n",
+                   head.substr(0, head.find('\r')).c_str());
+      fail(c);
+      return;
+    }
+
+    switch (c.state) {
+    case Client::State::DESCRIBE:
+      c.state = Client::State::SETUP;
+      send_request(c, "SETUP",
+                   "Transport: RTP/AVP;unicast;client_port=" +
+                       std::to_string(c.rtp_port) + "-" +
+                       std::to_string(c.rtp_port + 1) + "\r\n");
+      break;
+    case Client::State::SETUP:
+      if (auto at = head.find("Session: "); at != std::string::npos) {
+        at += 9;
+        c.session = head.substr(at, head.find_first_of(";\r", at) - at);
+      }
+      c.state = Client::State::PLAY;
+      send_request(c, "PLAY", "Session: " + c.session + "\r\n");
+      break;
+    case Client::State::PLAY:
+      c.state = Client::State::IDLE;
+      c.next_at = Clock::now();
+      break;
+    case Client::State::WAITING: {
+      const auto now = Clock::now();
+      latencies_.push_back(
+          std::chrono::duration<double, std::milli>(now - c.sent_at).count());
+      c.state = Client::State::IDLE;
+      c.next_at = c.sent_at + KEEPALIVE_INTERVAL;
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  // Give up on a client. It stays connected (if it still is), but quiet.
+  void fail(Client &c) {
+    if (c.state == Client::State::FAILED)
+      return;
+    c.state = Client::State::FAILED;
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, c.fd, nullptr);
+    failures_++;
+  }
+
+  sockaddr_in server_;
+  std::string url_;
+  int epoll_;
+  std::mt19937 rng_{std::random_device{}()};
+  std::vector<std::unique_ptr<Client>> clients_;
+  std::vector<double> latencies_;
+  int failures_ = 0;
+};
+
+static double Percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  return sorted[std::min(sorted.size() - 1,
+                         static_cast<size_t>(p * sorted.size()))];
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr,
+                 "usage: %s <host> [stream] [watchers] [max_clients] "
+                 "[seconds_per_step]\n",
+                 argv[0]);
+    return 1;
+  }
+  const std::string host = argv[1];
+  const std::string stream = argc > 2 ? argv[2] : "lifecam";
+  const int watchers = argc > 3 ? std::atoi(argv[3]) : 0;
+  const int max_clients = argc > 4 ? std::atoi(argv[4]) : 400;
+  const int seconds = argc > 5 ? std::atoi(argv[5]) : 5;
+
+  addrinfo hints{};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *resolved = nullptr;
+  if (getaddrinfo(host.c_str(), nullptr, &hints, &resolved) != 0) {
+    std::fprintf(stderr, "Couldn't resolve %s\n", host.c_str());
+    return 1;
+  }
+  sockaddr_in server = *reinterpret_cast<sockaddr_in *>(resolved->ai_addr);
+  server.sin_port = htons(RTSP_PORT);
+  freeaddrinfo(resolved);
+
+  // Each client is a socket, and each watcher two more
+  rlimit files{};
+  getrlimit(RLIMIT_NOFILE, &files);
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+
+  Bench bench(server, "rtsp://" + host + ":" + std::to_string(RTSP_PORT) +
+                          "/" + stream);
+  std::printf("%8s %8s %10s %8s %8s %8s %8s\n", "clients", "failed",
+              "requests/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+  for (int step : {1, 10, 50, 100, 200, 400, 800, 1600}) {
+    const int target = std::min(step, max_clients);
+    while (static_cast<int>(bench.clients()) < target) {
+      const bool watcher = static_cast<int>(bench.clients()) < watchers;
+      if (!bench.connect_client(watcher)) {
+        std::fprintf(stderr, "Couldn't connect client %zu: %s\n",
+                     bench.clients(), std::strerror(errno));
+        return 1;
+      }
+    }
+
+    auto latencies = bench.run(std::chrono::seconds(seconds));
+    std::sort(latencies.begin(), latencies.end());
+    std::printf("%8zu %8d %10.0f %8.2f %8.2f %8.2f %8.2f\n", bench.clients(),
+                bench.failures(),
+                static_cast<double>(latencies.size()) / seconds,
+                Percentile(latencies, 0.5), Percentile(latencies, 0.9),
+                Percentile(latencies, 0.99),
+                latencies.empty() ? 0.0 : latencies.back());
+    std::fflush(stdout);
+
+    if (target == max_clients)
+      break;
+  }
+}
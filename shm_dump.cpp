@@ -0,0 +1,73 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+// Example local reader: copies a stream's encoded frames from shared memory
+// to stdout as an Annex-B elementary stream, re-attaching whenever the
+// publisher restarts. Stats go to stderr.
+//
+//   shm_dump <stream> [codec] | ffplay -f hevc -
+//
+// The stream has to be shared first, see SetCameraStreamLocalSharing.
+
+#include "ShmRing.hpp"
+#include <chrono>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <stream> [codec]\n", argv[0]);
+    return 1;
+  }
+  const std::string name =
+      ShmRingName(argv[1], ShmRingKind::ENCODED, argc > 2 ? argv[2] : "hevc");
+
+  std::optional<ShmRingReader> reader;
+  std::vector<uint8_t> copy;
+  uint64_t frames = 0;
+
+  for (;;) {
+    if (!reader) {
+      try {
+        reader.emplace(name);
+        std::fprintf(stderr, "Attached to %s\n", name.c_str());
+      } catch (const std::exception &e) {
+        std::fprintf(stderr, "Waiting for %s (%s)\n", name.c_str(), e.what());
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        continue;
+      }
+    }
+
+    ShmRingEntry entry;
+    switch (reader->next(entry)) {
+    case ShmRingReader::Status::OK:
+      // Copy out before writing, since stdout can block for a long time
+      copy.assign(entry.data.begin(), entry.data.end());
+      if (!reader->still_valid(entry))
+        continue;
+      std::fwrite(copy.data(), 1, copy.size(), stdout);
+      if (++frames % 300 == 0) {
+        std::fprintf(stderr, "%llu frames, %llu dropped\n",
+                     static_cast<unsigned long long>(frames),
+                     static_cast<unsigned long long>(reader->dropped()));
+      }
+      break;
+    case ShmRingReader::Status::EMPTY:
+      reader->wait(std::chrono::milliseconds(500));
+      break;
+    case ShmRingReader::Status::OVERRUN:
+      std::fputs("Overrun, skipping to the next IDR\n", stderr);
+      break;
+    case ShmRingReader::Status::CLOSED:
+      std::fputs("Publisher went away\n", stderr);
+      reader.reset();
+      break;
+    }
+  }
+}
@@ -9,5 +9,137 @@ public class FfmpegRtspHandler {
 
     public static native boolean putFrame(String streamName, long matPtr);
 
+    /**
+     * putFrame, telling the encoder which parts of the frame matter most. roiRects holds x, y,
+     * width, height (pixels) for each region; roiQualityOffsets one offset per region, from -1
+     * (spend many more bits here) to 1 (many fewer). Bits spent on regions come out of the rest
+     * of the frame, so the bitrate doesn't go up. Earlier regions win where they overlap.
+     *
+     * <p>Only the software encoders (libx265, libx264) act on regions. Streams encoded with nvenc
+     * or rkmpp ignore them, and log a warning the first time they're given some. nvenc is the
+     * default, so as built this is the same as putFrame, except for streams that fell back to
+     * software because no nvenc session was free or nvenc wouldn't open.
+     */
+    public static native boolean putFrameWithRois(
+            String streamName, long matPtr, int[] roiRects, float[] roiQualityOffsets);
+
+    public static final int CODEC_HEVC = 0;
+    public static final int CODEC_H264 = 1;
+
+    /**
+     * For cameras that encode for themselves: send one already encoded frame (an Annex-B access
+     * unit in CODEC_HEVC or CODEC_H264, width by height pixels) to everyone watching, as is,
+     * instead of putFrame. Nothing is re-encoded, so encoder settings don't apply; clients that
+     * join mid-GOP are sent everything since the last keyframe. Returns false if it couldn't be
+     * sent.
+     */
+    public static native boolean putEncodedFrame(
+            String streamName, int codec, byte[] data, int width, int height);
+
+    /**
+     * Split each encoded frame into this many slices so the top of a frame can be sent (and
+     * decoded) before the bottom is done. Applies to clients already watching, too.
+     */
+    public static native void setSliceCount(String streamName, int slices);
+
+    /**
+     * Encode in this many temporal layers (1-3), each doubling the frame rate of the ones below.
+     * Clients reporting loss, or that we can't send to fast enough, are sent fewer layers (a
+     * lower frame rate) without affecting anyone else. Only the software encoder supports this,
+     * at the cost of 2^(layers-1)-1 frames of extra latency.
+     */
+    public static native void setTemporalLayers(String streamName, int layers);
+
+    public static final int RATE_CONTROL_CBR = 0;
+    public static final int RATE_CONTROL_VBR = 1;
+    public static final int RATE_CONTROL_CONSTANT_QUALITY = 2;
+
+    /**
+     * Change a stream's encoder settings while it's running. bitrate is in bits per second, gop
+     * is frames between keyframes, fps of 0 follows the camera (otherwise frames are dropped to
+     * get down to it), and quality is the QP/CRF (0-51) used with RATE_CONTROL_CONSTANT_QUALITY.
+     * Bitrate changes apply immediately where the encoder supports it; everything else at the
+     * next keyframe.
+     */
+    public static native void configureStream(
+            String streamName, int bitrate, int gop, int fps, int rateControl, int quality);
+
+    /**
+     * Protect a stream with FlexFEC. Each repair packet covers groupSize media packets (0
+     * disables FEC), spaced interleave packets apart so bursts of up to interleave losses are
+     * recoverable. If adaptive, groupSize is the upper bound and shrinks as clients report loss.
+     * Applies to clients that connect afterwards.
+     */
+    public static native void setFecProtection(
+            String streamName, int groupSize, int interleave, boolean adaptive);
+
+    /**
+     * Share a stream with other processes on this machine through shared memory, instead of them
+     * pulling it over RTSP on loopback: encoded (HEVC) frames in /dev/shm/hevc-meme.NAME.hevc,
+     * and/or frames as passed to putFrame in /dev/shm/hevc-meme.NAME.raw. See ShmRing.hpp for
+     * the reader side. Sharing encoded frames keeps the encoder running with nobody watching.
+     */
+    public static native void setLocalSharing(String streamName, boolean encoded, boolean raw);
+
+    /**
+     * Frames from all streams are encoded on a shared pool of worker threads rather than the
+     * thread calling putFrame. Use this many workers, pinned round robin to the given CPUs (or
+     * unpinned if cores is empty). Defaults to 2 unpinned workers.
+     */
+    public static native void setEncodeWorkers(int workers, int[] cores);
+
+    /**
+     * When there are more frames waiting than encode workers, higher priority streams (the
+     * driver camera, say) are encoded first. Defaults to 0.
+     */
+    public static native void setStreamPriority(String streamName, int priority);
+
+    /**
+     * Burn lines of text into every frame of a stream, replacing any set before. Much cheaper
+     * than Imgproc.putText before putFrame, and done on the encode workers. origins holds x, y
+     * (bottom left, pixels) for each line, and colors one 0xRRGGBB per line. "{time}" in a line
+     * is replaced by the frame's capture time. An empty texts array turns the overlay off.
+     */
+    public static native void setTextOverlay(
+            String streamName,
+            String[] texts,
+            int[] origins,
+            int[] colors,
+            double scale,
+            int thickness);
+
+    /**
+     * Write every frame passed to putFrame for a stream (with its ROIs and timestamp) to path,
+     * uncompressed, until stopRecording. Returns false if path can't be written.
+     */
+    public static native boolean startRecording(String streamName, String path);
+
+    /** Finish a stream's recording, if it has one. */
+    public static native void stopRecording(String streamName);
+
+    /**
+     * Publish a recording made with startRecording to a stream, in place of putFrame, from a
+     * thread of its own. With realTime, frames go out as far apart as they were recorded;
+     * otherwise each goes as soon as the one before has been encoded, to measure throughput.
+     * Returns false if path isn't a recording.
+     */
+    public static native boolean startReplay(
+            String streamName, String path, boolean realTime, boolean loop);
+
+    /** Stop a stream's replay, if it has one. */
+    public static native void stopReplay(String streamName);
+
+    public static final int LOG_VERBOSE = 0;
+    public static final int LOG_INFO = 1;
+    public static final int LOG_WARN = 2;
+    public static final int LOG_ERROR = 3;
+
+    /**
+     * Only log messages at this level or above (LOG_INFO by default). LOG_VERBOSE adds every
+     * RTSP request and response. Logging is written to stderr from a thread of its own, and
+     * repeated errors (a client that's gone away, say) are rate limited.
+     */
+    public static native void setLogLevel(int level);
+
     public static String[] libraryNames = new String[] {"RtspServer"};
 }
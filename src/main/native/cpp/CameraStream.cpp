@@ -0,0 +1,555 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "CameraStream.hpp"
+#include "EncodeScheduler.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <opencv2/imgproc.hpp>
+#include <utility>
+
+// Re-open the encoder if the input rate wanders this far from what it was
+// opened with (only when following the input rate)
+constexpr double FPS_DRIFT_TOLERANCE = 0.2;
+
+// How long to wait before trying a new resolution again if its encoder
+// wouldn't open
+constexpr int64_t RESOLUTION_RETRY_US = 1'000'000;
+
+// Shared memory for local readers. The encoded ring holds several seconds at
+// any bitrate we'd use; the raw one just a few frames, since they're big.
+constexpr size_t ENCODED_RING_BYTES = 16 << 20;
+constexpr uint32_t ENCODED_RING_SLOTS = 512;
+constexpr uint32_t RAW_RING_FRAMES = 4;
+
+// Passthrough GOP cache limit, a few seconds of a high bitrate camera
+constexpr size_t GOP_CACHE_BYTES = 8 << 20;
+
+CameraStream::CameraStream(std::string name, VideoCodec codec, bool keep_warm)
+    : keep_warm_(keep_warm) {
+  info_.unique_name = std::move(name);
+  info_.codec = codec;
+}
+
+CameraStream::~CameraStream() {
+  // Closing an encoder flushes it, and what comes out goes through deliver(),
+  // which needs members declared after the pipelines. So close them all
+  // (waiting for any still opening) before those go.
+  std::scoped_lock media{media_mutex_};
+  pipeline_.reset();
+  abandon_next_pipeline();
+  abandoned_pipelines_.clear();
+}
+
+CameraStreamInfo CameraStream::info() const {
+  std::scoped_lock lock{mutex_};
+  return info_;
+}
+
+void CameraStream::configure(const EncoderSettings &settings) {
+  std::scoped_lock lock{mutex_};
+  info_.encoder = settings;
+  settings_changed_ = true;
+}
+
+void CameraStream::set_fec(const FecSettings &fec) {
+  std::scoped_lock lock{mutex_};
+  info_.fec = fec;
+}
+
+void CameraStream::set_priority(int priority) {
+  std::scoped_lock lock{mutex_};
+  info_.priority = priority;
+}
+
+void CameraStream::set_local_sharing(const LocalSharing &local) {
+  std::scoped_lock lock{mutex_};
+  info_.local = local;
+}
+
+PacingSettings CameraStream::pacing() const {
+  const auto &encoder = info_.encoder;
+  int fps = info_.fps > 0 ? info_.fps : 30;
+  if (encoder.fps > 0)
+    fps = std::min(fps, encoder.fps);
+  return {.bitrate = encoder.bitrate, .fps = fps};
+}
+
+void CameraStream::subscribe(std::shared_ptr<RtpSender> sender,
+                             ReadyCallback on_ready) {
+  {
+    std::scoped_lock lock{mutex_};
+    sender->set_pacing(pacing());
+    sender->set_temporal_layers(info_.encoder.temporal_layers);
+    subscribers_.push_back(std::make_shared<Subscriber>(Subscriber{sender}));
+    // Get them a picture now instead of at the end of the GOP
+    keyframe_needed_ = true;
+
+    if (!encoder_ready_) {
+      if (on_ready)
+        ready_waiters_.push_back({std::move(sender), std::move(on_ready)});
+      return;
+    }
+  }
+  if (on_ready)
+    on_ready();
+}
+
+void CameraStream::unsubscribe(const std::shared_ptr<RtpSender> &sender) {
+  std::scoped_lock lock{mutex_};
+  std::erase_if(subscribers_,
+                [&](const auto &sub) { return sub->sender == sender; });
+  // Gave up waiting (e.g. SETUP timed out), so don't call back
+  std::erase_if(ready_waiters_,
+                [&](const auto &waiter) { return waiter.sender == sender; });
+}
+
+void CameraStream::publish(const cv::Mat &frame,
+                           std::span<const RegionOfInterest> rois,
+                           int64_t captured_us) {
+  const int64_t now_us = captured_us >= 0 ? captured_us : av_gettime();
+
+  EncodeScheduler::Job job;
+  {
+    std::scoped_lock lock{mutex_};
+    const double fps = measure_input(now_us, frame.cols, frame.rows);
+
+    // Due before the next frame comes in
+    const double interval_us = fps > 0 ? 1e6 / fps : 1e6 / 30;
+    job.key = this;
+    job.priority = info_.priority;
+    job.deadline_us = now_us + static_cast<int64_t>(interval_us);
+  }
+
+  job.run = [self = shared_from_this(), frame,
+             rois = std::vector(rois.begin(), rois.end()), now_us] {
+    try {
+      self->encode(frame, rois, now_us);
+      self->encode_failed_ = false;
+    } catch (const std::exception &e) {
+      // The stream picks back up on the next frame that does work
+      LOG_WARN_EVERY(1000, "dropped frame for {}: {}",
+                     self->info().unique_name, e.what());
+      self->encode_failed_ = true;
+    }
+  };
+  EncodeScheduler::Default().submit(std::move(job));
+}
+
+/**
+ * Measure the input frame rate, and note the frame size. Returns the frame
+ * rate estimate. Called with mutex_ held.
+ */
+double CameraStream::measure_input(int64_t now_us, int width, int height) {
+  // Ignore long gaps (camera restarting, pipeline switching) rather than
+  // letting them drag the estimate down
+  if (last_frame_us_ >= 0) {
+    const int64_t dt_us = now_us - last_frame_us_;
+    if (dt_us > 0 && dt_us < 1'000'000) {
+      const double fps = 1e6 / dt_us;
+      fps_estimate_ = fps_estimate_ > 0 ? 0.9 * fps_estimate_ + 0.1 * fps : fps;
+    }
+  }
+  last_frame_us_ = now_us;
+
+  info_.width = width;
+  info_.height = height;
+  info_.fps = static_cast<int>(std::lround(fps_estimate_));
+  return fps_estimate_;
+}
+
+void CameraStream::publish_encoded(std::span<const uint8_t> au, int width,
+                                   int height, int64_t captured_us) {
+  const int64_t now_us = captured_us >= 0 ? captured_us : av_gettime();
+
+  std::scoped_lock media{media_mutex_};
+  LocalSharing local;
+  bool first_frame;
+  {
+    std::scoped_lock lock{mutex_};
+    measure_input(now_us, width, height);
+    sending_to_ = subscribers_;
+    local = info_.local;
+    first_frame = !encoder_ready_;
+  }
+
+  if (!std::exchange(passthrough_, true)) {
+    // Whatever publish() had going is no use now
+    pipeline_.reset();
+    abandon_next_pipeline();
+  }
+  reap_abandoned_pipelines();
+  if (time_origin_us_ < 0)
+    time_origin_us_ = now_us;
+  // Keyframe requests from local readers can't be done anything about; they
+  // wait for the camera's next one
+  update_local_rings(local);
+
+  const bool keyframe = scan(au);
+  const int64_t pts = (now_us - time_origin_us_) * 90'000 / 1'000'000;
+  cache_gop(au, pts, keyframe);
+  if (first_frame)
+    notify_ready();
+  deliver(au, pts, keyframe);
+  encode_failed_ = false;
+}
+
+void CameraStream::encode(const cv::Mat &frame,
+                          std::span<const RegionOfInterest> rois,
+                          int64_t now_us) {
+  std::scoped_lock media{media_mutex_};
+  if (std::exchange(passthrough_, false)) {
+    gop_cache_frames_ = 0;
+    gop_cache_bytes_ = 0;
+  }
+
+  EncoderSettings settings;
+  LocalSharing local;
+  double fps_estimate;
+  bool settings_changed, keyframe_needed;
+  {
+    std::scoped_lock lock{mutex_};
+    sending_to_ = subscribers_;
+    fps_estimate = fps_estimate_;
+    settings = info_.encoder;
+    local = info_.local;
+    settings_changed = std::exchange(settings_changed_, false);
+    keyframe_needed = std::exchange(keyframe_needed_, false);
+  }
+
+  if (time_origin_us_ < 0)
+    time_origin_us_ = now_us;
+  reap_abandoned_pipelines();
+
+  // ── Local readers ──────────────────────────────────────────────────────
+  // A new encoded ring needs an IDR to start from, as do readers that ask
+  if (update_local_rings(local))
+    keyframe_needed = true;
+  if (encoded_ring_ && encoded_ring_->keyframe_requested())
+    keyframe_needed = true;
+  if (raw_ring_)
+    share_raw(frame, now_us, local.mode);
+
+  const bool watched = !sending_to_.empty() || encoded_ring_;
+  if (!watched && !keep_warm_) {
+    // Only worth the encoder while somebody's watching
+    if (pipeline_ || next_pipeline_.valid()) {
+      pipeline_.reset();
+      abandon_next_pipeline();
+      std::scoped_lock lock{mutex_};
+      encoder_ready_ = false;
+    }
+    return;
+  }
+
+  // ── Keep an encoder open at the camera's size, watched or not ──────────
+  // Opening one happens in the background, so the first viewer doesn't have
+  // to wait for it and encode workers never do. Frames that arrive before the
+  // very first one is ready are dropped.
+  const bool first_open = !pipeline_;
+  bool update_pacing = settings_changed;
+  if (follow_resolution(frame, settings, fps_estimate, now_us)) {
+    // Brand new encoder, which starts with an IDR anyway. Settings may have
+    // changed while it was opening.
+    update_pacing = true;
+    keyframe_needed = false;
+    settings_changed = true;
+  }
+  if (!pipeline_)
+    return;
+  if (first_open)
+    notify_ready();
+
+  const bool fps_drifted = settings.fps == 0 && fps_estimate > 0 &&
+                           std::abs(pipeline_->fps() - fps_estimate) >
+                               FPS_DRIFT_TOLERANCE * fps_estimate;
+  if (settings_changed || fps_drifted)
+    pipeline_->reconfigure(settings, fps_estimate);
+
+  // No point encoding for nobody. The encoder stays open though, and the
+  // subscribe that ends this asks for a keyframe.
+  if (!watched)
+    return;
+
+  if (keyframe_needed)
+    pipeline_->request_keyframe();
+
+  if (!rois.empty() && !pipeline_->honors_rois() &&
+      !std::exchange(rois_ignored_logged_, true)) {
+    LOG_WARN("{}'s encoder can't use regions of interest, ignoring them",
+             info_.unique_name);
+  }
+
+  if (update_pacing) {
+    PacingSettings pacing{.bitrate = settings.bitrate,
+                          .fps = static_cast<int>(pipeline_->fps())};
+    for (auto &sub : sending_to_) {
+      sub->sender->set_pacing(pacing);
+      sub->sender->set_temporal_layers(settings.temporal_layers);
+    }
+  }
+
+  if (frame.cols == pipeline_->width() && frame.rows == pipeline_->height()) {
+    pipeline_->handle_frame(frame, rois, now_us);
+  } else {
+    // Stretch to the size clients are currently decoding at
+    const double sx = static_cast<double>(pipeline_->width()) / frame.cols;
+    const double sy = static_cast<double>(pipeline_->height()) / frame.rows;
+    cv::resize(frame, rescaled_,
+               cv::Size(pipeline_->width(), pipeline_->height()), 0, 0,
+               cv::INTER_AREA);
+    rescaled_rois_.clear();
+    for (const auto &roi : rois) {
+      const cv::Rect &r = roi.rect;
+      rescaled_rois_.push_back(
+          {cv::Rect(static_cast<int>(r.x * sx), static_cast<int>(r.y * sy),
+                    static_cast<int>(std::ceil(r.width * sx)),
+                    static_cast<int>(std::ceil(r.height * sy))),
+           roi.quality_offset});
+    }
+    pipeline_->handle_frame(rescaled_, rescaled_rois_, now_us);
+  }
+}
+
+std::unique_ptr<FfmpegRtpPipeline>
+CameraStream::make_pipeline(int width, int height,
+                            const EncoderSettings &settings, double fps) {
+  return std::make_unique<FfmpegRtpPipeline>(
+      info_.codec, width, height, settings, fps,
+      [this](std::span<const uint8_t> au, int64_t pts, bool keyframe) {
+        // Only keyframes carry parameter sets
+        if (keyframe)
+          scan(au);
+        deliver(au, pts, keyframe);
+      },
+      time_origin_us_);
+}
+
+/**
+ * Open or close the shared memory rings to match `local`. Returns true if the
+ * encoded ring was just opened.
+ */
+bool CameraStream::update_local_rings(const LocalSharing &local) {
+  if (!local.raw)
+    raw_ring_.reset();
+  if (!local.encoded) {
+    encoded_ring_.reset();
+    return false;
+  }
+  if (encoded_ring_)
+    return false;
+
+  const char *codec = info_.codec == VideoCodec::H264 ? "h264" : "hevc";
+  try {
+    encoded_ring_ = std::make_unique<ShmRingWriter>(
+        ShmRingName(info_.unique_name, ShmRingKind::ENCODED, codec),
+        ShmRingKind::ENCODED, ENCODED_RING_BYTES, ENCODED_RING_SLOTS, codec,
+        local.mode);
+  } catch (const std::exception &e) {
+    // Don't try again every frame
+    LOG_WARN("not sharing {} locally: {}", info_.unique_name, e.what());
+    std::scoped_lock lock{mutex_};
+    info_.local.encoded = false;
+    return false;
+  }
+  return true;
+}
+
+/** Copy the frame into the raw ring, packed (no row padding) */
+void CameraStream::share_raw(const cv::Mat &frame, int64_t now_us,
+                             mode_t mode) {
+  if (frame.empty())
+    return;
+  const size_t row_bytes = frame.cols * frame.elemSize();
+  const size_t size = row_bytes * frame.rows;
+
+  // Readers see the old ring close, and attach again to get the new size
+  if (!raw_ring_ || raw_ring_->data_size() != size * RAW_RING_FRAMES) {
+    raw_ring_.reset();
+    try {
+      raw_ring_ = std::make_unique<ShmRingWriter>(
+          ShmRingName(info_.unique_name, ShmRingKind::RAW), ShmRingKind::RAW,
+          size * RAW_RING_FRAMES, RAW_RING_FRAMES, "", mode);
+    } catch (const std::exception &e) {
+      LOG_WARN("not sharing {} frames locally: {}", info_.unique_name,
+               e.what());
+      std::scoped_lock lock{mutex_};
+      info_.local.raw = false;
+      return;
+    }
+  }
+
+  auto dest = raw_ring_->reserve(size);
+  cv::Mat packed(frame.rows, frame.cols, frame.type(), dest.data(), row_bytes);
+  frame.copyTo(packed);
+  raw_ring_->commit({.data = dest,
+                     .timestamp_us = now_us,
+                     .width = frame.cols,
+                     .height = frame.rows,
+                     .stride = static_cast<int>(row_bytes),
+                     .cv_type = frame.type()});
+}
+
+void CameraStream::notify_ready() {
+  std::vector<ReadyWaiter> waiters;
+  {
+    std::scoped_lock lock{mutex_};
+    encoder_ready_ = true;
+    waiters.swap(ready_waiters_);
+  }
+  for (auto &waiter : waiters)
+    waiter.on_ready();
+}
+
+/**
+ * Swap in an encoder for the frame's size once one is ready, starting one in
+ * the background if need be (including when there's no encoder at all yet).
+ * Opening an encoder can take a good fraction of a second (nvenc especially),
+ * which we don't want to spend with a worker stalled (holding up other
+ * streams too) and clients staring at a frozen picture, so nothing here waits
+ * on one; not even one we've given up on. Returns true if the pipeline was
+ * swapped.
+ *
+ * While the new one opens, the old one still holds its hardware session, so
+ * with none spare the new one opens on software. Swapping closes the old
+ * one, and the new one takes its session over on its first frame (see
+ * FfmpegRtpPipeline), at the cost of reopening there.
+ */
+bool CameraStream::follow_resolution(const cv::Mat &frame,
+                                     const EncoderSettings &settings,
+                                     double fps, int64_t now_us) {
+  const bool size_changed = !pipeline_ || frame.cols != pipeline_->width() ||
+                            frame.rows != pipeline_->height();
+  const bool stale = next_pipeline_.valid() && (next_width_ != frame.cols ||
+                                                next_height_ != frame.rows);
+
+  // Changed again (or back) before the last one was ready
+  if (stale)
+    abandon_next_pipeline();
+  if (!size_changed)
+    return false;
+
+  if (!next_pipeline_.valid() && now_us >= retry_after_us_) {
+    if (pipeline_) {
+      LOG_INFO("Stream {} changing resolution {}x{} -> {}x{}",
+               info().unique_name, pipeline_->width(), pipeline_->height(),
+               frame.cols, frame.rows);
+    }
+    next_width_ = frame.cols;
+    next_height_ = frame.rows;
+    next_pipeline_ = std::async(
+        std::launch::async,
+        [this, w = frame.cols, h = frame.rows, settings, fps] {
+          return make_pipeline(w, h, settings, fps);
+        });
+  }
+
+  if (!next_pipeline_.valid() ||
+      next_pipeline_.wait_for(std::chrono::seconds(0)) !=
+      std::future_status::ready)
+    return false;
+
+  try {
+    pipeline_ = next_pipeline_.get();
+  } catch (const std::exception &e) {
+    // Keep going at the old size, and try again in a bit
+    LOG_WARN("couldn't open encoder at {}x{}: {}", next_width_, next_height_,
+             e.what());
+    retry_after_us_ = now_us + RESOLUTION_RETRY_US;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Give up on the encoder being opened in the background. Dropping its future
+ * would wait for it to finish opening, so it's kept until it has.
+ */
+void CameraStream::abandon_next_pipeline() {
+  if (next_pipeline_.valid())
+    abandoned_pipelines_.push_back(std::move(next_pipeline_));
+}
+
+/** Close any abandoned encoders that have finished opening */
+void CameraStream::reap_abandoned_pipelines() {
+  std::erase_if(abandoned_pipelines_, [](auto &pending) {
+    if (pending.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready)
+      return false;
+    try {
+      pending.get();
+    } catch (const std::exception &) {
+      // Not wanted anyway
+    }
+    return true;
+  });
+}
+
+/**
+ * Note any parameter sets in an access unit, for the SDP. Returns whether
+ * it's a keyframe.
+ */
+bool CameraStream::scan(std::span<const uint8_t> au) {
+  const auto found = ScanAccessUnit(info_.codec, au, parameter_sets_);
+  if (found.new_parameter_sets) {
+    std::scoped_lock lock{mutex_};
+    info_.parameter_sets = parameter_sets_;
+  }
+  return found.keyframe;
+}
+
+void CameraStream::cache_gop(std::span<const uint8_t> au, int64_t pts,
+                             bool keyframe) {
+  if (keyframe) {
+    gop_cache_frames_ = 0;
+    gop_cache_bytes_ = 0;
+  } else if (gop_cache_frames_ == 0) {
+    return; // Nothing to start decoding from until the next keyframe
+  }
+
+  if (gop_cache_bytes_ + au.size() > GOP_CACHE_BYTES) {
+    // New subscribers will have to wait for the next keyframe after all
+    gop_cache_frames_ = 0;
+    gop_cache_bytes_ = 0;
+    return;
+  }
+  if (gop_cache_frames_ == gop_cache_.size())
+    gop_cache_.emplace_back();
+  auto &cached = gop_cache_[gop_cache_frames_++];
+  cached.data.assign(au.begin(), au.end());
+  cached.pts = pts;
+  gop_cache_bytes_ += au.size();
+}
+
+void CameraStream::deliver(std::span<const uint8_t> au, int64_t pts,
+                           bool keyframe) {
+  for (auto &sub : sending_to_) {
+    if (!sub->got_keyframe) {
+      if (passthrough_ && !keyframe && gop_cache_frames_ > 0) {
+        // Catch them up from the camera's last keyframe, rather than have
+        // them wait for its next. The cache ends with this access unit.
+        for (size_t i = 0; i < gop_cache_frames_; i++)
+          sub->sender->send_access_unit(gop_cache_[i].data, gop_cache_[i].pts);
+        sub->got_keyframe = true;
+        continue;
+      }
+      if (!keyframe)
+        continue;
+      sub->got_keyframe = true;
+    }
+    sub->sender->send_access_unit(au, pts);
+  }
+
+  if (encoded_ring_) {
+    const int64_t timestamp_us = time_origin_us_ + pts * 1'000'000 / 90'000;
+    if (!encoded_ring_->write(
+            {.data = au, .timestamp_us = timestamp_us, .keyframe = keyframe})) {
+      LOG_WARN_EVERY(1000, "{} byte frame doesn't fit in {}", au.size(),
+                     encoded_ring_->name());
+    }
+  }
+}
@@ -0,0 +1,226 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include "FfmpegRtpPipe.hpp"
+#include "FlexFec.hpp"
+#include "RtpSender.hpp"
+#include "ShmRing.hpp"
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+/** What to publish to same-host readers over shared memory; see ShmRing */
+struct LocalSharing {
+  // Encoded access units, in "/hevc-meme.<name>.<codec>"
+  bool encoded = false;
+  // Frames as published, before encoding, in "/hevc-meme.<name>.raw"
+  bool raw = false;
+  // Permissions of the rings, from when they're (re)created. The default
+  // keeps out other users; 0660 lets in our group too.
+  mode_t mode = 0600;
+};
+
+struct CameraStreamInfo {
+  // globally unique name for this stream, used in RTSP URL. Should
+  // differentiate between input and output
+  std::string unique_name;
+  VideoCodec codec = VideoCodec::HEVC;
+
+  int width = 0;
+  int height = 0;
+  // Measured from the rate frames are published at
+  int fps = 0;
+  // Encoded ahead of lower priority streams when encoders are busy
+  int priority = 0;
+
+  EncoderSettings encoder;
+  // Applied to clients at SETUP
+  FecSettings fec;
+  LocalSharing local;
+
+  // The latest seen in the stream, for the SDP. Empty until the first
+  // keyframe.
+  ParameterSets parameter_sets;
+};
+
+/**
+ * Everything for one published camera: a single encoder shared by every
+ * client watching it, and the RTP senders those clients are subscribed with.
+ *
+ * publish() runs on whatever thread the camera frames come from, and just
+ * queues the frame: encoding and sending happen on the EncodeScheduler's
+ * workers, one frame at a time per stream. Everything else may be called from
+ * any thread (in practice, the RTSP event loop and Java).
+ *
+ * With keep_warm, the encoder is opened in the background as soon as frames
+ * start coming in, and kept open (but idle) while nobody is watching, so
+ * clients never wait on encoder setup. Otherwise it's only open while someone
+ * is subscribed.
+ *
+ * The camera may change resolution at any time. A new encoder is opened for
+ * the new size in the background while frames are scaled to fit the old one,
+ * then swapped in; its first frame is an IDR carrying the new parameter sets.
+ * Clients keep their RTP session (same SSRC, sequence and timestamp clock)
+ * throughout, so all they see is the picture changing size.
+ *
+ * The stream can also be shared with other processes on this machine through
+ * shared memory rings (see set_local_sharing). An encoded ring counts as
+ * someone watching, since there's no telling whether anyone's reading it.
+ *
+ * Cameras that encode for themselves can skip all that with publish_encoded,
+ * which sends their access units on as they are. We can't ask those cameras
+ * for a keyframe, so the stream keeps everything since the last one (the GOP
+ * cache) to get new subscribers started straight away.
+ */
+class CameraStream : public std::enable_shared_from_this<CameraStream> {
+public:
+  CameraStream(std::string name, VideoCodec codec, bool keep_warm);
+  ~CameraStream();
+  CameraStream(const CameraStream &) = delete;
+  CameraStream &operator=(const CameraStream &) = delete;
+
+  /**
+   * Queue a frame to be encoded and sent to everyone subscribed. rois (in
+   * frame coordinates) get more of the bitrate; see RegionOfInterest. The
+   * frame is encoded later, so its pixels mustn't be changed afterwards (pass
+   * a clone). Must be owned by a shared_ptr. captured_us (av_gettime()
+   * clock) is when the frame was taken, if not just now.
+   */
+  void publish(const cv::Mat &frame,
+               std::span<const RegionOfInterest> rois = {},
+               int64_t captured_us = -1);
+
+  /**
+   * Send an access unit that's already encoded (Annex-B, in this stream's
+   * codec) to everyone subscribed, on this thread, without an encoder. width
+   * and height are the picture's. Closes the encoder if publish() had one
+   * open. captured_us is as for publish().
+   */
+  void publish_encoded(std::span<const uint8_t> au, int width, int height,
+                       int64_t captured_us = -1);
+
+  /** Whether the last frame encoded for this stream failed to */
+  bool encode_failed() const { return encode_failed_; }
+
+  using ReadyCallback = std::function<void()>;
+
+  /**
+   * Start sending to this sender. on_ready is called once the stream's
+   * encoder is open: straight away (on this thread) if it already is,
+   * otherwise later from an encode worker (or the thread calling
+   * publish_encoded). Unless the sender's unsubscribed first, in which case
+   * it's never called.
+   */
+  void subscribe(std::shared_ptr<RtpSender> sender,
+                 ReadyCallback on_ready = {});
+  void unsubscribe(const std::shared_ptr<RtpSender> &sender);
+
+  /** Takes effect live, from the next frame or the next IDR */
+  void configure(const EncoderSettings &settings);
+  void set_fec(const FecSettings &fec);
+  /** See CameraStreamInfo::priority */
+  void set_priority(int priority);
+  /** Takes effect from the next frame */
+  void set_local_sharing(const LocalSharing &local);
+
+  CameraStreamInfo info() const;
+
+private:
+  struct Subscriber {
+    std::shared_ptr<RtpSender> sender;
+    // Nothing is decodable until an IDR, so don't bother sending before one
+    bool got_keyframe = false;
+  };
+
+  struct ReadyWaiter {
+    std::shared_ptr<RtpSender> sender;
+    ReadyCallback on_ready;
+  };
+
+  struct CachedAccessUnit {
+    std::vector<uint8_t> data;
+    int64_t pts;
+  };
+
+  double measure_input(int64_t now_us, int width, int height);
+  void encode(const cv::Mat &frame, std::span<const RegionOfInterest> rois,
+              int64_t now_us);
+  bool scan(std::span<const uint8_t> au);
+  void deliver(std::span<const uint8_t> au, int64_t pts, bool keyframe);
+  void cache_gop(std::span<const uint8_t> au, int64_t pts, bool keyframe);
+  PacingSettings pacing() const;
+  void notify_ready();
+  std::unique_ptr<FfmpegRtpPipeline>
+  make_pipeline(int width, int height, const EncoderSettings &settings,
+                double fps);
+  bool follow_resolution(const cv::Mat &frame, const EncoderSettings &settings,
+                         double fps, int64_t now_us);
+  void abandon_next_pipeline();
+  void reap_abandoned_pipelines();
+  bool update_local_rings(const LocalSharing &local);
+  void share_raw(const cv::Mat &frame, int64_t now_us, mode_t mode);
+
+  const bool keep_warm_;
+
+  mutable std::mutex mutex_;
+  CameraStreamInfo info_;
+  std::vector<std::shared_ptr<Subscriber>> subscribers_;
+  bool settings_changed_ = false;
+  bool keyframe_needed_ = false;
+  bool encoder_ready_ = false;
+  std::vector<ReadyWaiter> ready_waiters_;
+  int64_t last_frame_us_ = -1;
+  double fps_estimate_ = 0;
+
+  std::atomic_bool encode_failed_{false};
+
+  // Held by encode() and publish_encoded(), so they can't overlap while a
+  // stream switches from one to the other. Uncontended otherwise.
+  std::mutex media_mutex_;
+
+  // Only touched with media_mutex_ held
+  std::unique_ptr<FfmpegRtpPipeline> pipeline_;
+  std::vector<std::shared_ptr<Subscriber>> sending_to_;
+  // Shared by every pipeline we open, so RTP timestamps never jump backwards
+  int64_t time_origin_us_ = -1;
+  // Warned that the encoder ignores ROIs, which we only do once
+  bool rois_ignored_logged_ = false;
+
+  // Encoder being opened in the background: the first one, or one for a new
+  // resolution
+  std::future<std::unique_ptr<FfmpegRtpPipeline>> next_pipeline_;
+  int next_width_ = 0;
+  int next_height_ = 0;
+  int64_t retry_after_us_ = 0;
+  // Ones we gave up on (the size changed again, or nobody's watching) that
+  // are still opening. Closed once they're open, on a later frame; only the
+  // destructor waits for them.
+  std::vector<std::future<std::unique_ptr<FfmpegRtpPipeline>>>
+      abandoned_pipelines_;
+  // Frames (and their ROIs) scaled to the old size until it's ready
+  cv::Mat rescaled_;
+  std::vector<RegionOfInterest> rescaled_rois_;
+
+  // Shared memory rings for local readers, if enabled
+  std::unique_ptr<ShmRingWriter> encoded_ring_;
+  std::unique_ptr<ShmRingWriter> raw_ring_;
+
+  ParameterSets parameter_sets_;
+  // Fed by publish_encoded rather than an encoder of ours
+  bool passthrough_ = false;
+  // Passthrough only: the last keyframe and everything after it, in the
+  // first gop_cache_frames_ entries (the rest are kept for their buffers).
+  // Empty when it's grown past GOP_CACHE_BYTES, until the next keyframe.
+  std::vector<CachedAccessUnit> gop_cache_;
+  size_t gop_cache_frames_ = 0;
+  size_t gop_cache_bytes_ = 0;
+};
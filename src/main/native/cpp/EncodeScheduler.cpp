@@ -0,0 +1,145 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "EncodeScheduler.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <utility>
+
+// The scheduler this thread is a worker of, if any
+static thread_local const EncodeScheduler *worker_of = nullptr;
+
+EncodeScheduler::EncodeScheduler(const EncodeSchedulerSettings &settings) {
+  std::scoped_lock lock{config_mutex_};
+  start(settings);
+}
+
+EncodeScheduler::~EncodeScheduler() {
+  std::scoped_lock lock{config_mutex_};
+  stop();
+}
+
+EncodeScheduler &EncodeScheduler::Default() {
+  static EncodeScheduler scheduler;
+  return scheduler;
+}
+
+void EncodeScheduler::configure(const EncodeSchedulerSettings &settings) {
+  if (worker_of == this) {
+    LOG_ERROR("can't reconfigure encode workers from an encode job");
+    return;
+  }
+  std::scoped_lock lock{config_mutex_};
+  stop();
+  start(settings);
+}
+
+void EncodeScheduler::start(const EncodeSchedulerSettings &settings) {
+  settings_ = settings;
+  settings_.workers = std::max(settings_.workers, 1);
+  {
+    std::scoped_lock lock{mutex_};
+    stopping_ = false;
+  }
+
+  for (int i = 0; i < settings_.workers; i++) {
+    workers_.emplace_back([this, i] { run_worker(i); });
+
+    if (settings_.cores.empty())
+      continue;
+    const int core = settings_.cores[i % settings_.cores.size()];
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    const int err = pthread_setaffinity_np(workers_.back().native_handle(),
+                                           sizeof(cpus), &cpus);
+    if (err != 0) {
+      LOG_WARN("couldn't pin encode worker {} to CPU {}: {}", i, core,
+               std::strerror(err));
+    }
+  }
+}
+
+void EncodeScheduler::stop() {
+  {
+    std::scoped_lock lock{mutex_};
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto &worker : workers_)
+    worker.join();
+  workers_.clear();
+}
+
+void EncodeScheduler::submit(Job job) {
+  {
+    std::scoped_lock lock{mutex_};
+    auto it = std::find_if(waiting_.begin(), waiting_.end(),
+                           [&](const Job &j) { return j.key == job.key; });
+    if (it != waiting_.end())
+      *it = std::move(job); // Never got to the old frame, so drop it
+    else
+      waiting_.push_back(std::move(job));
+  }
+  cv_.notify_one();
+}
+
+void EncodeScheduler::wait_idle(const void *key) {
+  std::unique_lock lock{mutex_};
+  idle_cv_.wait(lock, [&] {
+    return std::none_of(waiting_.begin(), waiting_.end(),
+                        [&](const Job &j) { return j.key == key; }) &&
+           std::find(running_.begin(), running_.end(), key) == running_.end();
+  });
+}
+
+// Highest priority, then earliest deadline, among streams nobody's encoding
+std::vector<EncodeScheduler::Job>::iterator EncodeScheduler::next_runnable() {
+  auto best = waiting_.end();
+  for (auto it = waiting_.begin(); it != waiting_.end(); ++it) {
+    if (std::find(running_.begin(), running_.end(), it->key) !=
+        running_.end())
+      continue;
+    if (best == waiting_.end() || it->priority > best->priority ||
+        (it->priority == best->priority &&
+         it->deadline_us < best->deadline_us))
+      best = it;
+  }
+  return best;
+}
+
+void EncodeScheduler::run_worker(int index) {
+  pthread_setname_np(pthread_self(),
+                     ("encode-" + std::to_string(index)).c_str());
+  worker_of = this;
+
+  std::unique_lock lock{mutex_};
+  for (;;) {
+    auto next = waiting_.end();
+    cv_.wait(lock, [&] {
+      next = next_runnable();
+      return stopping_ || next != waiting_.end();
+    });
+    if (stopping_)
+      return;
+
+    Job job = std::move(*next);
+    waiting_.erase(next);
+    running_.push_back(job.key);
+
+    lock.unlock();
+    job.run();
+    lock.lock();
+
+    std::erase(running_, job.key);
+    // That stream may have a frame waiting behind this one
+    cv_.notify_all();
+    idle_cv_.notify_all();
+  }
+}
@@ -0,0 +1,92 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct EncodeSchedulerSettings {
+  // Worker threads, i.e. frames encoded at once across all streams
+  int workers = 2;
+  // CPUs to pin workers to, round robin. Empty leaves them unpinned.
+  std::vector<int> cores;
+};
+
+/**
+ * Encodes frames for every stream on a fixed pool of worker threads, instead
+ * of on whichever thread published them, so the number of encodes in flight
+ * (and the cores they run on) doesn't depend on how many cameras there are.
+ *
+ * Each stream has at most one frame waiting. A newer one replaces it, so a
+ * stream that falls behind drops frames rather than building up latency.
+ * Workers take the waiting frame with the highest priority, then the earliest
+ * deadline, so the driver camera goes ahead of the logging camera when there's
+ * contention. A stream's frames are never encoded two at a time, and always in
+ * order.
+ */
+class EncodeScheduler {
+public:
+  struct Job {
+    // Identifies the stream; jobs with the same key replace each other and
+    // never run concurrently
+    const void *key = nullptr;
+    // Higher goes first
+    int priority = 0;
+    // av_gettime() microseconds by which this should have been encoded
+    int64_t deadline_us = 0;
+    // Does the encode. Shouldn't throw.
+    std::function<void()> run;
+  };
+
+  explicit EncodeScheduler(const EncodeSchedulerSettings &settings = {});
+  ~EncodeScheduler();
+  EncodeScheduler(const EncodeScheduler &) = delete;
+  EncodeScheduler &operator=(const EncodeScheduler &) = delete;
+
+  /** Queue a job, replacing the one waiting for the same key if any */
+  void submit(Job job);
+
+  /**
+   * Block until there's nothing waiting or running for key, e.g. to feed a
+   * stream frames exactly as fast as it encodes them, without dropping any.
+   */
+  void wait_idle(const void *key);
+
+  /**
+   * Replace the worker pool. Frames being encoded are finished first; frames
+   * waiting stay queued for the new workers. Calls from different threads
+   * take turns. Refused (and logged) from a job, since its worker can't wait
+   * for itself to finish.
+   */
+  void configure(const EncodeSchedulerSettings &settings);
+
+  /** Process-wide scheduler, started on first use */
+  static EncodeScheduler &Default();
+
+private:
+  void start(const EncodeSchedulerSettings &settings);
+  void stop();
+  void run_worker(int index);
+  std::vector<Job>::iterator next_runnable();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Signalled whenever a job finishes, for wait_idle
+  std::condition_variable idle_cv_;
+  bool stopping_ = false;
+  std::vector<Job> waiting_;
+  // Keys of jobs being run right now
+  std::vector<const void *> running_;
+
+  // Held while replacing the pool, for everything below
+  std::mutex config_mutex_;
+  EncodeSchedulerSettings settings_;
+  std::vector<std::thread> workers_;
+};
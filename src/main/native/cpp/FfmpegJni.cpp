@@ -5,7 +5,10 @@
 
 #include "org_photonvision_ffmpeg_FfmpegRtspHandler.h"
 
+#include "Logging.hpp"
 #include "RtspClientsMap.hpp"
+#include <algorithm>
+#include <vector>
 #include <opencv2/core.hpp>
 
 /*
@@ -38,3 +41,350 @@ Java_org_photonvision_ffmpeg_FfmpegRtspHandler_putFrame
 
   return PublishCameraFrame(cameraNameStr, *mat);
 }
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    putFrameWithRois
+ * Signature: (Ljava/lang/String;J[I[F)Z
+ */
+JNIEXPORT jboolean JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_putFrameWithRois
+  (JNIEnv *env, jclass, jstring cameraName, jlong matPtr, jintArray roiRects,
+   jfloatArray roiQualityOffsets)
+{
+  cv::Mat *mat = reinterpret_cast<cv::Mat *>(matPtr);
+
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  // x, y, width, height for each region, and one offset per region
+  std::vector<RegionOfInterest> rois;
+  if (roiRects && roiQualityOffsets) {
+    const jsize count = std::min(env->GetArrayLength(roiRects) / 4,
+                                 env->GetArrayLength(roiQualityOffsets));
+    std::vector<jint> rects(count * 4);
+    std::vector<jfloat> offsets(count);
+    env->GetIntArrayRegion(roiRects, 0, count * 4, rects.data());
+    env->GetFloatArrayRegion(roiQualityOffsets, 0, count, offsets.data());
+
+    rois.reserve(count);
+    for (jsize i = 0; i < count; i++) {
+      rois.push_back({cv::Rect(rects[i * 4], rects[i * 4 + 1],
+                               rects[i * 4 + 2], rects[i * 4 + 3]),
+                      offsets[i]});
+    }
+  }
+
+  return PublishCameraFrame(cameraNameStr, *mat, rois);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    putEncodedFrame
+ * Signature: (Ljava/lang/String;I[BII)Z
+ */
+JNIEXPORT jboolean JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_putEncodedFrame
+  (JNIEnv *env, jclass, jstring cameraName, jint codec, jbyteArray data,
+   jint width, jint height)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  // Not a critical section: sending can block on the stream's lock
+  const jsize length = env->GetArrayLength(data);
+  jbyte *bytes = env->GetByteArrayElements(data, nullptr);
+  const bool sent = PublishEncodedFrame(
+      cameraNameStr, codec == 1 ? VideoCodec::H264 : VideoCodec::HEVC,
+      {reinterpret_cast<const uint8_t *>(bytes), static_cast<size_t>(length)},
+      width, height);
+  env->ReleaseByteArrayElements(data, bytes, JNI_ABORT);
+  return sent;
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    setSliceCount
+ * Signature: (Ljava/lang/String;I)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_setSliceCount
+  (JNIEnv *env, jclass, jstring cameraName, jint slices)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  SetCameraStreamSlices(cameraNameStr, slices);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    setTemporalLayers
+ * Signature: (Ljava/lang/String;I)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_setTemporalLayers
+  (JNIEnv *env, jclass, jstring cameraName, jint layers)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  SetCameraStreamTemporalLayers(cameraNameStr, layers);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    setFecProtection
+ * Signature: (Ljava/lang/String;IIZ)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_setFecProtection
+  (JNIEnv *env, jclass, jstring cameraName, jint groupSize, jint interleave,
+   jboolean adaptive)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  SetCameraStreamFec(cameraNameStr, FecSettings{
+                                        .group_size = groupSize,
+                                        .interleave = interleave,
+                                        .adaptive = static_cast<bool>(adaptive),
+                                    });
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    setLocalSharing
+ * Signature: (Ljava/lang/String;ZZ)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_setLocalSharing
+  (JNIEnv *env, jclass, jstring cameraName, jboolean encoded, jboolean raw)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  SetCameraStreamLocalSharing(cameraNameStr,
+                              LocalSharing{
+                                  .encoded = static_cast<bool>(encoded),
+                                  .raw = static_cast<bool>(raw),
+                              });
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    setEncodeWorkers
+ * Signature: (I[I)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_setEncodeWorkers
+  (JNIEnv *env, jclass, jint workers, jintArray cores)
+{
+  EncodeSchedulerSettings settings;
+  settings.workers = std::max<int>(workers, 1);
+  if (cores) {
+    const jsize count = env->GetArrayLength(cores);
+    std::vector<jint> values(count);
+    env->GetIntArrayRegion(cores, 0, count, values.data());
+    settings.cores.assign(values.begin(), values.end());
+  }
+  ConfigureEncodeWorkers(settings);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    setStreamPriority
+ * Signature: (Ljava/lang/String;I)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_setStreamPriority
+  (JNIEnv *env, jclass, jstring cameraName, jint priority)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  SetCameraStreamPriority(cameraNameStr, priority);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    setTextOverlay
+ * Signature: (Ljava/lang/String;[Ljava/lang/String;[I[IDI)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_setTextOverlay
+  (JNIEnv *env, jclass, jstring cameraName, jobjectArray texts,
+   jintArray origins, jintArray colors, jdouble scale, jint thickness)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  // x, y for each line, and one 0xRRGGBB color per line
+  std::vector<OverlayText> lines;
+  if (texts && origins && colors) {
+    const jsize count =
+        std::min({env->GetArrayLength(texts),
+                  env->GetArrayLength(origins) / 2,
+                  env->GetArrayLength(colors)});
+    std::vector<jint> xy(count * 2);
+    std::vector<jint> rgb(count);
+    env->GetIntArrayRegion(origins, 0, count * 2, xy.data());
+    env->GetIntArrayRegion(colors, 0, count, rgb.data());
+
+    for (jsize i = 0; i < count; i++) {
+      auto text = static_cast<jstring>(env->GetObjectArrayElement(texts, i));
+      if (!text)
+        continue;
+      const char *textChars = env->GetStringUTFChars(text, nullptr);
+      lines.push_back({
+          .text = textChars,
+          .origin = {xy[i * 2], xy[i * 2 + 1]},
+          .color = {static_cast<double>(rgb[i] & 0xFF),
+                    static_cast<double>((rgb[i] >> 8) & 0xFF),
+                    static_cast<double>((rgb[i] >> 16) & 0xFF)},
+          .scale = scale,
+          .thickness = thickness,
+      });
+      env->ReleaseStringUTFChars(text, textChars);
+      env->DeleteLocalRef(text);
+    }
+  }
+
+  SetCameraStreamOverlay(cameraNameStr, std::move(lines));
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    configureStream
+ * Signature: (Ljava/lang/String;IIIII)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_configureStream
+  (JNIEnv *env, jclass, jstring cameraName, jint bitrate, jint gop, jint fps,
+   jint rateControl, jint quality)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  RateControl rc;
+  switch (rateControl) {
+  case 1:
+    rc = RateControl::VBR;
+    break;
+  case 2:
+    rc = RateControl::CONSTANT_QUALITY;
+    break;
+  default:
+    rc = RateControl::CBR;
+    break;
+  }
+
+  // Keep whatever slicing was asked for separately
+  auto stream = GetCameraStream(cameraNameStr);
+  EncoderSettings settings = stream ? stream->info().encoder : EncoderSettings{};
+  settings.bitrate = std::max<int>(bitrate, 1);
+  settings.gop = std::max<int>(gop, 1);
+  settings.fps = std::max<int>(fps, 0);
+  settings.rate_control = rc;
+  settings.quality = std::clamp<int>(quality, 0, 51);
+  ConfigureCameraStream(cameraNameStr, settings);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    startRecording
+ * Signature: (Ljava/lang/String;Ljava/lang/String;)Z
+ */
+JNIEXPORT jboolean JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_startRecording
+  (JNIEnv *env, jclass, jstring cameraName, jstring path)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  const char *pathChars = env->GetStringUTFChars(path, nullptr);
+  std::string pathStr(pathChars);
+  env->ReleaseStringUTFChars(path, pathChars);
+
+  return StartCameraStreamRecording(cameraNameStr, pathStr);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    stopRecording
+ * Signature: (Ljava/lang/String;)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_stopRecording
+  (JNIEnv *env, jclass, jstring cameraName)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  StopCameraStreamRecording(cameraNameStr);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    startReplay
+ * Signature: (Ljava/lang/String;Ljava/lang/String;ZZ)Z
+ */
+JNIEXPORT jboolean JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_startReplay
+  (JNIEnv *env, jclass, jstring cameraName, jstring path, jboolean realTime,
+   jboolean loop)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  const char *pathChars = env->GetStringUTFChars(path, nullptr);
+  std::string pathStr(pathChars);
+  env->ReleaseStringUTFChars(path, pathChars);
+
+  ReplaySettings settings;
+  settings.real_time = realTime;
+  settings.loop = loop;
+  return StartCameraStreamReplay(cameraNameStr, pathStr, settings);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    stopReplay
+ * Signature: (Ljava/lang/String;)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_stopReplay
+  (JNIEnv *env, jclass, jstring cameraName)
+{
+  const char *cameraNameChars = env->GetStringUTFChars(cameraName, nullptr);
+  std::string cameraNameStr(cameraNameChars);
+  env->ReleaseStringUTFChars(cameraName, cameraNameChars);
+
+  StopCameraStreamReplay(cameraNameStr);
+}
+
+/*
+ * Class:     org_photonvision_ffmpeg_FfmpegRtspHandler
+ * Method:    setLogLevel
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL
+Java_org_photonvision_ffmpeg_FfmpegRtspHandler_setLogLevel
+  (JNIEnv *, jclass, jint level)
+{
+  SetLogLevel(static_cast<LogLevel>(std::clamp(
+      level, static_cast<jint>(LogLevel::VERBOSE),
+      static_cast<jint>(LogLevel::ERROR))));
+}
@@ -4,17 +4,17 @@
 // project.
 
 #include "FfmpegRtpPipe.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
-#include <cstdio>
 #include <cstring>
-#include <fstream>
+#include <mutex>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <stdexcept>
 #include <string>
-#include <thread>
-
-enum class EncoderType { HEVC_RKMPP, HEVC_NVENC };
-const EncoderType ENCODER_TYPE = EncoderType::HEVC_NVENC;
+#include <utility>
+#include <vector>
 
 static std::string averr(int ret) {
   char buf[AV_ERROR_MAX_STRING_SIZE] = {};
@@ -22,23 +22,141 @@ static std::string averr(int ret) {
   return {buf};
 }
 
-FfmpegRtpPipeline::FfmpegRtpPipeline(int width, int height, std::string url)
-    : width_(width), height_(height), url_(url) {
+// ── Session limits ─────────────────────────────────────────────────────────
+// Indexed by EncoderType
+
+static std::mutex session_mutex;
+static int session_limit[] = {4, 3, -1};
+static int sessions_open[] = {0, 0, 0};
+
+void SetEncoderSessionLimit(EncoderType type, int limit) {
+  std::scoped_lock lock{session_mutex};
+  session_limit[static_cast<int>(type)] = limit;
+}
+
+EncoderSession EncoderSession::TryAcquire(EncoderType type) {
+  std::scoped_lock lock{session_mutex};
+  const int i = static_cast<int>(type);
+  EncoderSession session;
+  if (session_limit[i] >= 0 && sessions_open[i] >= session_limit[i])
+    return session;
+  sessions_open[i]++;
+  session.type_ = type;
+  session.held_ = true;
+  return session;
+}
+
+EncoderSession::~EncoderSession() { release(); }
+
+void EncoderSession::release() {
+  if (!std::exchange(held_, false))
+    return;
+  std::scoped_lock lock{session_mutex};
+  sessions_open[static_cast<int>(type_)]--;
+}
+
+EncoderSession::EncoderSession(EncoderSession &&other) noexcept
+    : type_(other.type_), held_(std::exchange(other.held_, false)) {}
+
+EncoderSession &EncoderSession::operator=(EncoderSession &&other) noexcept {
+  if (this != &other) {
+    release();
+    type_ = other.type_;
+    held_ = std::exchange(other.held_, false);
+  }
+  return *this;
+}
+
+// Rate we'll encode at given what the user asked for and what we're getting
+static double effective_fps(const EncoderSettings &settings,
+                            double input_fps) {
+  if (input_fps <= 0)
+    return settings.fps > 0 ? settings.fps : 30;
+  if (settings.fps > 0)
+    return std::min<double>(settings.fps, input_fps);
+  return input_fps;
+}
+
+FfmpegRtpPipeline::FfmpegRtpPipeline(VideoCodec codec, int width, int height,
+                                     const EncoderSettings &settings,
+                                     double fps, PacketSink sink,
+                                     int64_t time_origin_us)
+    : codec_(codec), width_(width), height_(height), sink_(std::move(sink)),
+      settings_(settings), fps_(effective_fps(settings, fps)),
+      first_frame_time_us(time_origin_us) {
+  open_encoder();
+
+  // ── Allocate frame for encoder input ─────────────────────────────────────
+  enc_frame_ = av_frame_alloc();
+  if (!enc_frame_)
+    throw std::runtime_error("av_frame_alloc failed");
+
+  // We point data[] straight at a cv::Mat in handle_frame, so no
+  // av_frame_get_buffer here
+  enc_frame_->format = enc_ctx_->pix_fmt;
+  enc_frame_->width = width_;
+  enc_frame_->height = height_;
+
+  // ── Allocate packet for encoder output ───────────────────────────────────
+  enc_pkt_ = av_packet_alloc();
+  if (!enc_pkt_)
+    throw std::runtime_error("av_packet_alloc (encoder) failed");
+}
+
+void FfmpegRtpPipeline::open_encoder() {
+  if (backend_ != EncoderType::HEVC_X265 || hardware_wanted_) {
+    if (!session_)
+      session_ = EncoderSession::TryAcquire(ENCODER_TYPE);
+    if (!session_) {
+      if (!hardware_wanted_) {
+        LOG_WARN("out of hardware encoder sessions, encoding {}x{} in "
+                 "software until one's free",
+                 width_, height_);
+      }
+      backend_ = EncoderType::HEVC_X265;
+      hardware_wanted_ = true;
+    } else {
+      try {
+        open_encoder(ENCODER_TYPE);
+        if (hardware_wanted_) {
+          LOG_INFO("got a hardware encoder session, {}x{} off software",
+                   width_, height_);
+        }
+        backend_ = ENCODER_TYPE;
+        hardware_wanted_ = false;
+        return;
+      } catch (const std::exception &e) {
+        // Likely sessions used up by someone else, or no such hardware here.
+        // Either way no point trying again.
+        LOG_WARN("hardware encoder failed ({}), encoding {}x{} in software",
+                 e.what(), width_, height_);
+        session_ = {};
+        backend_ = EncoderType::HEVC_X265;
+        hardware_wanted_ = false;
+      }
+    }
+  }
+  open_encoder(backend_);
+}
 
-  const int BITRATE = 2'000'000; // bps
+void FfmpegRtpPipeline::open_encoder(EncoderType type) {
   std::string encoder_name;
   AVPixelFormat pix_fmt;
 
-  if (ENCODER_TYPE == EncoderType::HEVC_NVENC) {
-    encoder_name = "hevc_nvenc";
+  const bool h264 = codec_ == VideoCodec::H264;
+  if (type == EncoderType::HEVC_NVENC) {
+    encoder_name = h264 ? "h264_nvenc" : "hevc_nvenc";
     pix_fmt = AV_PIX_FMT_BGR0;
+  } else if (type == EncoderType::HEVC_X265) {
+    encoder_name = h264 ? "libx264" : "libx265";
+    pix_fmt = AV_PIX_FMT_YUV420P;
   } else {
-    encoder_name = "hevc_rkmpp";
+    encoder_name = h264 ? "h264_rkmpp" : "hevc_rkmpp";
     pix_fmt = AV_PIX_FMT_BGR24;
   }
 
-  // ── 1. Find and allocate the hevc_rkmpp encoder ──────────────────────────
-  AVCodec *codec = avcodec_find_encoder_by_name(encoder_name.c_str());
+  // ── 1. Find and allocate the encoder ─────────────────────────────────────
+  const AVCodec *codec = avcodec_find_encoder_by_name(encoder_name.c_str());
   if (!codec)
     throw std::runtime_error(encoder_name + " encoder not found");
 
@@ -50,68 +168,192 @@ FfmpegRtpPipeline::FfmpegRtpPipeline(int width, int height, std::string url)
   enc_ctx_->width = width_;
   enc_ctx_->height = height_;
   enc_ctx_->time_base = {1, 90000};
-  enc_ctx_->framerate = {30, 1}; // 30 FPS
+  enc_ctx_->framerate = {static_cast<int>(std::lround(fps_ * 1000)), 1000};
   enc_ctx_->pix_fmt = pix_fmt;
-  enc_ctx_->bit_rate = BITRATE;
-  enc_ctx_->gop_size = 30; // Keyframe every 1 second at 30fps
+  enc_ctx_->bit_rate = settings_.bitrate;
+  enc_ctx_->gop_size = settings_.gop;
+
+  if (settings_.rate_control == RateControl::CBR) {
+    // One frame's worth of VBV buffer keeps frame sizes even
+    enc_ctx_->rc_max_rate = settings_.bitrate;
+    enc_ctx_->rc_buffer_size = static_cast<int>(settings_.bitrate / fps_);
+  } else if (settings_.rate_control == RateControl::VBR) {
+    enc_ctx_->rc_max_rate = 2 * settings_.bitrate;
+  }
+
+  // nvenc maps this onto its slice mode 3 (fixed number of slices per
+  // picture). ffmpeg gives us no way to get at rkmpp's split mode, so there it
+  // only takes effect if the wrapper reads the generic field.
+  if (settings_.slices > 1)
+    enc_ctx_->slices = settings_.slices;
 
   // Try to reduce internal buffering
   AVDictionary *opts = nullptr;
 
-  if (ENCODER_TYPE == EncoderType::HEVC_NVENC) {
+  // H.264 is for clients that can't do HEVC, browsers especially, so stick
+  // to the profile everything decodes. Parameter sets go in-band either way.
+  if (h264)
+    av_dict_set(&opts, "profile", "baseline", 0);
+
+  if (type == EncoderType::HEVC_NVENC) {
     av_dict_set(&opts, "preset", "p1", 0);     // Low latency preset
     av_dict_set(&opts, "tune", "ull", 0);      // Ultra low latency tuning
-    av_dict_set(&opts, "rc", "cbr", 0);        // Constant bitrate
     av_dict_set(&opts, "zerolatency", "1", 0); // No reordering delay
     av_dict_set(&opts, "delay", "0", 0);       // Minimize output delay
     av_dict_set(&opts, "strict_gop", "1", 0);  // Prevent GOP fluctuations
     av_dict_set(&opts, "forced-idr", "1", 0);  // Force keyframes as IDR
-  } else if (ENCODER_TYPE == EncoderType::HEVC_RKMPP) {
+    switch (settings_.rate_control) {
+    case RateControl::CBR:
+      av_dict_set(&opts, "rc", "cbr", 0);
+      break;
+    case RateControl::VBR:
+      av_dict_set(&opts, "rc", "vbr", 0);
+      break;
+    case RateControl::CONSTANT_QUALITY:
+      av_dict_set(&opts, "rc", "constqp", 0);
+      av_dict_set_int(&opts, "qp", settings_.quality, 0);
+      break;
+    }
+  } else if (type == EncoderType::HEVC_X265) {
+    av_dict_set(&opts, "preset", "ultrafast", 0);
+    av_dict_set(&opts, "tune", "zerolatency", 0);
+    // CBR and VBR are both ABR to x265; CBR is just the one with a tight VBV
+    if (settings_.rate_control == RateControl::CONSTANT_QUALITY)
+      av_dict_set_int(&opts, "crf", settings_.quality, 0);
+    std::string params;
+    if (settings_.slices > 1)
+      params += "slices=" + std::to_string(settings_.slices) + ":";
+    if (settings_.temporal_layers > 1 && !h264) {
+      // Fixed dyadic B-pyramid, so every other frame is droppable, then every
+      // other one of those, and so on. x265 assigns the TemporalIds.
+      const int bframes = (1 << (settings_.temporal_layers - 1)) - 1;
+      params += "temporal-layers=" + std::to_string(settings_.temporal_layers) +
+                ":bframes=" + std::to_string(bframes) +
+                ":b-adapt=0:b-pyramid=1:";
+    }
+    if (!params.empty()) {
+      params.pop_back();
+      av_dict_set(&opts, h264 ? "x264-params" : "x265-params", params.c_str(),
+                  0);
+    }
+  } else if (type == EncoderType::HEVC_RKMPP) {
     av_dict_set(&opts, "preset", "ultrafast", 0);
     av_dict_set_int(&opts, "refs", 1, 0);
+    switch (settings_.rate_control) {
+    case RateControl::CBR:
+      av_dict_set(&opts, "rc_mode", "CBR", 0);
+      break;
+    case RateControl::VBR:
+      av_dict_set(&opts, "rc_mode", "VBR", 0);
+      break;
+    case RateControl::CONSTANT_QUALITY:
+      av_dict_set(&opts, "rc_mode", "CQP", 0);
+      av_dict_set_int(&opts, "qp_init", settings_.quality, 0);
+      break;
+    }
+  }
+
+  if (settings_.temporal_layers > 1 &&
+      (h264 || type != EncoderType::HEVC_X265)) {
+    LOG_WARN("{} can't do temporal layers through ffmpeg, every client will "
+             "get every frame",
+             encoder_name);
   }
 
   // ── 3. Open the encoder ───────────────────────────────────────────────────
   int ret = avcodec_open2(enc_ctx_, codec, &opts);
   av_dict_free(&opts);
-  if (ret < 0)
+  if (ret < 0) {
+    avcodec_free_context(&enc_ctx_);
     throw std::runtime_error("avcodec_open2: " + averr(ret));
+  }
 
-  // ── 4. Allocate frame for encoder input ──────────────────────────────────
-  enc_frame_ = av_frame_alloc();
-  if (!enc_frame_)
-    throw std::runtime_error("av_frame_alloc failed");
+  // A fresh encoder always starts on an IDR
+  frames_since_keyframe_ = 0;
+  fresh_encoder_ = true;
+}
 
-  enc_frame_->format = enc_ctx_->pix_fmt;
-  enc_frame_->width = width_;
-  enc_frame_->height = height_;
+void FfmpegRtpPipeline::close_encoder() {
+  // Flush encoder
+  if (enc_ctx_) {
+    avcodec_send_frame(enc_ctx_, nullptr);
+    while (avcodec_receive_packet(enc_ctx_, enc_pkt_) == 0) {
+      write_packet(enc_pkt_);
+      av_packet_unref(enc_pkt_);
+    }
+    avcodec_free_context(&enc_ctx_);
+  }
+}
 
-  // ret = av_frame_get_buffer(enc_frame_, 0);
-  // if (ret < 0)
-  //   throw std::runtime_error("av_frame_get_buffer: " + averr(ret));
-  enc_frame_->format = enc_ctx_->pix_fmt;
-  enc_frame_->width = width_;
-  enc_frame_->height = height_;
+void FfmpegRtpPipeline::reconfigure(const EncoderSettings &settings,
+                                    double input_fps) {
+  const double fps = effective_fps(settings, input_fps);
+  const bool same_fps = std::abs(fps - fps_) < 0.5;
 
-  // ── 5. Allocate packet for encoder output ────────────────────────────────
-  enc_pkt_ = av_packet_alloc();
-  if (!enc_pkt_)
-    throw std::runtime_error("av_packet_alloc (encoder) failed");
-}
+  if (settings == settings_ && same_fps) {
+    // Possibly cancelling a change we hadn't got to yet
+    pending_settings_.reset();
+    return;
+  }
+
+  // nvenc picks up a new average bitrate on the next frame by itself (its
+  // dynamic bitrate support), so that doesn't need a new session
+  EncoderSettings bitrate_only = settings_;
+  bitrate_only.bitrate = settings.bitrate;
+  if (backend_ == EncoderType::HEVC_NVENC && same_fps &&
+      bitrate_only == settings &&
+      settings.rate_control != RateControl::CONSTANT_QUALITY) {
+    enc_ctx_->bit_rate = settings.bitrate;
+    if (settings.rate_control == RateControl::CBR)
+      enc_ctx_->rc_max_rate = settings.bitrate;
+    else
+      enc_ctx_->rc_max_rate = 2 * settings.bitrate;
+    settings_ = settings;
+    pending_settings_.reset();
+    return;
+  }
 
-void FfmpegRtpPipeline::handle_frame(const cv::Mat &bgr_image) {
-  int type;
-  int pixelWidthBytes;
+  pending_settings_ = settings;
+  pending_fps_ = fps;
+}
 
-  if (ENCODER_TYPE == EncoderType::HEVC_NVENC) {
-    // NVEnc wants BGR0
-    type = CV_8UC4;
-    pixelWidthBytes = 4;
-  } else {
-    type = CV_8UC3;
-    pixelWidthBytes = 3;
+void AttachRegionsOfInterest(AVFrame *frame,
+                             std::span<const RegionOfInterest> rois) {
+  av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+  const cv::Rect bounds{0, 0, frame->width, frame->height};
+  std::vector<AVRegionOfInterest> regions;
+  regions.reserve(rois.size());
+  for (const auto &roi : rois) {
+    const cv::Rect rect = roi.rect & bounds;
+    if (rect.empty())
+      continue;
+
+    AVRegionOfInterest region{};
+    region.self_size = sizeof(AVRegionOfInterest);
+    region.top = rect.y;
+    region.bottom = rect.y + rect.height;
+    region.left = rect.x;
+    region.right = rect.x + rect.width;
+    const float offset = std::clamp(roi.quality_offset, -1.0f, 1.0f);
+    region.qoffset = av_make_q(static_cast<int>(std::lround(offset * 1000)),
+                               1000);
+    regions.push_back(region);
   }
+  if (regions.empty())
+    return;
+
+  const size_t size = regions.size() * sizeof(AVRegionOfInterest);
+  AVFrameSideData *sd =
+      av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, size);
+  if (!sd)
+    throw std::runtime_error("av_frame_new_side_data failed");
+  std::memcpy(sd->data, regions.data(), size);
+}
 
+void FfmpegRtpPipeline::handle_frame(const cv::Mat &bgr_image,
+                                     std::span<const RegionOfInterest> rois,
+                                     int64_t captured_us) {
   if (bgr_image.cols != width_ || bgr_image.rows != height_)
     throw std::runtime_error(
         "Image dimensions do not match pipeline configuration");
@@ -120,35 +362,90 @@ void FfmpegRtpPipeline::handle_frame(const cv::Mat &bgr_image) {
   if (!bgr_image.isContinuous())
     throw std::runtime_error("Image must be continuous");
 
-  // If nvenc, convert
-  if (ENCODER_TYPE == EncoderType::HEVC_NVENC) {
-    if (scratch.empty()) {
-      scratch.create(height_, width_, type);
-    }
-    cv::cvtColor(bgr_image, scratch, cv::COLOR_BGR2BGRA);
-  } else {
-    scratch = bgr_image;
-  }
-
   // ── Use actual wall-clock time for PTS ───────────────────────────────────
-  auto now_us = av_gettime();
+  // Frames may have queued for a while before getting here, so go by when
+  // they were captured
+  auto now_us = captured_us >= 0 ? captured_us : av_gettime();
   if (first_frame_time_us < 0) {
     first_frame_time_us = now_us;
   }
 
+  // ── Drop frames to get down to the target rate, if there is one ─────────
+  if (settings_.fps > 0) {
+    const int64_t interval_us = static_cast<int64_t>(1'000'000 / fps_);
+    // A little slack so jitter in the input doesn't make us skip a frame we
+    // meant to keep
+    if (next_frame_due_us_ >= 0 &&
+        now_us < next_frame_due_us_ - interval_us / 4)
+      return;
+    next_frame_due_us_ =
+        std::max(next_frame_due_us_ + interval_us, now_us - interval_us);
+  }
+
+  // ── Swap to new settings where an IDR was due anyway ─────────────────────
+  // (or retry, if the last swap couldn't open the new encoder). Likewise from
+  // software to hardware, if we're only on software for want of a session
+  // and one's free now.
+  if (!enc_ctx_)
+    open_encoder();
+  const bool idr_due = fresh_encoder_ || keyframe_requested_ ||
+                       frames_since_keyframe_ + 1 >= settings_.gop;
+  if (idr_due && hardware_wanted_ && !session_)
+    session_ = EncoderSession::TryAcquire(ENCODER_TYPE);
+  if (idr_due && (pending_settings_ || (hardware_wanted_ && session_))) {
+    close_encoder();
+    if (pending_settings_) {
+      settings_ = *pending_settings_;
+      fps_ = pending_fps_;
+      pending_settings_.reset();
+    }
+    open_encoder();
+    keyframe_requested_ = false;
+  }
+
   auto elapsed_us = now_us - first_frame_time_us;
   int64_t pts =
       elapsed_us * 90 / 1'000'000; // Convert microseconds to 90kHz clock
 
-  // ── 1. Point AVFrame directly at cv::Mat data (zero-copy) ────────────────
-  enc_frame_->data[0] = scratch.data;
-  enc_frame_->linesize[0] = width_ * pixelWidthBytes; // BGR24 stride
+  // ── 1. Point AVFrame at the (possibly converted) image, zero-copy ────────
+  // (The format changes if a reopen had to fall back to software)
+  enc_frame_->format = enc_ctx_->pix_fmt;
+  if (backend_ == EncoderType::HEVC_NVENC) {
+    // NVEnc wants BGR0
+    cv::cvtColor(bgr_image, scratch, cv::COLOR_BGR2BGRA);
+    enc_frame_->data[0] = scratch.data;
+    enc_frame_->linesize[0] = width_ * 4;
+  } else if (backend_ == EncoderType::HEVC_X265) {
+    // x265 wants planar I420, which OpenCV packs as one tall 8UC1 image
+    cv::cvtColor(bgr_image, scratch, cv::COLOR_BGR2YUV_I420);
+    const int luma_size = width_ * height_;
+    enc_frame_->data[0] = scratch.data;
+    enc_frame_->data[1] = scratch.data + luma_size;
+    enc_frame_->data[2] = scratch.data + luma_size + luma_size / 4;
+    enc_frame_->linesize[0] = width_;
+    enc_frame_->linesize[1] = width_ / 2;
+    enc_frame_->linesize[2] = width_ / 2;
+  } else {
+    enc_frame_->data[0] = bgr_image.data;
+    enc_frame_->linesize[0] = width_ * 3; // BGR24 stride
+  }
   enc_frame_->pts = pts;
+  // forced-idr makes nvenc turn this into an IDR rather than just an I frame
+  enc_frame_->pict_type = keyframe_requested_.exchange(false)
+                              ? AV_PICTURE_TYPE_I
+                              : AV_PICTURE_TYPE_NONE;
+
+  // Where to spend the bits. Cleared on frames without any, since enc_frame_
+  // is reused
+  AttachRegionsOfInterest(enc_frame_,
+                          honors_rois() ? rois
+                                        : std::span<const RegionOfInterest>{});
 
   // ── 2. Send frame to encoder ──────────────────────────────────────────────
   int ret = avcodec_send_frame(enc_ctx_, enc_frame_);
   if (ret < 0)
     throw std::runtime_error("avcodec_send_frame: " + averr(ret));
+  fresh_encoder_ = false;
   // ── 3. Receive encoded packets ───────────────────────────────────────────
   while (ret >= 0) {
     ret = avcodec_receive_packet(enc_ctx_, enc_pkt_);
@@ -157,115 +454,33 @@ void FfmpegRtpPipeline::handle_frame(const cv::Mat &bgr_image) {
     if (ret < 0)
       throw std::runtime_error("avcodec_receive_packet: " + averr(ret));
 
-    // enc_pkt_->pts = enc_pkt_->dts = enc_pkt_->pts;
-    // enc_pkt_->duration = frame_duration_;
-    enc_pkt_->stream_index = 0;
-
-    if (!header_written_) {
-      init_muxer(enc_ctx_);
-      stream_start_wall_ = Clock::now();
-      header_written_ = true;
-    }
-
     write_packet(enc_pkt_);
     av_packet_unref(enc_pkt_);
   }
 }
 
 FfmpegRtpPipeline::~FfmpegRtpPipeline() {
-  // Flush encoder
-  if (enc_ctx_) {
-    avcodec_send_frame(enc_ctx_, nullptr);
-    while (avcodec_receive_packet(enc_ctx_, enc_pkt_) == 0) {
-      if (header_written_)
-        write_packet(enc_pkt_);
-      av_packet_unref(enc_pkt_);
-    }
-    avcodec_free_context(&enc_ctx_);
-  }
+  close_encoder();
 
   av_frame_free(&enc_frame_);
   av_packet_free(&enc_pkt_);
 
-  if (oc_) {
-    if (header_written_)
-      av_write_trailer(oc_);
-    if (!(oc_->oformat->flags & AVFMT_NOFILE))
-      avio_closep(&oc_->pb);
-    avformat_free_context(oc_);
-  }
-
-  printf("FfmpegRtpPipeline destroyed\n");
-}
-
-void FfmpegRtpPipeline::init_muxer(AVCodecContext *enc_ctx) {
-  // ── 1. Allocate output context ───────────────────────────────────────────
-  int ret = avformat_alloc_output_context2(&oc_, nullptr, "rtp", url_.c_str());
-  if (ret < 0 || !oc_)
-    throw std::runtime_error("avformat_alloc_output_context2: " + averr(ret));
-
-  // ── 2. Create the video stream and copy codec params from encoder ────────
-  st_ = avformat_new_stream(oc_, nullptr);
-  if (!st_)
-    throw std::runtime_error("avformat_new_stream failed");
-
-  ret = avcodec_parameters_from_context(st_->codecpar, enc_ctx);
-  if (ret < 0)
-    throw std::runtime_error("avcodec_parameters_from_context: " + averr(ret));
-
-  st_->time_base = {1, 90000};
-
-  // ── 3. Open the UDP socket ───────────────────────────────────────────────
-  ret = avio_open(&oc_->pb, url_.c_str(), AVIO_FLAG_WRITE);
-  if (ret < 0)
-    throw std::runtime_error("avio_open(" + url_ + "): " + averr(ret));
-
-  // ── 4. Write header ──────────────────────────────────────────────────────
-  oc_->start_time_realtime = av_gettime();
-  oc_->flags |= AVFMT_FLAG_FLUSH_PACKETS;
-
-  AVDictionary *opts = nullptr;
-  av_dict_set_int(&opts, "pkt_size", 1472, 0);
-  av_dict_set(&opts, "rtpflags", "send_bye", 0);
-  av_dict_set_int(&opts, "buffer_size", 65536, 0);
-  av_dict_set_int(&opts, "payload_type", 96, 0);
-  av_dict_set_int(&opts, "rtcp_port", 18889, 0); // todo pass in RTCP port
-  ret = avformat_write_header(oc_, &opts);
-  av_dict_free(&opts);
-  if (ret < 0)
-    throw std::runtime_error("avformat_write_header: " + averr(ret));
-
-  // Print SDP for the receiver
-  if (false) {
-    char sdp[4096] = {};
-    av_sdp_create(&oc_, 1, sdp, sizeof(sdp));
-    std::ofstream output_file("stream_sdp.txt");
-    output_file << sdp;
-  }
+  LOG_VERBOSE("FfmpegRtpPipeline destroyed");
 }
 
 void FfmpegRtpPipeline::write_packet(AVPacket *pkt) {
-  // Convert this packet's PTS (in 90 kHz ticks) to a wall-clock deadline
-  // and sleep until we reach it. This prevents the RTP sender from blasting
-  // all packets instantly and overflowing the receiver's jitter buffer.
-  // {
-  //   const int64_t pts_us = pkt->pts * 1'000'000LL / 90'000LL;
-  //   const auto deadline =
-  //       stream_start_wall_ + std::chrono::microseconds(pts_us);
-  //   const auto now = Clock::now();
-  //   if (deadline > now)
-  //     std::this_thread::sleep_until(deadline);
-  // }
-
-  // NAL type check for key-frame flag (skip start code)
-  if (pkt->size >= 5) {
-    int off = (pkt->data[2] == 1) ? 3 : 4;
-    int nal_type = (pkt->data[off] >> 1) & 0x3F;
-    if (nal_type == 19 || nal_type == 20)
-      pkt->flags |= AV_PKT_FLAG_KEY;
-  }
-
-  int ret = av_write_frame(oc_, pkt);
-  if (ret < 0)
-    std::fprintf(stderr, "WARN: av_write_frame: %s\n", averr(ret).c_str());
+  const bool keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+  if (keyframe)
+    frames_since_keyframe_ = 0;
+  else
+    frames_since_keyframe_++;
+
+  // No sleeping here: senders pace packets out over part of the frame
+  // interval on their own timer, so we go straight back to encoding.
+  //
+  // Each slice is its own NAL unit, so senders packetize and send them one at
+  // a time. ffmpeg only hands us whole access units (none of the encoders we
+  // use expose sub-frame output through libavcodec), so this is as early as
+  // we can get at them.
+  sink_({pkt->data, static_cast<size_t>(pkt->size)}, pkt->pts, keyframe);
 }
@@ -8,46 +8,220 @@
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavcodec/bsf.h>
-#include <libavformat/avformat.h>
-#include <libavformat/avio.h>
 #include <libavutil/error.h>
+#include <libavutil/frame.h>
 #include <libavutil/opt.h>
+#include <libavutil/rational.h>
 #include <libavutil/time.h>
 } // extern "C"
 
-#include <chrono>
+#include "NalUnits.hpp"
+#include <atomic>
+#include <functional>
 #include <opencv2/core.hpp>
+#include <optional>
 #include <span>
 #include <string>
 #include <vector>
 
+enum class RateControl {
+  // Constant bitrate, the default. Best for links with a hard budget.
+  CBR,
+  // Average bitrate, letting busy scenes borrow from quiet ones
+  VBR,
+  // Constant quality (QP for nvenc/rkmpp, CRF for x265). Bitrate floats.
+  CONSTANT_QUALITY,
+};
+
+// Which family of encoders to use. H.264 streams use the H.264 sibling of the
+// HEVC encoder named here (h264_nvenc, libx264, h264_rkmpp).
+enum class EncoderType { HEVC_RKMPP, HEVC_NVENC, HEVC_X265 };
+constexpr EncoderType ENCODER_TYPE = EncoderType::HEVC_NVENC;
+
+/**
+ * Limit how many encoders of a type may be open at once in this process, -1
+ * for no limit. H.264 and HEVC encoders of a type count against the same
+ * limit, since they share the hardware. Pipelines that can't get a hardware
+ * session use x265/x264 until one's free; ones whose hardware encoder won't
+ * open stay on software. Defaults to 3 for nvenc, the cap on consumer GPUs
+ * with older drivers, and 4 for rkmpp, which runs sessions one after another
+ * anyway.
+ */
+void SetEncoderSessionLimit(EncoderType type, int limit);
+
+/** One of the sessions counted by SetEncoderSessionLimit, while held */
+class EncoderSession {
+public:
+  EncoderSession() = default;
+  ~EncoderSession();
+  EncoderSession(EncoderSession &&other) noexcept;
+  EncoderSession &operator=(EncoderSession &&other) noexcept;
+
+  /** Empty if that type is at its limit */
+  static EncoderSession TryAcquire(EncoderType type);
+
+  explicit operator bool() const { return held_; }
+
+private:
+  void release();
+
+  EncoderType type_ = EncoderType::HEVC_X265;
+  bool held_ = false;
+};
+
+struct EncoderSettings {
+  int bitrate = 2'000'000; // bps
+  // Frames between IDRs
+  int gop = 30;
+  // Frames per second to encode. 0 follows the measured input rate, otherwise
+  // input frames are dropped to get down to this rate.
+  int fps = 0;
+  RateControl rate_control = RateControl::CBR;
+  // QP (or CRF) for CONSTANT_QUALITY, 0-51
+  int quality = 28;
+
+  // Number of slices to split each frame into. More than one lets us
+  // packetize and send the top of a frame before the bottom is done, and lets
+  // the receiver start decoding it early. Honored by nvenc (slices) and
+  // x265/x264 (x26x-params), ignored by encoders that can't do it.
+  int slices = 1;
+
+  // Temporal layers to encode, 1-3. Each layer above the base doubles the
+  // frame rate (e.g. 7.5/15/30 fps), and the pictures in it are marked with
+  // their TemporalId so senders can drop upper layers for clients that can't
+  // keep up, without a second encode. Only libx265 exposes this through
+  // ffmpeg, as a hierarchical-B structure that adds 2^(layers-1)-1 frames of
+  // latency, and only for HEVC. Everything else sends every picture in the
+  // base layer.
+  int temporal_layers = 1;
+
+  static constexpr int MAX_TEMPORAL_LAYERS = 3;
+
+  bool operator==(const EncoderSettings &) const = default;
+};
+
+/**
+ * Part of the picture worth spending more (or fewer) bits on, e.g. around a
+ * target the vision pipeline found.
+ */
+struct RegionOfInterest {
+  cv::Rect rect; // pixels
+  // -1 (much better quality) to 1 (much worse), the same scale as
+  // AVRegionOfInterest::qoffset. 0 leaves the region alone.
+  float quality_offset = -0.5f;
+};
+
+/**
+ * Attach regions of interest to a frame as AV_FRAME_DATA_REGIONS_OF_INTEREST
+ * side data, replacing any that's already there. Rects are clipped to the
+ * frame. Where regions overlap, the earlier one wins.
+ *
+ * libx265 and libx264 turn this into their per-block QP offsets. Encoder
+ * wrappers that don't understand the side data ignore it; see
+ * FfmpegRtpPipeline::honors_rois.
+ */
+void AttachRegionsOfInterest(AVFrame *frame,
+                             std::span<const RegionOfInterest> rois);
+
+/**
+ * One encoder session. Frames go in through handle_frame, and every encoded
+ * access unit comes back out through the sink, on the same thread.
+ *
+ * Uses the hardware encoder (ENCODER_TYPE) if there's a session free for it
+ * (see SetEncoderSessionLimit), otherwise the software one. One that had to
+ * settle for software tries for a session again on its first frame and at
+ * every IDR after, and moves to hardware once it gets one; so a pipeline
+ * opened while the one it replaces still holds a session takes it over as
+ * soon as that one's closed.
+ *
+ * Settings can be changed while running. A bitrate change is applied in
+ * place on encoders that can reconfigure themselves (nvenc). Anything else
+ * reopens the encoder where the next IDR was going to be anyway, so the
+ * stream carries on with fresh parameter sets and no extra keyframe.
+ */
 class FfmpegRtpPipeline {
+public:
+  using PacketSink = std::function<void(std::span<const uint8_t> au,
+                                        int64_t pts, bool keyframe)>;
+
 private:
+  VideoCodec codec_;
   int width_, height_;
-  std::string url_;
-  AVFormatContext *oc_ = nullptr;
-  AVStream *st_ = nullptr;
+  PacketSink sink_;
 
-  AVCodecContext *enc_ctx_ = nullptr; // Hardware encoder context
-  AVFrame *enc_frame_ = nullptr;      // Frame buffer for BGR24 input
+  // ENCODER_TYPE, unless we had to fall back to software
+  EncoderType backend_ = ENCODER_TYPE;
+  EncoderSession session_;
+  // On software only for want of a session, so worth trying for one again
+  bool hardware_wanted_ = false;
+  // Nothing's gone into the open encoder yet, so its next frame is an IDR
+  bool fresh_encoder_ = false;
+
+  AVCodecContext *enc_ctx_ = nullptr; // Open encoder, hardware or software
+  AVFrame *enc_frame_ = nullptr;      // Frame buffer for encoder input
   AVPacket *enc_pkt_ = nullptr;       // Packet buffer for encoded output
 
-  bool header_written_ = false;
-  int next_pts_ = 3000; // start at frame 1
-  int frame_duration_ = 90000 / 30;
-  using Clock = std::chrono::steady_clock;
-  std::chrono::time_point<Clock> stream_start_wall_;
+  // What the open encoder was configured with
+  EncoderSettings settings_;
+  double fps_;
+
+  // Applied at the next IDR
+  std::optional<EncoderSettings> pending_settings_;
+  double pending_fps_ = 0;
+
+  std::atomic_bool keyframe_requested_{false};
+  int frames_since_keyframe_ = 0;
 
   int64_t first_frame_time_us = -1;
+  int64_t next_frame_due_us_ = -1;
 
   cv::Mat scratch;
 
+  void open_encoder();
+  void open_encoder(EncoderType type);
+  void close_encoder();
+
 public:
-  FfmpegRtpPipeline(int width, int height, std::string url);
+  /**
+   * time_origin_us (av_gettime() clock) is the instant pts counts from. Pass
+   * the same origin to a replacement pipeline so timestamps carry on across
+   * the switch instead of restarting at zero; -1 starts from the first frame.
+   */
+  FfmpegRtpPipeline(VideoCodec codec, int width, int height,
+                    const EncoderSettings &settings, double fps,
+                    PacketSink sink, int64_t time_origin_us = -1);
   ~FfmpegRtpPipeline();
   FfmpegRtpPipeline(const FfmpegRtpPipeline &) = delete;
   FfmpegRtpPipeline &operator=(const FfmpegRtpPipeline &) = delete;
   void write_packet(AVPacket *pkt);
-  void init_muxer(AVCodecContext *enc_ctx);
-  void handle_frame(const cv::Mat &frame);
+  /**
+   * Encode a frame. captured_us (av_gettime() clock) is when it was taken,
+   * for its timestamp; -1 means now.
+   */
+  void handle_frame(const cv::Mat &frame,
+                    std::span<const RegionOfInterest> rois = {},
+                    int64_t captured_us = -1);
+
+  /**
+   * Switch to new settings. input_fps is the measured rate frames are coming
+   * in at, used when settings.fps is 0 and to cap it otherwise.
+   */
+  void reconfigure(const EncoderSettings &settings, double input_fps);
+
+  /** Make the next frame an IDR, e.g. because a new client just joined. */
+  void request_keyframe() { keyframe_requested_ = true; }
+
+  const EncoderSettings &settings() const { return settings_; }
+  // Frame rate we're actually encoding at
+  double fps() const { return fps_; }
+  VideoCodec codec() const { return codec_; }
+  EncoderType backend() const { return backend_; }
+  /**
+   * Whether the encoder acts on the rois passed to handle_frame. Only the
+   * software ones do: nvenc's emphasis map and rkmpp's ROI config aren't
+   * reachable through libavcodec.
+   */
+  bool honors_rois() const { return backend_ == EncoderType::HEVC_X265; }
+  int width() const { return width_; }
+  int height() const { return height_; }
 };
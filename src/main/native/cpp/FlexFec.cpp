@@ -0,0 +1,166 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "FlexFec.hpp"
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+constexpr size_t RTP_HEADER_SIZE = 12;
+// R/F/P/X/CC/M/PT, length recovery, TS recovery
+constexpr size_t FLEXFEC_BASE_HEADER_SIZE = 8;
+
+// GCC/clang vector extension; lowers to SSE2 on x86-64 and NEON on arm64
+// without needing per-arch intrinsics
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+void XorBytes(uint8_t *dst, const uint8_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    v16u8 a[4], b[4];
+    std::memcpy(a, dst + i, 64);
+    std::memcpy(b, src + i, 64);
+    a[0] ^= b[0];
+    a[1] ^= b[1];
+    a[2] ^= b[2];
+    a[3] ^= b[3];
+    std::memcpy(dst + i, a, 64);
+  }
+  for (; i + 16 <= n; i += 16) {
+    v16u8 a, b;
+    std::memcpy(&a, dst + i, 16);
+    std::memcpy(&b, src + i, 16);
+    a ^= b;
+    std::memcpy(dst + i, &a, 16);
+  }
+  for (; i < n; ++i)
+    dst[i] ^= src[i];
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+FlexFecEncoder::FlexFecEncoder(uint8_t payload_type, uint32_t ssrc,
+                               SendFn send)
+    : payload_type_(payload_type), send_(std::move(send)), ssrc_(ssrc) {
+  std::random_device rd;
+  seq_ = rd() & 0xFFFF;
+}
+
+void FlexFecEncoder::configure(int group_size, int interleave) {
+  interleave = std::clamp(interleave, 1, MAX_BLOCK);
+  group_size = std::clamp(group_size, 0, MAX_BLOCK / interleave);
+  if (group_size == group_size_ && interleave == interleave_)
+    return;
+
+  // Finish off anything protected under the old layout first
+  flush();
+  group_size_ = group_size;
+  interleave_ = interleave;
+  columns_.assign(interleave_, Column{});
+}
+
+void FlexFecEncoder::add_packet(std::span<const uint8_t> rtp) {
+  if (!enabled() || rtp.size() < RTP_HEADER_SIZE)
+    return;
+
+  uint16_t seq = (rtp[2] << 8) | rtp[3];
+  uint32_t timestamp =
+      (rtp[4] << 24) | (rtp[5] << 16) | (rtp[6] << 8) | rtp[7];
+
+  if (block_count_ == 0)
+    sn_base_ = seq;
+  const int offset = static_cast<uint16_t>(seq - sn_base_);
+
+  auto &col = columns_[offset % interleave_];
+  auto payload = rtp.subspan(RTP_HEADER_SIZE);
+
+  col.hdr[0] ^= rtp[0];
+  col.hdr[1] ^= rtp[1];
+  col.length ^= static_cast<uint16_t>(payload.size());
+  col.timestamp ^= timestamp;
+  col.mask |= uint64_t{1} << offset;
+
+  if (payload.size() > col.payload_size) {
+    col.payload.resize(payload.size(), 0);
+    col.payload_size = payload.size();
+  }
+  XorBytes(col.payload.data(), payload.data(), payload.size());
+
+  last_timestamp_ = timestamp;
+  if (++block_count_ == group_size_ * interleave_)
+    flush();
+}
+
+void FlexFecEncoder::flush() {
+  for (auto &col : columns_) {
+    if (col.mask)
+      emit(col);
+    // Keep the payload allocation around for the next block
+    auto payload = std::move(col.payload);
+    std::fill(payload.begin(), payload.end(), 0);
+    col = Column{};
+    col.payload = std::move(payload);
+  }
+  block_count_ = 0;
+}
+
+void FlexFecEncoder::emit(Column &col) {
+  // Two mask chunks if anything past offset 14 is protected
+  const bool long_mask = col.mask >> 15;
+  const size_t mask_size = long_mask ? 6 : 2;
+  const size_t hdr_size =
+      RTP_HEADER_SIZE + FLEXFEC_BASE_HEADER_SIZE + 2 + mask_size;
+
+  out_buf_.resize(hdr_size + col.payload_size);
+  uint8_t *p = out_buf_.data();
+
+  // ── RTP header of the repair packet ──────────────────────────────────────
+  p[0] = 0x80;
+  p[1] = payload_type_ & 0x7F;
+  put_u16(p + 2, seq_++);
+  put_u32(p + 4, last_timestamp_);
+  put_u32(p + 8, ssrc_);
+  p += RTP_HEADER_SIZE;
+
+  // ── FlexFEC header (RFC 8627 4.2.2) ──────────────────────────────────────
+  // R=0 F=0 replace the version bits
+  p[0] = col.hdr[0] & 0x3F;
+  p[1] = col.hdr[1];
+  put_u16(p + 2, col.length);
+  put_u32(p + 4, col.timestamp);
+  put_u16(p + 8, sn_base_);
+  p += FLEXFEC_BASE_HEADER_SIZE + 2;
+
+  // Mask[0] is the bit just after the k bit
+  uint16_t chunk0 = 0;
+  for (int i = 0; i < 15; ++i)
+    if (col.mask & (uint64_t{1} << i))
+      chunk0 |= 1 << (14 - i);
+  if (!long_mask) {
+    put_u16(p, 0x8000 | chunk0);
+  } else {
+    uint32_t chunk1 = 0;
+    for (int i = 15; i < MAX_BLOCK; ++i)
+      if (col.mask & (uint64_t{1} << i))
+        chunk1 |= uint32_t{1} << (30 - (i - 15));
+    put_u16(p, chunk0);
+    put_u32(p + 2, 0x80000000u | chunk1);
+  }
+  p += mask_size;
+
+  std::memcpy(p, col.payload.data(), col.payload_size);
+
+  send_(out_buf_);
+}
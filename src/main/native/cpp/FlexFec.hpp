@@ -0,0 +1,93 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+struct FecSettings {
+  // Media packets protected by each FEC packet. 0 disables FEC. Overhead is
+  // roughly 1 / group_size.
+  int group_size = 0;
+  // Each FEC packet covers every interleave-th media packet, so a burst of up
+  // to `interleave` consecutive losses costs at most one packet per group.
+  int interleave = 1;
+  // Let RTCP receiver reports shrink group_size (down to 2) as loss goes up
+  bool adaptive = false;
+};
+
+/**
+ * Generates FlexFEC (RFC 8627) repair packets over an outgoing RTP stream.
+ * We use the flexible mask (F=0) with XOR parity, and send repair packets in
+ * the same RTP session as the media with their own SSRC and sequence numbers.
+ *
+ * Media packets are grouped into blocks of group_size * interleave packets.
+ * A block is closed early at the end of every frame, so FEC never adds more
+ * than a frame of latency to recovery.
+ */
+class FlexFecEncoder {
+public:
+  // The mask can name up to 46 packets with two chunks (RFC 8627 4.2.2.1)
+  static constexpr int MAX_BLOCK = 46;
+  // Repair packets are this much bigger than the largest media packet they
+  // protect (FlexFEC header with a two chunk mask), which the media
+  // packetizer has to leave room for
+  static constexpr size_t MAX_OVERHEAD = 8 + 2 + 6;
+
+  using SendFn = std::function<void(std::span<const uint8_t>)>;
+
+  /**
+   * Repair packets go out under ssrc, which the SDP ties to the media SSRC
+   * they protect with an FEC-FR ssrc-group (RFC 8627 section 5.1.1)
+   */
+  FlexFecEncoder(uint8_t payload_type, uint32_t ssrc, SendFn send);
+
+  void configure(int group_size, int interleave);
+  int group_size() const { return group_size_; }
+  bool enabled() const { return group_size_ > 0; }
+
+  /** Feed a complete media RTP packet, right after it's sent */
+  void add_packet(std::span<const uint8_t> rtp);
+
+  /** Emit repair packets for a partly filled block, e.g. at end of frame */
+  void flush();
+
+  uint32_t ssrc() const { return ssrc_; }
+
+private:
+  struct Column {
+    uint8_t hdr[2] = {};     // P/X/CC, M/PT of the protected packets, XORed
+    uint16_t length = 0;     // XOR of payload lengths
+    uint32_t timestamp = 0;  // XOR of timestamps
+    uint64_t mask = 0;       // bit i set => sn_base + i is protected
+    size_t payload_size = 0; // longest payload seen
+    std::vector<uint8_t> payload;
+  };
+
+  void emit(Column &col);
+
+  uint8_t payload_type_;
+  SendFn send_;
+
+  int group_size_ = 0;
+  int interleave_ = 1;
+
+  uint16_t seq_;
+  uint32_t ssrc_;
+
+  // Current block
+  std::vector<Column> columns_;
+  uint16_t sn_base_ = 0;
+  int block_count_ = 0;
+  uint32_t last_timestamp_ = 0;
+
+  std::vector<uint8_t> out_buf_;
+};
+
+/** dst ^= src over n bytes, 16 bytes at a time where possible */
+void XorBytes(uint8_t *dst, const uint8_t *src, size_t n);
@@ -0,0 +1,355 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "FrameRecording.hpp"
+#include "Logging.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+// "HMRF", and bumped whenever the layout below changes
+constexpr uint32_t RECORDING_MAGIC = 0x46524D48;
+constexpr uint32_t RECORDING_VERSION = 1;
+// "FRAM" and "INDX"
+constexpr uint32_t FRAME_MAGIC = 0x4D415246;
+constexpr uint32_t INDEX_MAGIC = 0x58444E49;
+constexpr uint64_t ALIGN = 64;
+// cv_type of an encoded frame, by codec
+constexpr int32_t ENCODED_HEVC = -1;
+constexpr int32_t ENCODED_H264 = -2;
+
+// ── File layout ────────────────────────────────────────────────────────────
+// [ FileHeader | frame | frame | ... | index | IndexFooter ]
+//
+// The header and every frame start on a 64 byte boundary. A frame is a
+// FrameHeader, its RoiRecords, then its pixels at pixels_offset, also
+// aligned. The index (each frame's offset) and its footer are only written
+// once the recorder finishes; without them, readers walk the frames from the
+// start instead.
+//
+// An encoded frame has a negative cv_type (ENCODED_HEVC or ENCODED_H264), its
+// picture size in width and height, and its access unit where the pixels
+// would be, row_bytes long.
+
+struct FileHeader {
+  uint32_t magic = RECORDING_MAGIC;
+  uint32_t version = RECORDING_VERSION;
+};
+
+struct FrameHeader {
+  uint32_t magic = FRAME_MAGIC;
+  uint32_t roi_count = 0;
+  int64_t timestamp_us = 0;
+  int32_t width = 0;
+  int32_t height = 0;
+  int32_t cv_type = 0;
+  // Rows are packed, so this is width * bytes per pixel. For encoded frames,
+  // the size of the access unit.
+  uint32_t row_bytes = 0;
+  // From the start of this header
+  uint64_t pixels_offset = 0;
+  // Of the whole frame, padding and all
+  uint64_t size = 0;
+};
+
+struct RoiRecord {
+  int32_t x, y, width, height;
+  float quality_offset;
+};
+
+struct IndexFooter {
+  uint64_t index_offset = 0;
+  uint64_t frames = 0;
+  uint32_t magic = INDEX_MAGIC;
+  uint32_t version = RECORDING_VERSION;
+};
+
+static uint64_t AlignUp(uint64_t n) { return (n + ALIGN - 1) / ALIGN * ALIGN; }
+
+// How many bytes follow pixels_offset
+static uint64_t DataBytes(const FrameHeader &h) {
+  return h.cv_type < 0 ? h.row_bytes
+                       : static_cast<uint64_t>(h.height) * h.row_bytes;
+}
+
+// ── Recorder ───────────────────────────────────────────────────────────────
+
+FrameRecorder::FrameRecorder(const std::string &path) : path_(path) {
+  file_ = std::fopen(path.c_str(), "wb");
+  if (!file_) {
+    throw std::runtime_error("Couldn't create " + path + ": " +
+                             std::strerror(errno));
+  }
+  const FileHeader header;
+  write(&header, sizeof(header));
+  pad();
+
+  thread_ = std::thread([this] { run(); });
+}
+
+FrameRecorder::~FrameRecorder() { close(); }
+
+bool FrameRecorder::record(const cv::Mat &frame,
+                           std::span<const RegionOfInterest> rois,
+                           int64_t timestamp_us) {
+  Pending pending;
+  pending.frame = frame;
+  pending.rois.assign(rois.begin(), rois.end());
+  pending.timestamp_us = timestamp_us;
+  return queue(std::move(pending));
+}
+
+bool FrameRecorder::record_encoded(VideoCodec codec,
+                                   std::span<const uint8_t> au, cv::Size size,
+                                   int64_t timestamp_us) {
+  {
+    // Don't bother copying what'd be dropped anyway
+    std::scoped_lock lock{mutex_};
+    if (closing_)
+      return false;
+    if (queue_.size() >= RECORD_QUEUE_FRAMES) {
+      dropped_++;
+      return false;
+    }
+  }
+  Pending pending;
+  pending.timestamp_us = timestamp_us;
+  pending.encoded.assign(au.begin(), au.end());
+  pending.codec = codec;
+  pending.size = size;
+  return queue(std::move(pending));
+}
+
+bool FrameRecorder::queue(Pending &&frame) {
+  {
+    std::scoped_lock lock{mutex_};
+    if (closing_)
+      return false;
+    if (queue_.size() >= RECORD_QUEUE_FRAMES) {
+      dropped_++;
+      return false;
+    }
+    queue_.push_back(std::move(frame));
+  }
+  cv_.notify_one();
+  return true;
+}
+
+void FrameRecorder::close() {
+  {
+    std::scoped_lock lock{mutex_};
+    closing_ = true;
+  }
+  cv_.notify_one();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void FrameRecorder::run() {
+  std::unique_lock lock{mutex_};
+  for (;;) {
+    cv_.wait(lock, [&] { return closing_ || !queue_.empty(); });
+    if (queue_.empty())
+      break; // Closing, and everything's written
+
+    Pending frame = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    write_frame(frame);
+    lock.lock();
+    written_++;
+  }
+  lock.unlock();
+
+  IndexFooter footer;
+  footer.index_offset = offset_;
+  footer.frames = index_.size();
+  write(index_.data(), index_.size() * sizeof(uint64_t));
+  write(&footer, sizeof(footer));
+  if (std::fclose(std::exchange(file_, nullptr)) != 0 && !failed_) {
+    LOG_WARN("couldn't finish recording {}: {}", path_, std::strerror(errno));
+  }
+
+  LOG_INFO("Recorded {} frames to {}, {} dropped", written_, path_, dropped_);
+}
+
+void FrameRecorder::write_frame(const Pending &frame) {
+  const cv::Mat &image = frame.frame;
+
+  const bool encoded = image.empty();
+
+  FrameHeader header;
+  header.roi_count = frame.rois.size();
+  header.timestamp_us = frame.timestamp_us;
+  if (encoded) {
+    header.width = frame.size.width;
+    header.height = frame.size.height;
+    header.cv_type =
+        frame.codec == VideoCodec::H264 ? ENCODED_H264 : ENCODED_HEVC;
+    header.row_bytes = frame.encoded.size();
+  } else {
+    header.width = image.cols;
+    header.height = image.rows;
+    header.cv_type = image.type();
+    header.row_bytes = image.cols * image.elemSize();
+  }
+  header.pixels_offset =
+      AlignUp(sizeof(header) + frame.rois.size() * sizeof(RoiRecord));
+  header.size = AlignUp(header.pixels_offset + DataBytes(header));
+
+  index_.push_back(offset_);
+  write(&header, sizeof(header));
+  for (const auto &roi : frame.rois) {
+    const RoiRecord record{roi.rect.x, roi.rect.y, roi.rect.width,
+                           roi.rect.height, roi.quality_offset};
+    write(&record, sizeof(record));
+  }
+  pad();
+  if (encoded) {
+    write(frame.encoded.data(), frame.encoded.size());
+  } else if (image.isContinuous()) {
+    write(image.ptr(), image.rows * header.row_bytes);
+  } else {
+    for (int y = 0; y < image.rows; y++)
+      write(image.ptr(y), header.row_bytes);
+  }
+  pad();
+}
+
+void FrameRecorder::write(const void *data, size_t size) {
+  offset_ += size;
+  if (size == 0 || std::fwrite(data, 1, size, file_) == size || failed_)
+    return;
+  // Keep going, so the frame count still comes out right; the file's no
+  // good past here anyway
+  LOG_WARN("writing recording {}: {}", path_, std::strerror(errno));
+  failed_ = true;
+}
+
+void FrameRecorder::pad() {
+  static constexpr uint8_t zeros[ALIGN] = {};
+  write(zeros, AlignUp(offset_) - offset_);
+}
+
+// ── Playback ───────────────────────────────────────────────────────────────
+
+FrameRecording::FrameRecording(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Couldn't open " + path + ": " +
+                             std::strerror(errno));
+  }
+  struct stat st{};
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(ALIGN)) {
+    ::close(fd);
+    throw std::runtime_error(path + " is too short to be a recording");
+  }
+  map_size_ = st.st_size;
+  void *map = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    throw std::runtime_error("Couldn't map " + path + ": " +
+                             std::strerror(errno));
+  }
+  map_ = static_cast<const uint8_t *>(map);
+  // Played front to back, so read ahead
+  madvise(map, map_size_, MADV_SEQUENTIAL);
+
+  FileHeader file;
+  std::memcpy(&file, map_, sizeof(file));
+  if (file.magic != RECORDING_MAGIC || file.version != RECORDING_VERSION) {
+    munmap(map, map_size_);
+    throw std::runtime_error(path + " isn't a version " +
+                             std::to_string(RECORDING_VERSION) +
+                             " recording");
+  }
+
+  // Whether a whole, sane frame starts at offset
+  auto frame_at = [&](uint64_t offset) -> const FrameHeader * {
+    if (offset % ALIGN != 0 || offset + sizeof(FrameHeader) > map_size_)
+      return nullptr;
+    const auto *h = reinterpret_cast<const FrameHeader *>(map_ + offset);
+    const uint64_t pixels = DataBytes(*h);
+    const uint64_t rois =
+        sizeof(FrameHeader) + h->roi_count * sizeof(RoiRecord);
+    const bool row_ok =
+        h->cv_type < 0
+            ? h->cv_type >= ENCODED_H264 && h->row_bytes > 0
+            : h->row_bytes == static_cast<uint64_t>(h->width) *
+                                  CV_ELEM_SIZE(h->cv_type);
+    const bool ok =
+        h->magic == FRAME_MAGIC && h->width > 0 && h->height > 0 && row_ok &&
+        h->pixels_offset % ALIGN == 0 && h->pixels_offset >= rois &&
+        h->pixels_offset + pixels <= h->size &&
+        h->size <= map_size_ - offset;
+    return ok ? h : nullptr;
+  };
+
+  IndexFooter footer;
+  std::memcpy(&footer, map_ + map_size_ - sizeof(footer), sizeof(footer));
+  const bool indexed =
+      footer.magic == INDEX_MAGIC && footer.version == RECORDING_VERSION &&
+      footer.index_offset + footer.frames * sizeof(uint64_t) +
+              sizeof(footer) ==
+          map_size_;
+  if (indexed) {
+    frames_.resize(footer.frames);
+    std::memcpy(frames_.data(), map_ + footer.index_offset,
+                footer.frames * sizeof(uint64_t));
+    std::erase_if(frames_, [&](uint64_t offset) { return !frame_at(offset); });
+  } else {
+    // Never finished, so go looking for the frames that did get written
+    for (uint64_t offset = AlignUp(sizeof(FileHeader));
+         const FrameHeader *h = frame_at(offset); offset += h->size)
+      frames_.push_back(offset);
+    LOG_WARN("{} wasn't finished, playing its {} whole frames", path,
+             frames_.size());
+  }
+}
+
+FrameRecording::~FrameRecording() {
+  if (map_)
+    munmap(const_cast<uint8_t *>(map_), map_size_);
+  map_ = nullptr;
+}
+
+RecordedFrame FrameRecording::operator[](size_t i) const {
+  const uint8_t *record = map_ + frames_.at(i);
+  FrameHeader header;
+  std::memcpy(&header, record, sizeof(header));
+
+  RecordedFrame frame;
+  frame.timestamp_us = header.timestamp_us;
+  if (header.cv_type < 0) {
+    frame.encoded = {record + header.pixels_offset, header.row_bytes};
+    frame.codec =
+        header.cv_type == ENCODED_H264 ? VideoCodec::H264 : VideoCodec::HEVC;
+    frame.size = cv::Size(header.width, header.height);
+    return frame;
+  }
+  // Read only, even though cv::Mat won't say so
+  frame.image = cv::Mat(header.height, header.width, header.cv_type,
+                        const_cast<uint8_t *>(record + header.pixels_offset),
+                        header.row_bytes);
+  for (uint32_t r = 0; r < header.roi_count; r++) {
+    RoiRecord roi;
+    std::memcpy(&roi, record + sizeof(header) + r * sizeof(roi), sizeof(roi));
+    frame.rois.push_back(
+        {cv::Rect(roi.x, roi.y, roi.width, roi.height), roi.quality_offset});
+  }
+  return frame;
+}
+
+int64_t FrameRecording::duration_us() const {
+  if (frames_.empty())
+    return 0;
+  return (*this)[frames_.size() - 1].timestamp_us - (*this)[0].timestamp_us;
+}
@@ -0,0 +1,144 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include "FfmpegRtpPipe.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <opencv2/core/mat.hpp>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Recordings of exactly what was handed to PublishCameraFrame: every frame,
+ * its ROIs, and when it was published. Played back (see ReplayRecording),
+ * they let encoder and network performance be compared from one commit to the
+ * next on the same real footage, with no camera attached.
+ *
+ * Frames are stored uncompressed, rows packed, each starting on a 64 byte
+ * boundary. That's big on disk, but playing back costs nothing but page
+ * faults: no decoder muddying the numbers, and no copy before the frame goes
+ * to PublishCameraFrame.
+ *
+ * Streams fed already encoded access units (PublishEncodedFrame) record those
+ * instead, as they came, to be replayed through the same passthrough.
+ */
+
+/** One frame of a recording. Only valid as long as the FrameRecording is. */
+struct RecordedFrame {
+  // When it was published, av_gettime() microseconds
+  int64_t timestamp_us = 0;
+  // Points into the read only mapping of the file
+  cv::Mat image;
+  std::vector<RegionOfInterest> rois;
+
+  // Encoded frames only, when image is empty: the access unit (also pointing
+  // into the mapping), its codec and its picture size
+  std::span<const uint8_t> encoded;
+  VideoCodec codec = VideoCodec::HEVC;
+  cv::Size size;
+};
+
+/**
+ * Writes a recording. record() just queues the frame; it's written by a
+ * thread of our own, so a slow disk never holds up the publisher. If the disk
+ * falls more than RECORD_QUEUE_FRAMES behind, frames are dropped (and
+ * counted) instead.
+ */
+class FrameRecorder {
+public:
+  static constexpr size_t RECORD_QUEUE_FRAMES = 30;
+
+  /** Create or truncate path. Throws std::runtime_error on failure. */
+  explicit FrameRecorder(const std::string &path);
+  ~FrameRecorder();
+  FrameRecorder(const FrameRecorder &) = delete;
+  FrameRecorder &operator=(const FrameRecorder &) = delete;
+
+  /**
+   * Queue a frame. Its pixels mustn't be changed afterwards (pass a clone).
+   * False if it was dropped, or the recording's been closed.
+   */
+  bool record(const cv::Mat &frame, std::span<const RegionOfInterest> rois,
+              int64_t timestamp_us);
+
+  /** Queue an encoded access unit, copying it. Same returns as record(). */
+  bool record_encoded(VideoCodec codec, std::span<const uint8_t> au,
+                      cv::Size size, int64_t timestamp_us);
+
+  /**
+   * Write out what's queued and finish the file. Safe to call more than
+   * once; later frames are ignored.
+   */
+  void close();
+
+  const std::string &path() const { return path_; }
+
+private:
+  struct Pending {
+    cv::Mat frame;
+    std::vector<RegionOfInterest> rois;
+    int64_t timestamp_us = 0;
+    // Instead of frame, for record_encoded()
+    std::vector<uint8_t> encoded;
+    VideoCodec codec = VideoCodec::HEVC;
+    cv::Size size;
+  };
+
+  bool queue(Pending &&frame);
+  void run();
+  void write_frame(const Pending &frame);
+  void write(const void *data, size_t size);
+  // Up to the next 64 byte boundary
+  void pad();
+
+  const std::string path_;
+  FILE *file_ = nullptr;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Pending> queue_;
+  bool closing_ = false;
+  uint64_t written_ = 0;
+  uint64_t dropped_ = 0;
+
+  // Only touched from the writer thread
+  uint64_t offset_ = 0;
+  std::vector<uint64_t> index_;
+  bool failed_ = false;
+
+  std::thread thread_;
+};
+
+/**
+ * A recording, mapped read only. A file whose recorder never finished (the
+ * process was killed, say) is still readable up to its last whole frame.
+ */
+class FrameRecording {
+public:
+  /** Throws std::runtime_error if path isn't a recording */
+  explicit FrameRecording(const std::string &path);
+  ~FrameRecording();
+  FrameRecording(const FrameRecording &) = delete;
+  FrameRecording &operator=(const FrameRecording &) = delete;
+
+  size_t size() const { return frames_.size(); }
+  RecordedFrame operator[](size_t i) const;
+
+  /** From the first frame's timestamp to the last's */
+  int64_t duration_us() const;
+
+private:
+  const uint8_t *map_ = nullptr;
+  size_t map_size_ = 0;
+  // Offset of each frame's record in the file
+  std::vector<uint64_t> frames_;
+};
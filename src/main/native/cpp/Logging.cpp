@@ -0,0 +1,231 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "Logging.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <pthread.h>
+#include <thread>
+
+// Power of two. At 512 bytes each, 256 KiB.
+constexpr uint64_t LOG_RING_SLOTS = 512;
+
+namespace logging {
+
+static int64_t SteadyClockUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t WallClockUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+bool Site::admit(uint32_t &held_back) {
+  held_back = 0;
+  if (interval_us <= 0)
+    return true;
+  // Steady clock, so a wall clock step back can't mute us
+  const int64_t now_us = SteadyClockUs();
+  int64_t next = next_us.load(std::memory_order_relaxed);
+  if (now_us < next ||
+      !next_us.compare_exchange_strong(next, now_us + interval_us,
+                                       std::memory_order_relaxed)) {
+    // Too soon, or another thread just got the slot
+    suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  held_back = suppressed.exchange(0, std::memory_order_relaxed);
+  return true;
+}
+
+/**
+ * Bounded multi-producer, single-consumer ring (Dmitry Vyukov's), and the
+ * thread consuming it. Each slot's sequence says whose turn it is: equal to
+ * the position a producer wants means free, one more means written and ready
+ * for the writer thread.
+ */
+class Writer {
+public:
+  Writer() {
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++)
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    thread_ = std::thread([this] { run(); });
+    // Never joined (see Default), so don't let it hold up exit
+    thread_.detach();
+  }
+
+  static Writer &Default() {
+    // Leaked on purpose: other statics' destructors (encode workers, the
+    // pacer) may still log while they're torn down
+    static Writer *writer = [] {
+      auto *w = new Writer;
+      std::atexit(FlushLog);
+      return w;
+    }();
+    return *writer;
+  }
+
+  Record *claim() {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &slot = slots_[pos & (LOG_RING_SLOTS - 1)];
+      const uint64_t seq = slot.sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<int64_t>(seq - pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+          return &slot.record;
+      } else if (diff < 0) {
+        // A lap ahead of the writer thread
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void commit(Record *record) {
+    // The record's the first member
+    Slot &slot = *reinterpret_cast<Slot *>(record);
+    const uint64_t pos = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(pos + 1, std::memory_order_release);
+    // Only a syscall if the writer thread's asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed) && sleeping_.exchange(false))
+      wake();
+  }
+
+  void flush() {
+    const uint64_t target = tail_.load(std::memory_order_acquire);
+    wake();
+    const auto give_up =
+        std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (written_.load(std::memory_order_acquire) < target &&
+           std::chrono::steady_clock::now() < give_up)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+private:
+  struct Slot {
+    Record record;
+    std::atomic<uint64_t> sequence;
+  };
+  static_assert(std::is_standard_layout_v<Slot>);
+
+  void wake() {
+    wakeups_.fetch_add(1, std::memory_order_release);
+    wakeups_.notify_one();
+  }
+
+  void run() {
+    pthread_setname_np(pthread_self(), "log");
+    fmt::memory_buffer out;
+    for (;;) {
+      const uint32_t seen = wakeups_.load(std::memory_order_acquire);
+      write_ready(out);
+
+      sleeping_.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      // Anything committed before the producer saw us sleeping
+      if (ready())
+        sleeping_.store(false, std::memory_order_relaxed);
+      else
+        wakeups_.wait(seen, std::memory_order_acquire);
+    }
+  }
+
+  bool ready() const {
+    const Slot &slot = slots_[head_ & (LOG_RING_SLOTS - 1)];
+    return slot.sequence.load(std::memory_order_acquire) == head_ + 1;
+  }
+
+  // Format everything that's been committed, and write it in one go
+  void write_ready(fmt::memory_buffer &out) {
+    out.clear();
+    while (ready()) {
+      Slot &slot = slots_[head_ & (LOG_RING_SLOTS - 1)];
+      format(slot.record, out);
+      slot.sequence.store(head_ + LOG_RING_SLOTS, std::memory_order_release);
+      head_++;
+    }
+    if (const uint64_t dropped =
+            dropped_.exchange(0, std::memory_order_relaxed)) {
+      fmt::format_to(std::back_inserter(out),
+                     "WARN: logging fell behind, {} messages dropped\n",
+                     dropped);
+    }
+    if (out.size() > 0) {
+      std::fwrite(out.data(), 1, out.size(), stderr);
+      std::fflush(stderr);
+    }
+    written_.store(head_, std::memory_order_release);
+  }
+
+  static void format(const Record &record, fmt::memory_buffer &out) {
+    const time_t seconds = record.time_us / 1'000'000;
+    tm local{};
+    localtime_r(&seconds, &local);
+    fmt::format_to(std::back_inserter(out), "{:02}:{:02}:{:02}.{:03} ",
+                   local.tm_hour, local.tm_min, local.tm_sec,
+                   record.time_us / 1000 % 1000);
+    switch (record.site->level) {
+    case LogLevel::WARN:
+      fmt::format_to(std::back_inserter(out), "WARN: ");
+      break;
+    case LogLevel::ERROR:
+      fmt::format_to(std::back_inserter(out), "ERROR: ");
+      break;
+    default:
+      break;
+    }
+
+    try {
+      record.format_args(record, out);
+    } catch (const fmt::format_error &e) {
+      // Checked at compile time, so only for specs that depend on values
+      fmt::format_to(std::back_inserter(out), "[bad log format \"{}\": {}]",
+                     std::string_view(record.format.data(),
+                                      record.format.size()),
+                     e.what());
+    }
+    if (record.suppressed > 0) {
+      fmt::format_to(std::back_inserter(out), " ({} more suppressed)",
+                     record.suppressed);
+    }
+    out.push_back('\n');
+  }
+
+  std::unique_ptr<Slot[]> slots_{new Slot[LOG_RING_SLOTS]};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  alignas(64) std::atomic<uint64_t> dropped_{0};
+  std::atomic<bool> sleeping_{false};
+  std::atomic<uint32_t> wakeups_{0};
+
+  // Only touched from the writer thread, but for written_
+  alignas(64) uint64_t head_ = 0;
+  std::atomic<uint64_t> written_{0};
+
+  std::thread thread_;
+};
+
+Record *Claim() { return Writer::Default().claim(); }
+
+void Commit(Record *record) { Writer::Default().commit(record); }
+
+} // namespace logging
+
+void SetLogLevel(LogLevel level) {
+  logging::level.store(level, std::memory_order_relaxed);
+}
+
+void FlushLog() { logging::Writer::Default().flush(); }
@@ -0,0 +1,189 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fmt/format.h>
+#include <iterator>
+#include <new>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+/**
+ * Logging that's safe to leave in the encode and network paths.
+ *
+ *   LOG_WARN("couldn't open encoder at {}x{}: {}", width, height, e.what());
+ *   LOG_WARN_EVERY(1000, "RTP send: {}", std::strerror(errno));
+ *
+ * A message below the current level (SetLogLevel) costs one relaxed load;
+ * its arguments aren't even evaluated. Otherwise the arguments are copied,
+ * strings included, into a slot of a lock-free ring, and formatted and
+ * written to stderr by a thread of our own. Nothing on the calling thread
+ * blocks or allocates. If the ring's full the message is dropped, and the
+ * drop counted in the output.
+ *
+ * The _EVERY variants let through at most one message per that many
+ * milliseconds from that line of code, saying how many were held back in
+ * between. Use them anywhere that can fail once per packet or frame.
+ */
+
+enum class LogLevel {
+  VERBOSE,
+  INFO,
+  WARN,
+  ERROR,
+};
+
+/** Messages below level are skipped. Defaults to INFO. */
+void SetLogLevel(LogLevel level);
+
+/** Wait (up to a second) for everything logged so far to be written */
+void FlushLog();
+
+namespace logging {
+
+inline std::atomic<LogLevel> level{LogLevel::INFO};
+
+inline bool Enabled(LogLevel at) {
+  return at >= level.load(std::memory_order_relaxed);
+}
+
+/** One LOG_ macro in the code, for rate limiting */
+struct Site {
+  LogLevel level;
+  // At most one message per this long, or 0 for no limit
+  int64_t interval_us;
+  std::atomic<int64_t> next_us{0};
+  std::atomic<uint32_t> suppressed{0};
+
+  /**
+   * Whether a message from here may go out now. If so, held_back is how
+   * many were held back since the last one that did.
+   */
+  bool admit(uint32_t &held_back);
+};
+
+// A string argument, copied into the record after the arguments
+struct StringRef {
+  uint16_t offset, size;
+};
+
+// How an argument is kept in a record: strings by StringRef, anything else
+// by value
+template <typename T>
+using Captured =
+    std::conditional_t<std::is_convertible_v<const T &, std::string_view>,
+                       StringRef, std::decay_t<T>>;
+
+constexpr size_t RECORD_BYTES = 448;
+
+struct Record {
+  const Site *site;
+  // Wall clock, microseconds since the epoch
+  int64_t time_us;
+  uint32_t suppressed;
+  fmt::string_view format;
+  // Formats the arguments in data, which vary by call site
+  void (*format_args)(const Record &, fmt::memory_buffer &);
+  alignas(16) unsigned char data[RECORD_BYTES];
+};
+
+/** A free record in the ring, or nullptr if it's full (the drop is counted) */
+Record *Claim();
+/** Hand a claimed record to the writer thread */
+void Commit(Record *record);
+int64_t WallClockUs();
+
+template <typename T> auto Restore(const Record &record, const T &arg) {
+  if constexpr (std::is_same_v<T, StringRef>) {
+    return std::string_view(
+        reinterpret_cast<const char *>(record.data) + arg.offset, arg.size);
+  } else {
+    return arg;
+  }
+}
+
+template <typename Tuple>
+void FormatArgs(const Record &record, fmt::memory_buffer &out) {
+  const auto &captured =
+      *std::launder(reinterpret_cast<const Tuple *>(record.data));
+  // make_format_args wants lvalues
+  auto args = std::apply(
+      [&](const auto &...arg) {
+        return std::make_tuple(Restore(record, arg)...);
+      },
+      captured);
+  std::apply(
+      [&](auto &...arg) {
+        fmt::vformat_to(std::back_inserter(out), record.format,
+                        fmt::make_format_args(arg...));
+      },
+      args);
+}
+
+template <typename T>
+Captured<T> Capture(Record &record, size_t &used, const T &arg) {
+  if constexpr (std::is_same_v<Captured<T>, StringRef>) {
+    // Truncated to whatever room's left
+    const std::string_view s = arg;
+    const size_t size = std::min(s.size(), RECORD_BYTES - used);
+    std::memcpy(record.data + used, s.data(), size);
+    const StringRef ref{static_cast<uint16_t>(used),
+                        static_cast<uint16_t>(size)};
+    used += size;
+    return ref;
+  } else {
+    static_assert(std::is_trivially_copyable_v<Captured<T>>,
+                  "log arguments are copied to another thread, so must be "
+                  "strings or trivially copyable");
+    return arg;
+  }
+}
+
+template <typename... Args>
+void Log(Site &site, fmt::format_string<Args...> format, Args &&...args) {
+  uint32_t suppressed;
+  if (!site.admit(suppressed))
+    return;
+  Record *record = Claim();
+  if (!record)
+    return;
+
+  using Tuple = std::tuple<Captured<std::remove_cvref_t<Args>>...>;
+  static_assert(sizeof(Tuple) <= RECORD_BYTES && alignof(Tuple) <= 16,
+                "too many log arguments");
+  record->site = &site;
+  record->time_us = WallClockUs();
+  record->suppressed = suppressed;
+  record->format = format;
+  record->format_args = &FormatArgs<Tuple>;
+  // Strings go after the arguments. Braces, so they're captured in order.
+  [[maybe_unused]] size_t used = sizeof(Tuple);
+  new (record->data) Tuple{Capture(*record, used, args)...};
+  Commit(record);
+}
+
+} // namespace logging
+
+#define LOG_AT(at, every_ms, ...)                                              \
+  do {                                                                         \
+    static ::logging::Site log_site_{(at), (every_ms) * 1000};                 \
+    if (::logging::Enabled(at))                                                \
+      ::logging::Log(log_site_, __VA_ARGS__);                                  \
+  } while (0)
+
+#define LOG_VERBOSE(...) LOG_AT(LogLevel::VERBOSE, 0, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LogLevel::INFO, 0, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LogLevel::WARN, 0, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::ERROR, 0, __VA_ARGS__)
+
+#define LOG_INFO_EVERY(ms, ...) LOG_AT(LogLevel::INFO, ms, __VA_ARGS__)
+#define LOG_WARN_EVERY(ms, ...) LOG_AT(LogLevel::WARN, ms, __VA_ARGS__)
@@ -0,0 +1,81 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "NalUnits.hpp"
+#include <algorithm>
+
+// Returns the index of the first byte after the next 00 00 01 start code at
+// or after `from`, or data.size() if there isn't one
+static size_t next_nal_start(std::span<const uint8_t> data, size_t from) {
+  for (size_t i = from; i + 2 < data.size(); ++i) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+      return i + 3;
+  }
+  return data.size();
+}
+
+std::vector<std::span<const uint8_t>>
+SplitAnnexB(std::span<const uint8_t> data) {
+  std::vector<std::span<const uint8_t>> nals;
+
+  size_t start = next_nal_start(data, 0);
+  while (start < data.size()) {
+    size_t next = next_nal_start(data, start);
+
+    // Back up over the start code, and the leading zero of a 4-byte start
+    // code (and any trailing_zero_8bits) so they aren't part of this NAL
+    size_t end = next == data.size() ? next : next - 3;
+    while (end > start && data[end - 1] == 0)
+      --end;
+
+    if (end > start)
+      nals.push_back(data.subspan(start, end - start));
+    start = next;
+  }
+
+  return nals;
+}
+
+// Replace a stored parameter set, noting whether it changed
+static void StoreParameterSet(std::vector<uint8_t> &stored,
+                              std::span<const uint8_t> nal,
+                              AccessUnitInfo &info) {
+  if (std::equal(stored.begin(), stored.end(), nal.begin(), nal.end()))
+    return;
+  stored.assign(nal.begin(), nal.end());
+  info.new_parameter_sets = true;
+}
+
+AccessUnitInfo ScanAccessUnit(VideoCodec codec, std::span<const uint8_t> au,
+                              ParameterSets &params) {
+  AccessUnitInfo info;
+  for (auto nal : SplitAnnexB(au)) {
+    if (codec == VideoCodec::H264) {
+      switch (H264NalType(nal)) {
+      case H264_NAL_IDR:
+        info.keyframe = true;
+        break;
+      case H264_NAL_SPS:
+        StoreParameterSet(params.sps, nal, info);
+        break;
+      case H264_NAL_PPS:
+        StoreParameterSet(params.pps, nal, info);
+        break;
+      }
+      continue;
+    }
+
+    const int type = HevcNalType(nal);
+    if (type >= HEVC_NAL_BLA_W_LP && type <= HEVC_NAL_IRAP_RESERVED_23)
+      info.keyframe = true;
+    else if (type == HEVC_NAL_VPS)
+      StoreParameterSet(params.vps, nal, info);
+    else if (type == HEVC_NAL_SPS)
+      StoreParameterSet(params.sps, nal, info);
+    else if (type == HEVC_NAL_PPS)
+      StoreParameterSet(params.pps, nal, info);
+  }
+  return info;
+}
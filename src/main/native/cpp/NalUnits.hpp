@@ -0,0 +1,85 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+enum class VideoCodec {
+  HEVC,
+  H264,
+};
+
+// HEVC NAL unit types we care about (ITU-T H.265 table 7-1). 16 to 23 are
+// IRAP pictures, which decoding can start from.
+constexpr int HEVC_NAL_BLA_W_LP = 16;
+constexpr int HEVC_NAL_IDR_W_RADL = 19;
+constexpr int HEVC_NAL_IDR_N_LP = 20;
+constexpr int HEVC_NAL_IRAP_RESERVED_23 = 23;
+constexpr int HEVC_NAL_VPS = 32;
+constexpr int HEVC_NAL_SPS = 33;
+constexpr int HEVC_NAL_PPS = 34;
+
+// H.264 NAL unit types we care about (ITU-T H.264 table 7-1)
+constexpr int H264_NAL_IDR = 5;
+constexpr int H264_NAL_SPS = 7;
+constexpr int H264_NAL_PPS = 8;
+
+/**
+ * Split an Annex-B byte stream (as produced by avcodec_receive_packet) into
+ * its NAL units. Start codes are stripped; the returned spans point into
+ * `data`.
+ */
+std::vector<std::span<const uint8_t>>
+SplitAnnexB(std::span<const uint8_t> data);
+
+/** NAL unit type from the 2-byte HEVC NAL header. */
+inline int HevcNalType(std::span<const uint8_t> nal) {
+  return nal.empty() ? -1 : (nal[0] >> 1) & 0x3F;
+}
+
+/**
+ * TemporalId from the 2-byte HEVC NAL header: 0 for the base layer, and a
+ * picture never references one with a higher id than its own.
+ */
+inline int HevcTemporalId(std::span<const uint8_t> nal) {
+  return nal.size() < 2 ? 0 : (nal[1] & 0x07) - 1;
+}
+
+inline bool HevcIsIdr(std::span<const uint8_t> nal) {
+  int type = HevcNalType(nal);
+  return type == HEVC_NAL_IDR_W_RADL || type == HEVC_NAL_IDR_N_LP;
+}
+
+/** NAL unit type from the 1-byte H.264 NAL header. */
+inline int H264NalType(std::span<const uint8_t> nal) {
+  return nal.empty() ? -1 : nal[0] & 0x1F;
+}
+
+/** A stream's parameter sets, as NAL units without start codes */
+struct ParameterSets {
+  // HEVC only
+  std::vector<uint8_t> vps;
+  std::vector<uint8_t> sps;
+  std::vector<uint8_t> pps;
+
+  bool operator==(const ParameterSets &) const = default;
+};
+
+struct AccessUnitInfo {
+  // Decoding can start here: an IDR, or for HEVC any IRAP picture
+  bool keyframe = false;
+  // It carried parameter sets that differ from what we had
+  bool new_parameter_sets = false;
+};
+
+/**
+ * Look through an Annex-B access unit for what a server needs to know about
+ * it without decoding it. Parameter sets found in it replace those in params.
+ */
+AccessUnitInfo ScanAccessUnit(VideoCodec codec, std::span<const uint8_t> au,
+                              ParameterSets &params);
@@ -0,0 +1,164 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "Pacer.hpp"
+#include "Logging.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// Most a polled pacer sends before giving its thread back. Anything left due
+// goes on the next poll, so a keyframe to a lot of clients doesn't hold up
+// the rest of an I/O loop's work.
+constexpr int MAX_SENDS_PER_POLL = 64;
+
+PacedSocket::~PacedSocket() {
+  if (fd >= 0)
+    close(fd);
+}
+
+Pacer::Pacer() : thread_([this] { run(); }) {}
+
+Pacer::Pacer(Polled) {
+  // steady_clock is CLOCK_MONOTONIC, so deadlines go straight in
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd_ < 0)
+    throw std::runtime_error(std::string("timerfd_create: ") +
+                             std::strerror(errno));
+}
+
+Pacer::~Pacer() {
+  if (polled()) {
+    close(timer_fd_);
+    return;
+  }
+  {
+    std::scoped_lock lock{mutex_};
+    stop_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+Pacer &Pacer::Default() {
+  static Pacer pacer;
+  return pacer;
+}
+
+void Pacer::schedule(std::shared_ptr<PacedSocket> sock,
+                     std::span<const uint8_t> data, Clock::time_point when,
+                     Clock::time_point txtime) {
+  sock->queued++;
+
+  bool wake;
+  {
+    std::scoped_lock lock{mutex_};
+    // Only need to wake the thread if this is now the earliest deadline
+    wake = queue_.empty() || when < queue_.top().when;
+    queue_.push(Entry{when, next_order_++, txtime, std::move(sock),
+                      std::vector<uint8_t>(data.begin(), data.end())});
+    if (wake && polled())
+      arm(when);
+  }
+  if (wake && !polled())
+    cv_.notify_one();
+}
+
+void Pacer::arm(Clock::time_point when) {
+  using namespace std::chrono;
+  // Zero would disarm it, but the monotonic clock is well past that already
+  const auto ns = duration_cast<nanoseconds>(when.time_since_epoch()).count();
+  itimerspec spec{};
+  spec.it_value.tv_sec = ns / 1'000'000'000;
+  spec.it_value.tv_nsec = ns % 1'000'000'000;
+  // Goes off straight away if that's already passed
+  if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+    LOG_ERROR("timerfd_settime: {}", std::strerror(errno));
+}
+
+void Pacer::send_due() {
+  uint64_t expirations;
+  if (read(timer_fd_, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    LOG_WARN_EVERY(1000, "pacer timer: {}", std::strerror(errno));
+
+  std::unique_lock lock{mutex_};
+  for (int sends = 0; sends < MAX_SENDS_PER_POLL; sends++) {
+    if (queue_.empty() || queue_.top().when > Clock::now())
+      break;
+    // priority_queue::top is const, but we're about to pop it anyway
+    Entry entry = std::move(const_cast<Entry &>(queue_.top()));
+    queue_.pop();
+
+    lock.unlock();
+    Send(*entry.sock, entry.data, entry.txtime);
+    entry.sock->queued--;
+    lock.lock();
+  }
+  // Straight away again if we stopped short
+  if (!queue_.empty())
+    arm(queue_.top().when);
+}
+
+void Pacer::Send(PacedSocket &sock, std::span<const uint8_t> data,
+                 Clock::time_point txtime) {
+  ssize_t sent;
+  if (txtime == Clock::time_point{}) {
+    sent = send(sock.fd, data.data(), data.size(), 0);
+  } else {
+    // steady_clock is CLOCK_MONOTONIC, which is what SO_TXTIME was asked for
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            txtime.time_since_epoch())
+                            .count();
+    iovec iov{const_cast<uint8_t *>(data.data()), data.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(ns))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_TXTIME;
+    cm->cmsg_len = CMSG_LEN(sizeof(ns));
+    std::memcpy(CMSG_DATA(cm), &ns, sizeof(ns));
+    sent = sendmsg(sock.fd, &msg, 0);
+  }
+  if (sent < 0) {
+    if (errno == ENOBUFS || errno == EAGAIN)
+      sock.refused++;
+    LOG_WARN_EVERY(1000, "RTP send: {}", std::strerror(errno));
+  }
+}
+
+void Pacer::run() {
+  std::unique_lock lock{mutex_};
+  while (!stop_) {
+    if (queue_.empty()) {
+      cv_.wait(lock);
+      continue;
+    }
+
+    auto when = queue_.top().when;
+    if (Clock::now() < when) {
+      cv_.wait_until(lock, when);
+      continue;
+    }
+
+    // priority_queue::top is const, but we're about to pop it anyway
+    Entry entry = std::move(const_cast<Entry &>(queue_.top()));
+    queue_.pop();
+
+    lock.unlock();
+    Send(*entry.sock, entry.data, entry.txtime);
+    entry.sock->queued--;
+    lock.lock();
+  }
+}
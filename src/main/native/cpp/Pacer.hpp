@@ -0,0 +1,116 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <span>
+#include <thread>
+#include <vector>
+
+/**
+ * A connected UDP socket whose datagrams may be sent later by a Pacer.
+ * Shared with the pacer so the fd outlives any packets still queued on it.
+ */
+struct PacedSocket {
+  explicit PacedSocket(int fd) : fd(fd) {}
+  ~PacedSocket();
+  PacedSocket(const PacedSocket &) = delete;
+  PacedSocket &operator=(const PacedSocket &) = delete;
+
+  const int fd;
+  // Datagrams handed to the pacer and not sent yet. While this is nonzero,
+  // anything else for this socket has to queue behind them to stay in order.
+  std::atomic<int> queued{0};
+  // Datagrams the kernel turned away for lack of room (ENOBUFS, EAGAIN),
+  // whoever sent them. Reset by whoever's keeping an eye on it.
+  std::atomic<uint32_t> refused{0};
+};
+
+/**
+ * Sends datagrams at scheduled times, so the encode thread never sleeps to
+ * pace output. Either from a thread of its own, or polled: from whichever
+ * thread watches fd(), such as an I/O loop, which then sends everything its
+ * clients are sent.
+ */
+class Pacer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /** Sends from a thread of its own */
+  Pacer();
+
+  struct Polled {};
+  /**
+   * Sends only from send_due(), to be called whenever fd() polls readable.
+   * Senders hand a polled pacer every datagram, even ones due right away, so
+   * they all leave from the thread polling it.
+   */
+  explicit Pacer(Polled);
+
+  ~Pacer();
+  Pacer(const Pacer &) = delete;
+  Pacer &operator=(const Pacer &) = delete;
+
+  /**
+   * Copy `data` and send it on `sock` at (or just after) `when`. A txtime
+   * goes along with it as its SO_TXTIME departure time, for the kernel to
+   * hold it until.
+   */
+  void schedule(std::shared_ptr<PacedSocket> sock,
+                std::span<const uint8_t> data, Clock::time_point when,
+                Clock::time_point txtime = {});
+
+  bool polled() const { return timer_fd_ >= 0; }
+
+  /** A timerfd, readable once something's due. Polled pacers only. */
+  int fd() const { return timer_fd_; }
+
+  /** Send everything that's due. Polled pacers only. */
+  void send_due();
+
+  /**
+   * Send data on sock right away, with txtime as its SO_TXTIME departure time
+   * if it has one, counting it as refused if the kernel has no room
+   */
+  static void Send(PacedSocket &sock, std::span<const uint8_t> data,
+                   Clock::time_point txtime = {});
+
+  /** Process-wide pacer, started on first use */
+  static Pacer &Default();
+
+private:
+  struct Entry {
+    Clock::time_point when;
+    uint64_t order; // FIFO between entries due at the same time
+    Clock::time_point txtime;
+    std::shared_ptr<PacedSocket> sock;
+    std::vector<uint8_t> data;
+  };
+  struct Later {
+    bool operator()(const Entry &a, const Entry &b) const {
+      return a.when != b.when ? a.when > b.when : a.order > b.order;
+    }
+  };
+
+  void run();
+  // Have fd() go readable at `when`. Called with mutex_ held.
+  void arm(Clock::time_point when);
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::priority_queue<Entry, std::vector<Entry>, Later> queue_;
+  uint64_t next_order_ = 0;
+  bool stop_ = false;
+  // Polled pacers have the timer, and the rest the thread
+  int timer_fd_ = -1;
+  std::thread thread_;
+};
@@ -0,0 +1,619 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "RtpSender.hpp"
+#include "Logging.hpp"
+#include "NalUnits.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <ifaddrs.h>
+#include <linux/net_tstamp.h>
+#include <linux/netlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <random>
+#include <stdexcept>
+#include <linux/sockios.h>
+#include <memory>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+constexpr size_t RTP_HEADER_SIZE = 12;
+constexpr uint8_t RTCP_SR = 200;
+constexpr uint8_t RTCP_RR = 201;
+constexpr uint8_t RTCP_SDES = 202;
+constexpr uint8_t RTCP_BYE = 203;
+constexpr int HEVC_NAL_FU = 49;
+constexpr int H264_NAL_FU_A = 28;
+
+// Seconds between 1900 (NTP epoch) and 1970 (Unix epoch)
+constexpr uint64_t NTP_UNIX_OFFSET = 2208988800ULL;
+
+// Drop a temporal layer for a client reporting more loss than this, and add
+// one back after this many reports in a row under the recover threshold
+constexpr double TEMPORAL_LAYER_DROP_LOSS = 0.05;
+constexpr double TEMPORAL_LAYER_RECOVER_LOSS = 0.01;
+constexpr int TEMPORAL_LAYER_RECOVER_REPORTS = 3;
+// Least time between drops for send backlog
+constexpr auto TEMPORAL_LAYER_HOLD = std::chrono::milliseconds(500);
+// The kernel counts unsent bytes (SIOCOUTQ) by buffer size, which is up to
+// about twice the payload for full size packets
+constexpr size_t KERNEL_BYTES_PER_PAYLOAD_BYTE = 2;
+
+static void put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+// Bind a UDP socket to a local port and connect() it to ip:port, so we can
+// just send(), and only hear back from that peer
+static int open_udp(const addrinfo *dest, int local_port) {
+  int fd = socket(dest->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+
+  sockaddr_storage local{};
+  socklen_t local_len;
+  if (dest->ai_family == AF_INET6) {
+    auto *sin6 = reinterpret_cast<sockaddr_in6 *>(&local);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_addr = in6addr_any;
+    sin6->sin6_port = htons(local_port);
+    local_len = sizeof(sockaddr_in6);
+  } else {
+    auto *sin = reinterpret_cast<sockaddr_in *>(&local);
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_ANY);
+    sin->sin_port = htons(local_port);
+    local_len = sizeof(sockaddr_in);
+  }
+
+  if (bind(fd, reinterpret_cast<sockaddr *>(&local), local_len) < 0 ||
+      connect(fd, dest->ai_addr, dest->ai_addrlen) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+struct AddrinfoDeleter {
+  void operator()(addrinfo *res) const { freeaddrinfo(res); }
+};
+using AddrinfoPtr = std::unique_ptr<addrinfo, AddrinfoDeleter>;
+
+static AddrinfoPtr resolve(const std::string &ip, int port) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+  addrinfo *res = nullptr;
+  int ret =
+      getaddrinfo(ip.c_str(), std::to_string(port).c_str(), &hints, &res);
+  if (ret != 0)
+    throw std::runtime_error("getaddrinfo(" + ip + "): " + gai_strerror(ret));
+  return AddrinfoPtr(res);
+}
+
+// Index of the interface a connected socket sends out of: the one holding
+// the local address the kernel picked for the route, or 0 if we can't tell
+static unsigned egress_ifindex(int fd) {
+  sockaddr_storage local{};
+  socklen_t len = sizeof(local);
+  if (getsockname(fd, reinterpret_cast<sockaddr *>(&local), &len) < 0)
+    return 0;
+
+  ifaddrs *addrs = nullptr;
+  if (getifaddrs(&addrs) < 0)
+    return 0;
+  unsigned index = 0;
+  for (ifaddrs *ifa = addrs; ifa && !index; ifa = ifa->ifa_next) {
+    if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != local.ss_family)
+      continue;
+    bool match;
+    if (local.ss_family == AF_INET6) {
+      match = std::memcmp(
+                  &reinterpret_cast<sockaddr_in6 *>(ifa->ifa_addr)->sin6_addr,
+                  &reinterpret_cast<sockaddr_in6 *>(&local)->sin6_addr,
+                  sizeof(in6_addr)) == 0;
+    } else {
+      match = reinterpret_cast<sockaddr_in *>(ifa->ifa_addr)->sin_addr.s_addr ==
+              reinterpret_cast<sockaddr_in *>(&local)->sin_addr.s_addr;
+    }
+    if (match)
+      index = if_nametoindex(ifa->ifa_name);
+  }
+  freeifaddrs(addrs);
+  return index;
+}
+
+// Whether every packet out of this interface goes through an fq qdisc, the
+// only one that actually holds packets until their SO_TXTIME (others send
+// them immediately). That's fq at the root, or fq on every queue of a
+// multiqueue device. Asks rtnetlink for the interface's qdiscs.
+static bool interface_uses_fq(unsigned ifindex) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd < 0)
+    return false;
+
+  struct {
+    nlmsghdr hdr;
+    tcmsg tc;
+  } request{};
+  request.hdr.nlmsg_len = sizeof(request);
+  request.hdr.nlmsg_type = RTM_GETQDISC;
+  request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.tc.tcm_family = AF_UNSPEC;
+  request.tc.tcm_ifindex = ifindex;
+  if (send(fd, &request, sizeof(request), 0) < 0) {
+    close(fd);
+    return false;
+  }
+
+  // Root qdisc's kind and handle, and whether everything under it is fq
+  std::string root_kind;
+  uint32_t root_handle = 0;
+  std::vector<std::pair<uint32_t, std::string>> children; // parent, kind
+  alignas(nlmsghdr) char buf[16384];
+  bool done = false;
+  while (!done) {
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    if (len <= 0)
+      break;
+    for (auto *hdr = reinterpret_cast<nlmsghdr *>(buf);
+         NLMSG_OK(hdr, static_cast<unsigned>(len));
+         hdr = NLMSG_NEXT(hdr, len)) {
+      if (hdr->nlmsg_type == NLMSG_DONE || hdr->nlmsg_type == NLMSG_ERROR) {
+        done = true;
+        break;
+      }
+      if (hdr->nlmsg_type != RTM_NEWQDISC)
+        continue;
+      const auto *tc = static_cast<const tcmsg *>(NLMSG_DATA(hdr));
+      // Older kernels ignore the ifindex filter on dumps
+      if (tc->tcm_ifindex != static_cast<int>(ifindex))
+        continue;
+
+      std::string kind;
+      int attr_len = hdr->nlmsg_len - NLMSG_LENGTH(sizeof(*tc));
+      for (auto *attr = reinterpret_cast<const rtattr *>(
+               reinterpret_cast<const char *>(tc) + NLMSG_ALIGN(sizeof(*tc)));
+           RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+        if (attr->rta_type == TCA_KIND)
+          kind = static_cast<const char *>(RTA_DATA(attr));
+      }
+      if (tc->tcm_parent == TC_H_ROOT) {
+        root_kind = kind;
+        root_handle = tc->tcm_handle;
+      } else {
+        children.emplace_back(tc->tcm_parent, kind);
+      }
+    }
+  }
+  close(fd);
+
+  if (root_kind == "fq")
+    return true;
+  if (root_kind != "mq")
+    return false;
+  bool all_fq = false;
+  for (const auto &[parent, kind] : children) {
+    if (TC_H_MAJ(parent) != TC_H_MAJ(root_handle))
+      continue;
+    if (kind != "fq")
+      return false;
+    all_fq = true;
+  }
+  return all_fq;
+}
+
+static bool enable_kernel_txtime(int fd) {
+  const unsigned ifindex = egress_ifindex(fd);
+  if (!ifindex || !interface_uses_fq(ifindex))
+    return false;
+
+  sock_txtime cfg{};
+  cfg.clockid = CLOCK_MONOTONIC;
+  return setsockopt(fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == 0;
+}
+
+RtpSsrcs RtpSsrcs::Random() {
+  std::random_device rd;
+  RtpSsrcs ssrcs{rd(), rd()};
+  while (ssrcs.fec == ssrcs.media)
+    ssrcs.fec = rd();
+  return ssrcs;
+}
+
+RtpSender::RtpSender(const std::string &dest_ip, int dest_port,
+                     const FecSettings &fec, VideoCodec codec, Pacer &pacer,
+                     const RtpSsrcs &ssrcs)
+    : codec_(codec), pacer_(pacer), ssrc_(ssrcs.media), fec_settings_(fec),
+      fec_(FEC_PAYLOAD_TYPE, ssrcs.fec,
+           [this](std::span<const uint8_t> pkt) { send_datagram(pkt); }) {
+  std::random_device rd;
+  seq_ = rd() & 0xFFFF;
+  ts_offset_ = rd();
+
+  // ── Bind an even/odd local port pair, like RFC 3550 expects ─────────────
+  const AddrinfoPtr rtp_dest = resolve(dest_ip, dest_port);
+  const AddrinfoPtr rtcp_dest = resolve(dest_ip, dest_port + 1);
+  for (int attempt = 0; attempt < 64 && rtcp_fd_ < 0; ++attempt) {
+    int port = 20000 + 2 * (rd() % 10000);
+    int rtp_fd = open_udp(rtp_dest.get(), port);
+    if (rtp_fd < 0)
+      continue;
+    rtcp_fd_ = open_udp(rtcp_dest.get(), port + 1);
+    if (rtcp_fd_ < 0) {
+      close(rtp_fd);
+      continue;
+    }
+    rtp_sock_ = std::make_shared<PacedSocket>(rtp_fd);
+    local_port_ = port;
+  }
+  if (rtcp_fd_ < 0)
+    throw std::runtime_error("Couldn't bind an RTP/RTCP port pair for " +
+                             dest_ip + ":" + std::to_string(dest_port));
+
+  fec_.configure(fec.group_size, fec.interleave);
+
+  kernel_txtime_ = enable_kernel_txtime(rtp_sock_->fd);
+
+  pkt_buf_.resize(MAX_PACKET_SIZE);
+}
+
+RtpSender::~RtpSender() {
+  send_bye();
+  // rtp_sock_ closes itself once the pacer is done with it
+  close(rtcp_fd_);
+}
+
+void RtpSender::set_temporal_layers(int layers) {
+  layers = std::max(layers, 1);
+  // H.264 has no TemporalId outside of SVC, which we don't produce
+  if (codec_ != VideoCodec::HEVC)
+    layers = 1;
+  // Start (or stay) at the full rate unless we'd already backed off
+  if (max_temporal_id_ >= temporal_layers_ - 1)
+    max_temporal_id_ = layers - 1;
+  max_temporal_id_ = std::min(max_temporal_id_, layers - 1);
+  temporal_layers_ = layers;
+}
+
+void RtpSender::drop_temporal_layer(const char *why) {
+  if (max_temporal_id_ == 0)
+    return;
+  max_temporal_id_--;
+  good_reports_ = 0;
+  last_layer_drop_ = Pacer::Clock::now();
+  LOG_INFO("RTP {:08X}: {}, dropping to {} temporal layer(s)", ssrc_, why,
+           max_temporal_id_ + 1);
+}
+
+void RtpSender::send_access_unit(std::span<const uint8_t> au, int64_t pts) {
+  // Once a frame is plenty often to pick up receiver reports
+  poll_rtcp();
+
+  const double interval_s = 1.0 / std::max(pacing_.fps, 1);
+  auto nals = SplitAnnexB(au);
+
+  // ── Leave out pictures above this client's temporal layer ───────────────
+  if (temporal_layers_ > 1) {
+    // Give each drop a moment to take effect before dropping another
+    const auto now = Pacer::Clock::now();
+    if (send_backlogged(now) && now - last_layer_drop_ > TEMPORAL_LAYER_HOLD)
+      drop_temporal_layer("send backlog");
+
+    std::erase_if(nals, [this](const auto &nal) {
+      return HevcTemporalId(nal) > max_temporal_id_;
+    });
+  }
+  size_t bytes = 0;
+  for (const auto &nal : nals)
+    bytes += nal.size();
+  last_frame_bytes_ = bytes;
+
+  // Send at the target bitrate, or faster if that's what it takes to get this
+  // frame out within its share of the frame interval
+  pace_bytes_per_sec_ =
+      std::max(pacing_.bitrate / 8.0, bytes / (pacing_.spread * interval_s));
+
+  for (size_t i = 0; i < nals.size(); ++i)
+    send_nal(nals[i], pts, i + 1 == nals.size());
+}
+
+/**
+ * Whether packets we've sent aren't getting out: the kernel turned some away
+ * since we last looked, or some are still waiting (in the pacer, or the
+ * socket's queue) after the time they were all due to leave. Our own pacing
+ * only ever holds packets back until then, so anything past it is the link
+ * not keeping up.
+ */
+bool RtpSender::send_backlogged(Pacer::Clock::time_point now) {
+  if (rtp_sock_->refused.exchange(0) > 0)
+    return true;
+  if (now < next_send_)
+    return false;
+  if (rtp_sock_->queued > 0)
+    return true;
+  // Left the socket, but still in the qdisc or the driver. Some always is,
+  // so only count a frame's worth.
+  int unsent = 0;
+  if (ioctl(rtp_sock_->fd, SIOCOUTQ, &unsent) < 0)
+    return false;
+  return static_cast<size_t>(unsent) >
+         KERNEL_BYTES_PER_PAYLOAD_BYTE * std::max<size_t>(last_frame_bytes_,
+                                                           MAX_PACKET_SIZE);
+}
+
+void RtpSender::send_nal(std::span<const uint8_t> nal, int64_t pts,
+                         bool last_in_frame) {
+  if (nal.size() < 2)
+    return;
+
+  uint32_t timestamp = ts_offset_ + static_cast<uint32_t>(pts);
+  maybe_send_sender_report(timestamp);
+
+  // Leave room for the FEC header, so repair packets still fit the MTU
+  const size_t max_payload =
+      MAX_PACKET_SIZE - RTP_HEADER_SIZE -
+      (fec_settings_.group_size > 0 ? FlexFecEncoder::MAX_OVERHEAD : 0);
+
+  // ── Single NAL unit packet ───────────────────────────────────────────────
+  if (nal.size() <= max_payload) {
+    send_rtp({}, nal, timestamp, last_in_frame);
+    return;
+  }
+
+  // ── Fragmentation units ──────────────────────────────────────────────────
+  if (codec_ == VideoCodec::H264) {
+    // FU-A (RFC 6184 section 5.8): the FU indicator keeps F and NRI from the
+    // NAL header with type 28, and the FU header carries the original type
+    // plus start/end bits
+    const uint8_t fu_indicator = (nal[0] & 0xE0) | H264_NAL_FU_A;
+    send_fragments({&fu_indicator, 1}, nal.subspan(1), H264NalType(nal),
+                   max_payload, timestamp, last_in_frame);
+  } else {
+    // RFC 7798 section 4.4.3: PayloadHdr keeps F, LayerId and TID from the
+    // NAL header but with type 49
+    const uint8_t payload_hdr[2] = {
+        static_cast<uint8_t>((nal[0] & 0x81) | (HEVC_NAL_FU << 1)), nal[1]};
+    send_fragments(payload_hdr, nal.subspan(2), HevcNalType(nal), max_payload,
+                   timestamp, last_in_frame);
+  }
+}
+
+void RtpSender::send_fragments(std::span<const uint8_t> payload_hdr,
+                               std::span<const uint8_t> body,
+                               uint8_t nal_type, size_t max_payload,
+                               uint32_t timestamp, bool last_in_frame) {
+  // Payload header, then the one byte FU header, then a piece of the body
+  uint8_t hdr[3];
+  std::memcpy(hdr, payload_hdr.data(), payload_hdr.size());
+  const size_t hdr_len = payload_hdr.size() + 1;
+
+  const size_t max_frag = max_payload - hdr_len;
+  bool first = true;
+  while (!body.empty()) {
+    size_t len = std::min(body.size(), max_frag);
+    bool last = len == body.size();
+
+    uint8_t &fu = hdr[hdr_len - 1];
+    fu = nal_type;
+    if (first)
+      fu |= 0x80;
+    if (last)
+      fu |= 0x40;
+
+    send_rtp({hdr, hdr_len}, body.first(len), timestamp,
+             last && last_in_frame);
+    body = body.subspan(len);
+    first = false;
+  }
+}
+
+void RtpSender::send_rtp(std::span<const uint8_t> payload_hdr,
+                         std::span<const uint8_t> payload, uint32_t timestamp,
+                         bool marker) {
+  uint8_t *p = pkt_buf_.data();
+  p[0] = 0x80; // V=2
+  p[1] = (marker ? 0x80 : 0) | MEDIA_PAYLOAD_TYPE;
+  put_u16(p + 2, seq_++);
+  put_u32(p + 4, timestamp);
+  put_u32(p + 8, ssrc_);
+
+  size_t len = RTP_HEADER_SIZE;
+  if (!payload_hdr.empty()) {
+    std::memcpy(p + len, payload_hdr.data(), payload_hdr.size());
+    len += payload_hdr.size();
+  }
+  std::memcpy(p + len, payload.data(), payload.size());
+  len += payload.size();
+
+  send_datagram({p, len});
+
+  packet_count_++;
+  octet_count_ += len - RTP_HEADER_SIZE;
+
+  // Repair packets for a frame go out right behind it
+  fec_.add_packet({p, len});
+  if (marker)
+    fec_.flush();
+}
+
+void RtpSender::send_datagram(std::span<const uint8_t> data) {
+  using namespace std::chrono;
+
+  // ── Take tokens from the bucket ──────────────────────────────────────────
+  auto now = Pacer::Clock::now();
+  auto when = now;
+  if (pace_bytes_per_sec_ > 0) {
+    auto to_duration = [this](double bytes) {
+      return duration_cast<Pacer::Clock::duration>(
+          duration<double>(bytes / pace_bytes_per_sec_));
+    };
+    // An idle bucket fills up to burst_packets worth of tokens, no more
+    auto full_at = now - to_duration(pacing_.burst_packets * MAX_PACKET_SIZE);
+    next_send_ = std::max(next_send_, full_at);
+    when = std::max(now, next_send_);
+    next_send_ += to_duration(data.size());
+  }
+
+  // ── Hand it to whoever is going to wait for the departure time ──────────
+  // A polled pacer sends everything, so it all leaves from the connection's
+  // I/O loop, whether the kernel or the pacer holds it until it's due
+  if (pacer_.polled()) {
+    if (kernel_txtime_)
+      pacer_.schedule(rtp_sock_, data, now, when);
+    else
+      pacer_.schedule(rtp_sock_, data, when);
+  } else if (kernel_txtime_) {
+    Pacer::Send(*rtp_sock_, data, when);
+  } else if (when <= now && rtp_sock_->queued == 0) {
+    Pacer::Send(*rtp_sock_, data);
+  } else {
+    pacer_.schedule(rtp_sock_, data, when);
+  }
+}
+
+void RtpSender::maybe_send_sender_report(uint32_t timestamp) {
+  using namespace std::chrono_literals;
+
+  auto now = std::chrono::steady_clock::now();
+  if (now - last_sr_ < 1s)
+    return;
+  last_sr_ = now;
+
+  auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+  auto secs = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+  auto frac_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(since_epoch - secs);
+
+  // SR (28 bytes) followed by an SDES with our CNAME, as RFC 3550 wants
+  // every compound packet to carry one
+  uint8_t buf[64] = {};
+  uint8_t *p = buf;
+  p[0] = 0x80;
+  p[1] = RTCP_SR;
+  put_u16(p + 2, 6);
+  put_u32(p + 4, ssrc_);
+  put_u32(p + 8, static_cast<uint32_t>(secs.count() + NTP_UNIX_OFFSET));
+  put_u32(p + 12, static_cast<uint32_t>((frac_us.count() << 32) / 1'000'000));
+  put_u32(p + 16, timestamp);
+  put_u32(p + 20, packet_count_);
+  put_u32(p + 24, octet_count_);
+  p += 28;
+
+  static const char cname[] = "photonvision";
+  const size_t cname_len = sizeof(cname) - 1;
+  // header + ssrc + (type, len, text) + null terminator, padded to 32 bits
+  const size_t sdes_len = (8 + 2 + cname_len + 1 + 3) & ~size_t{3};
+  p[0] = 0x81; // one chunk
+  p[1] = RTCP_SDES;
+  put_u16(p + 2, sdes_len / 4 - 1);
+  put_u32(p + 4, ssrc_);
+  p[8] = 1; // CNAME
+  p[9] = cname_len;
+  std::memcpy(p + 10, cname, cname_len);
+  p += sdes_len;
+
+  if (send(rtcp_fd_, buf, p - buf, 0) < 0)
+    LOG_WARN_EVERY(1000, "RTCP send: {}", std::strerror(errno));
+}
+
+void RtpSender::send_bye() {
+  uint8_t buf[8];
+  buf[0] = 0x81; // one SSRC
+  buf[1] = RTCP_BYE;
+  put_u16(buf + 2, 1);
+  put_u32(buf + 4, ssrc_);
+  send(rtcp_fd_, buf, sizeof(buf), 0);
+}
+
+void RtpSender::poll_rtcp() {
+  uint8_t buf[1500];
+  for (;;) {
+    ssize_t len = recv(rtcp_fd_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0)
+      return;
+
+    // Walk the compound packet looking for report blocks about us, in
+    // either receiver reports or (if the client also sends) sender reports
+    size_t off = 0;
+    while (off + 8 <= static_cast<size_t>(len)) {
+      const uint8_t *p = buf + off;
+      const int count = p[0] & 0x1F;
+      const uint8_t type = p[1];
+      const size_t pkt_len = 4 * (((p[2] << 8) | p[3]) + 1);
+      if ((p[0] >> 6) != 2 || off + pkt_len > static_cast<size_t>(len))
+        break;
+
+      size_t blocks_at = 0;
+      if (type == RTCP_RR)
+        blocks_at = 8;
+      else if (type == RTCP_SR)
+        blocks_at = 28;
+
+      if (blocks_at) {
+        for (int i = 0; i < count; ++i) {
+          size_t block = blocks_at + 24 * i;
+          if (block + 24 > pkt_len)
+            break;
+          handle_report_block(p + block);
+        }
+      }
+      off += pkt_len;
+    }
+  }
+}
+
+void RtpSender::handle_report_block(const uint8_t *block) {
+  uint32_t ssrc = (block[0] << 24) | (block[1] << 16) | (block[2] << 8) |
+                  block[3];
+  if (ssrc != ssrc_)
+    return;
+
+  // Fraction lost since the last report, in 1/256ths
+  reported_loss_ = block[4] / 256.0;
+
+  // Back off a temporal layer at a time while the client is losing packets,
+  // and only climb back after it's been clean for a few reports in a row
+  if (temporal_layers_ > 1) {
+    if (reported_loss_ > TEMPORAL_LAYER_DROP_LOSS) {
+      drop_temporal_layer("client reporting loss");
+    } else if (reported_loss_ < TEMPORAL_LAYER_RECOVER_LOSS &&
+               max_temporal_id_ < temporal_layers_ - 1 &&
+               ++good_reports_ >= TEMPORAL_LAYER_RECOVER_REPORTS) {
+      max_temporal_id_++;
+      good_reports_ = 0;
+      LOG_INFO("RTP {:08X}: recovered, up to {} temporal layer(s)", ssrc_,
+               max_temporal_id_ + 1);
+    }
+  }
+
+  if (fec_settings_.adaptive && fec_settings_.group_size > 0) {
+    // Aim for about 4x the loss rate in overhead, so with independent losses
+    // a group rarely loses more than the one packet we can rebuild
+    int group_size = fec_settings_.group_size;
+    if (reported_loss_ > 0)
+      group_size = std::clamp(static_cast<int>(1 / (4 * reported_loss_)), 2,
+                              fec_settings_.group_size);
+    fec_.configure(group_size, fec_settings_.interleave);
+  }
+}
@@ -0,0 +1,163 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include "FlexFec.hpp"
+#include "NalUnits.hpp"
+#include "Pacer.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+struct PacingSettings {
+  // What the encoder is targeting; the pacer never sends slower than this
+  int bitrate = 2'000'000; // bps
+  int fps = 30;
+  // Each frame's packets are spread over at most this fraction of the frame
+  // interval, so a big IDR still gets out well before the next frame
+  double spread = 0.5;
+  // Packets that may go out back-to-back before pacing kicks in
+  int burst_packets = 4;
+};
+
+/**
+ * A client's media and FlexFEC SSRCs. Picked before DESCRIBE, since the SDP
+ * has to name both so the client can pair the repair stream with the media.
+ */
+struct RtpSsrcs {
+  uint32_t media;
+  uint32_t fec;
+
+  /** Two random, distinct SSRCs */
+  static RtpSsrcs Random();
+};
+
+/**
+ * Packetizes HEVC (RFC 7798) or H.264 (RFC 6184, packetization-mode 1) NAL
+ * units into RTP and sends them over UDP to a single client, along with
+ * periodic RTCP sender reports on port + 1.
+ *
+ * NAL units are packetized the moment they're handed to us, so an access unit
+ * split into several slices goes out slice by slice instead of as one
+ * frame-sized write.
+ *
+ * Optionally protects the stream with FlexFEC, and reads the client's RTCP
+ * receiver reports to size the protection to the loss it's seeing.
+ *
+ * Media is paced by a token bucket so a keyframe doesn't land on the radio as
+ * one burst. Departure times are handed to the kernel with SO_TXTIME when the
+ * client's route goes out an interface with the fq qdisc, which honors them,
+ * and otherwise to a Pacer. Given a polled Pacer, every packet is sent by it,
+ * from the thread polling it.
+ */
+class RtpSender {
+public:
+  // Largest UDP payload we'll emit, sized to fit a 1500 byte MTU
+  static constexpr size_t MAX_PACKET_SIZE = 1472;
+
+  static constexpr uint8_t MEDIA_PAYLOAD_TYPE = 96;
+  static constexpr uint8_t FEC_PAYLOAD_TYPE = 97;
+
+  RtpSender(const std::string &dest_ip, int dest_port,
+            const FecSettings &fec = {},
+            VideoCodec codec = VideoCodec::HEVC,
+            Pacer &pacer = Pacer::Default(),
+            const RtpSsrcs &ssrcs = RtpSsrcs::Random());
+  ~RtpSender();
+  RtpSender(const RtpSender &) = delete;
+  RtpSender &operator=(const RtpSender &) = delete;
+
+  /**
+   * Send a single NAL unit (no start code). pts is in 90 kHz ticks. Set
+   * last_in_frame on the final NAL of an access unit so we set the marker bit.
+   */
+  void send_nal(std::span<const uint8_t> nal, int64_t pts, bool last_in_frame);
+
+  VideoCodec codec() const { return codec_; }
+
+  /** Send every NAL unit of an Annex-B access unit, in order. */
+  void send_access_unit(std::span<const uint8_t> au, int64_t pts);
+
+  void set_pacing(const PacingSettings &pacing) { pacing_ = pacing; }
+
+  /**
+   * How many temporal layers the stream is encoded with (see
+   * EncoderSettings::temporal_layers). With more than one, pictures in the
+   * upper layers are dropped for this client alone when it reports loss or we
+   * can't get its packets out fast enough, and added back once it recovers.
+   */
+  void set_temporal_layers(int layers);
+
+  // Highest TemporalId currently being sent (0 = base layer only)
+  int max_temporal_id() const { return max_temporal_id_; }
+
+  uint32_t ssrc() const { return ssrc_; }
+  uint32_t fec_ssrc() const { return fec_.ssrc(); }
+
+  // Our end of the RTP/RTCP port pair, for the SETUP Transport header
+  int local_rtp_port() const { return local_port_; }
+  int local_rtcp_port() const { return local_port_ + 1; }
+
+  // Fraction of packets lost, as last reported by the client (0-1)
+  double reported_loss() const { return reported_loss_; }
+
+private:
+  void send_fragments(std::span<const uint8_t> payload_hdr,
+                      std::span<const uint8_t> body, uint8_t nal_type,
+                      size_t max_payload, uint32_t timestamp,
+                      bool last_in_frame);
+  void send_rtp(std::span<const uint8_t> payload_hdr,
+                std::span<const uint8_t> payload, uint32_t timestamp,
+                bool marker);
+  void send_datagram(std::span<const uint8_t> data);
+  void maybe_send_sender_report(uint32_t timestamp);
+  void send_bye();
+
+  void poll_rtcp();
+  void handle_report_block(const uint8_t *block);
+  void drop_temporal_layer(const char *why);
+  bool send_backlogged(Pacer::Clock::time_point now);
+
+  VideoCodec codec_;
+  // Sends what can't go out right away (everything, if it's polled); the RTSP
+  // connection's loop's pacer
+  Pacer &pacer_;
+  std::shared_ptr<PacedSocket> rtp_sock_;
+  int rtcp_fd_ = -1;
+  int local_port_ = 0;
+
+  uint16_t seq_;
+  uint32_t ssrc_;
+  uint32_t ts_offset_;
+
+  // For RTCP SR
+  uint32_t packet_count_ = 0;
+  uint32_t octet_count_ = 0;
+  std::chrono::steady_clock::time_point last_sr_{};
+
+  FecSettings fec_settings_;
+  FlexFecEncoder fec_;
+  double reported_loss_ = 0;
+
+  // Token bucket, kept as the time the bucket would next be empty
+  PacingSettings pacing_;
+  double pace_bytes_per_sec_ = 0;
+  Pacer::Clock::time_point next_send_{};
+  bool kernel_txtime_ = false;
+
+  // Temporal layer adaptation
+  int temporal_layers_ = 1;
+  int max_temporal_id_ = 0;
+  int good_reports_ = 0;
+  Pacer::Clock::time_point last_layer_drop_{};
+  // Payload of the last access unit sent
+  size_t last_frame_bytes_ = 0;
+
+  std::vector<uint8_t> pkt_buf_;
+};
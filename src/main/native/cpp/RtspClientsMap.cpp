@@ -4,110 +4,489 @@
 // project.
 
 #include "RtspClientsMap.hpp"
-#include <cstdio>
+#include "Logging.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <stdexcept>
 #include <string>
+#include <sys/socket.h>
+#include <thread>
 #include <vector>
-#include <wpi/print.h>
+#include <wpinet/uv/Poll.h>
 
-// All camera streams we know about, keyed by unique name
-std::map<std::string, CameraStreamInfo> all_camera_streams;
+// Every camera is offered in both codecs. HEVC is what we expect clients to
+// use, so its encoder is kept warm; H.264 only runs while someone watches it.
+struct PublishedCamera {
+  std::shared_ptr<CameraStream> hevc;
+  std::shared_ptr<CameraStream> h264;
+  // Drawn into frames before either codec gets them
+  std::shared_ptr<TextOverlay> overlay;
+  // Writing down every frame published, if asked to
+  std::shared_ptr<FrameRecorder> recorder;
 
-// All streams where the TCP connection is still alive
-// TODO TCP keepalives
-std::vector<std::shared_ptr<RtspServerConnectionHandler>>
-    rtsp_client_tcp_connections;
+  const std::shared_ptr<CameraStream> &get(VideoCodec codec) const {
+    return codec == VideoCodec::H264 ? h264 : hevc;
+  }
+};
+
+// All camera streams we know about, keyed by unique name. Created by
+// publishers or by Java configuring them, looked up from the event loop
+std::map<std::string, PublishedCamera> all_camera_streams;
+std::mutex all_camera_streams_mutex;
+
+static PublishedCamera GetOrCreateCamera(const std::string &stream_name) {
+  std::scoped_lock lock{all_camera_streams_mutex};
+  auto &camera = all_camera_streams[stream_name];
+  if (!camera.hevc) {
+    camera.hevc =
+        std::make_shared<CameraStream>(stream_name, VideoCodec::HEVC, true);
+    camera.h264 =
+        std::make_shared<CameraStream>(stream_name, VideoCodec::H264, false);
+    camera.overlay = std::make_shared<TextOverlay>();
+  }
+  return camera;
+}
+
+// Change some encoder settings for every codec a camera is offered in
+template <typename F>
+static void UpdateEncoderSettings(const std::string &stream_name, F &&update) {
+  auto camera = GetOrCreateCamera(stream_name);
+  for (const auto &stream : {camera.hevc, camera.h264}) {
+    auto settings = stream->info().encoder;
+    update(settings);
+    stream->configure(settings);
+  }
+}
+
+// One of the server's I/O loops. Each has its own listening socket on the
+// RTSP port, and the kernel spreads new connections across them
+// (SO_REUSEPORT). A connection stays on the loop that accepted it, and its
+// media is sent from that loop by its pacer, so clients on different loops
+// never wait on each other.
+struct RtspLoop {
+  // Polled by the loop, which sends whatever's due
+  Pacer pacer{Pacer::Polled{}};
+  // Connections accepted here whose TCP connection is still alive. Only
+  // touched from runner's thread
+  // TODO TCP keepalives
+  std::vector<std::shared_ptr<RtspServerConnectionHandler>> connections;
+  // Last, so its thread is stopped before the rest is destroyed
+  wpi::EventLoopRunner runner;
+};
 
-// Global loop. Never stops. Make sure to use ExecAsync to run things on it
-wpi::EventLoopRunner loop;
+// Created once by StartRtspServerLoop, then never changes. Loops never stop.
+// Make sure to use ExecAsync to run things on them
+std::vector<std::unique_ptr<RtspLoop>> rtsp_loops;
+
+// Let other listeners bind the same port, before we bind it ourselves
+static bool SetReusePort(wpi::uv::Tcp &tcp) {
+  uv_os_fd_t fd;
+  int err = uv_fileno(tcp.GetRawHandle(), &fd);
+  int on = 1;
+  if (err == 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+    err = -errno;
+  if (err != 0) {
+    LOG_WARN("couldn't set SO_REUSEPORT: {}", uv_strerror(err));
+    return false;
+  }
+  return true;
+}
 
-/**
- * Called once by Java to bind to our socket and start the server. Happens on
- * some sort of global thread
- */
-void StartRtspServerLoop() {
+void StartRtspServerLoop(int loops) {
   using namespace wpi;
   using namespace std::literals::chrono_literals;
 
-  // Block until the TCP socket is ready to go
-  loop.ExecSync([](uv::Loop &loop) {
-    auto tcp = uv::Tcp::Create(loop);
-    tcp->Bind("", 5801);
+  if (!rtsp_loops.empty()) {
+    LOG_WARN("RTSP server already started");
+    return;
+  }
+  loops = std::max(loops, 1);
+  for (int i = 0; i < loops; i++)
+    rtsp_loops.push_back(std::make_unique<RtspLoop>());
+
+  int listening = 0;
+  for (int index = 0; index < loops; index++) {
+    RtspLoop &rtsp = *rtsp_loops[index];
 
-    tcp->connection.connect([srv = tcp.get()] {
-      auto stream = srv->Accept();
-      if (!stream)
+    // Block until the TCP socket is ready to go
+    rtsp.runner.ExecSync([&, index](uv::Loop &loop) {
+      pthread_setname_np(pthread_self(),
+                         ("rtsp-io-" + std::to_string(index)).c_str());
+
+      // Encode workers queue this loop's media on its pacer, and the loop
+      // sends it once it's due
+      auto pacer_poll = uv::Poll::Create(loop, rtsp.pacer.fd());
+      if (!pacer_poll) {
+        LOG_ERROR("couldn't poll the pacer for I/O loop {}", index);
         return;
+      }
+      pacer_poll->pollEvent.connect([&rtsp](int) { rtsp.pacer.send_due(); });
+      pacer_poll->Start(UV_READABLE);
 
-      // TODO upstream converts to ms, but libuv wants seconds
-      stream->SetKeepAlive(true, 1ms);
-
-      std::fputs("Got a connection\n", stderr);
-      auto conn = std::make_shared<RtspServerConnectionHandler>(stream);
-
-      // on clised/end/error, erase from global list
-      auto erase_client = [conn]() {
-        wpi::print(stderr, "Client disconnected\n");
-
-        auto it = std::find(rtsp_client_tcp_connections.begin(),
-                            rtsp_client_tcp_connections.end(), conn);
-        if (it != rtsp_client_tcp_connections.end()) {
-          rtsp_client_tcp_connections.erase(it);
-        }
-
-        wpi::print("{} clients remaining\n",
-                   rtsp_client_tcp_connections.size());
-      };
-      stream->closed.connect(erase_client);
-      stream->end.connect(erase_client);
-      stream->error.connect([erase_client](wpi::uv::Error err) {
-        wpi::print(stderr, "Stream error: {}\n", err.str());
-        erase_client();
-      });
+      // Created with an address family so the socket exists before Bind
+      auto tcp = uv::Tcp::Create(loop, AF_INET);
+      if (loops > 1 && !SetReusePort(*tcp) && index > 0) {
+        // Port's held by the first loop, so this one stays idle
+        tcp->Close();
+        return;
+      }
+      tcp->Bind("", 5801);
+
+      tcp->connection.connect([srv = tcp.get(), &rtsp, index] {
+        auto stream = srv->Accept();
+        if (!stream)
+          return;
+
+        // TODO upstream converts to ms, but libuv wants seconds
+        stream->SetKeepAlive(true, 1ms);
+
+        LOG_INFO("Got a connection on loop {}", index);
+        auto conn = std::make_shared<RtspServerConnectionHandler>(
+            stream, index, rtsp.pacer);
+
+        // on clised/end/error, erase from this loop's list
+        auto erase_client = [conn, &rtsp]() {
+          LOG_INFO("Client disconnected");
+          // Stop sending to them
+          conn->Stop();
+
+          auto it = std::find(rtsp.connections.begin(),
+                              rtsp.connections.end(), conn);
+          if (it != rtsp.connections.end()) {
+            rtsp.connections.erase(it);
+          }
+
+          LOG_INFO("{} clients remaining on this loop",
+                   rtsp.connections.size());
+        };
+        stream->closed.connect(erase_client);
+        stream->end.connect(erase_client);
+        stream->error.connect([erase_client](wpi::uv::Error err) {
+          LOG_WARN("Stream error: {}", err.str());
+          erase_client();
+        });
 
-      rtsp_client_tcp_connections.push_back(conn);
+        rtsp.connections.push_back(conn);
 
-      conn->Start();
+        conn->Start();
+      });
+
+      tcp->Listen();
+      listening++;
     });
+  }
+  LOG_INFO("Listening on port 5801 on {} of {} I/O loops", listening, loops);
+}
 
-    tcp->Listen();
-    std::fputs("Listening on port 5801\n", stderr);
-  });
+void RunOnRtspLoop(int loop, std::function<void()> func) {
+  rtsp_loops.at(loop)->runner.ExecAsync(
+      [func = std::move(func)](wpi::uv::Loop &) { func(); });
+}
+
+// Queue a frame for encoding in every codec
+static bool PublishToStreams(const std::string &stream_name,
+                             const PublishedCamera &camera,
+                             const cv::Mat &frame,
+                             std::span<const RegionOfInterest> rois,
+                             int64_t captured_us) {
+  bool ok = true;
+  for (const auto &stream : {camera.hevc, camera.h264}) {
+    try {
+      stream->publish(frame, rois, captured_us);
+      ok = ok && !stream->encode_failed();
+    } catch (const std::exception &e) {
+      // Don't take the caller's thread down with us
+      LOG_WARN_EVERY(1000, "dropped frame for {}: {}", stream_name, e.what());
+      ok = false;
+    }
+  }
+  return ok;
 }
 
-bool PublishCameraFrame(const std::string &stream_name, const cv::Mat &frame) {
-  // Always record for GetCameraStreamInfo
-  // printf("Pushing %s to %ix%i", stream_name.c_str(), frame.rows, frame.cols);
-  all_camera_streams[stream_name] = CameraStreamInfo{
-      .unique_name = stream_name,
-      .width = frame.size().width,
-      .height = frame.size().height,
-      .fps = 30, // TODO pipe FPS
-  };
+bool PublishCameraFrame(const std::string &stream_name, const cv::Mat &frame,
+                        std::span<const RegionOfInterest> rois,
+                        int64_t captured_us) {
+  // Always record for GetCameraStreamInfo, even with nobody watching
+  auto camera = GetOrCreateCamera(stream_name);
+  if (captured_us < 0)
+    captured_us = av_gettime();
 
-  for (const auto &conn : rtsp_client_tcp_connections) {
-    // TODO this is really bad, we should have a map of stream name to clients
-    // that are subscribed to it or something
-    conn->OfferFrame(stream_name, frame);
+  // Encoded later on the scheduler's workers, by when the caller will have
+  // reused frame. One copy does for both codecs.
+  cv::Mat copy = frame.clone();
+  if (camera.recorder) {
+    // Without the overlay, which gets drawn into copy
+    camera.recorder->record(camera.overlay->empty() ? copy : frame.clone(),
+                            rois, captured_us);
   }
+  if (camera.overlay->empty())
+    return PublishToStreams(stream_name, camera, copy, rois, captured_us);
+
+  // Text is drawn on a worker too, once, and then both codecs are queued
+  EncodeScheduler::Default().submit({
+      .key = camera.overlay.get(),
+      .priority = camera.hevc->info().priority,
+      // Ahead of frames captured since, which it holds up
+      .deadline_us = captured_us,
+      .run =
+          [stream_name, camera, copy, captured_us,
+           rois = std::vector(rois.begin(), rois.end())]() mutable {
+            try {
+              camera.overlay->draw(copy, captured_us);
+            } catch (const std::exception &e) {
+              LOG_WARN_EVERY(1000, "overlay on {}: {}", stream_name,
+                             e.what());
+            }
+            PublishToStreams(stream_name, camera, copy, rois, captured_us);
+          },
+  });
+  return !camera.hevc->encode_failed() && !camera.h264->encode_failed();
+}
+
+bool PublishEncodedFrame(const std::string &stream_name, VideoCodec codec,
+                         std::span<const uint8_t> au, int width, int height,
+                         int64_t captured_us) {
+  auto camera = GetOrCreateCamera(stream_name);
+  if (captured_us < 0)
+    captured_us = av_gettime();
 
+  if (camera.recorder) {
+    camera.recorder->record_encoded(codec, au, cv::Size(width, height),
+                                    captured_us);
+  }
+  try {
+    camera.get(codec)->publish_encoded(au, width, height, captured_us);
+  } catch (const std::exception &e) {
+    LOG_WARN_EVERY(1000, "dropped access unit for {}: {}", stream_name,
+                   e.what());
+    return false;
+  }
   return true;
 }
 
 std::optional<CameraStreamInfo>
-GetCameraStreamInfo(const std::string &stream_name) {
-  // Should always be updated by PublishCameraFrame
-  // printf("Looking up %s\n", stream_name.c_str());
-  // for (const auto &cam : all_camera_streams) {
-  //   printf("camera %s\n", cam.first.c_str());
-  // }
-
-  auto it = all_camera_streams.find(stream_name);
-  if (it == all_camera_streams.end()) {
+GetCameraStreamInfo(const std::string &stream_name, VideoCodec codec) {
+  auto stream = GetCameraStream(stream_name, codec);
+  if (!stream)
+    return std::nullopt;
+  auto info = stream->info();
+  if (info.width == 0) {
+    // Configured but never published
     return std::nullopt;
   }
-  return it->second;
+  return info;
+}
+
+std::shared_ptr<CameraStream> GetCameraStream(const std::string &stream_name,
+                                              VideoCodec codec) {
+  std::scoped_lock lock{all_camera_streams_mutex};
+  auto it = all_camera_streams.find(stream_name);
+  if (it == all_camera_streams.end())
+    return nullptr;
+  return it->second.get(codec);
+}
+
+void ConfigureCameraStream(const std::string &stream_name,
+                           const EncoderSettings &settings) {
+  UpdateEncoderSettings(stream_name,
+                        [&](EncoderSettings &s) { s = settings; });
+}
+
+void SetCameraStreamSlices(const std::string &stream_name, int slices) {
+  UpdateEncoderSettings(stream_name, [&](EncoderSettings &s) {
+    s.slices = std::max(slices, 1);
+  });
+}
+
+void SetCameraStreamTemporalLayers(const std::string &stream_name,
+                                   int layers) {
+  UpdateEncoderSettings(stream_name, [&](EncoderSettings &s) {
+    s.temporal_layers =
+        std::clamp(layers, 1, EncoderSettings::MAX_TEMPORAL_LAYERS);
+  });
+}
+
+void SetCameraStreamFec(const std::string &stream_name,
+                        const FecSettings &fec) {
+  auto camera = GetOrCreateCamera(stream_name);
+  camera.hevc->set_fec(fec);
+  camera.h264->set_fec(fec);
+}
+
+void SetCameraStreamOverlay(const std::string &stream_name,
+                            std::vector<OverlayText> lines) {
+  GetOrCreateCamera(stream_name).overlay->set(std::move(lines));
+}
+
+void SetCameraStreamPriority(const std::string &stream_name, int priority) {
+  auto camera = GetOrCreateCamera(stream_name);
+  camera.hevc->set_priority(priority);
+  camera.h264->set_priority(priority);
+}
+
+void ConfigureEncodeWorkers(const EncodeSchedulerSettings &settings) {
+  EncodeScheduler::Default().configure(settings);
+}
+
+void SetCameraStreamLocalSharing(const std::string &stream_name,
+                                 const LocalSharing &local) {
+  GetOrCreateCamera(stream_name).hevc->set_local_sharing(local);
 }
 
 // TODO once a camera is registered there's currently no way for it to time out
+
+bool StartCameraStreamRecording(const std::string &stream_name,
+                                const std::string &path) {
+  std::shared_ptr<FrameRecorder> recorder;
+  try {
+    recorder = std::make_shared<FrameRecorder>(path);
+  } catch (const std::exception &e) {
+    LOG_WARN("not recording {}: {}", stream_name, e.what());
+    return false;
+  }
+
+  GetOrCreateCamera(stream_name);
+  {
+    std::scoped_lock lock{all_camera_streams_mutex};
+    std::swap(all_camera_streams[stream_name].recorder, recorder);
+  }
+  // The one it replaced, if any. Publishers still holding it can't add to it
+  // once it's closed.
+  if (recorder)
+    recorder->close();
+  return true;
+}
+
+void StopCameraStreamRecording(const std::string &stream_name) {
+  std::shared_ptr<FrameRecorder> recorder;
+  {
+    std::scoped_lock lock{all_camera_streams_mutex};
+    auto it = all_camera_streams.find(stream_name);
+    if (it != all_camera_streams.end())
+      recorder = std::move(it->second.recorder);
+  }
+  if (recorder)
+    recorder->close();
+}
+
+// ── Replay ─────────────────────────────────────────────────────────────────
+
+// Wait for everything queued for a camera to have been encoded and sent
+static void WaitForEncodes(const PublishedCamera &camera) {
+  auto &scheduler = EncodeScheduler::Default();
+  // The overlay stage is what queues the codecs, so it goes first
+  scheduler.wait_idle(camera.overlay.get());
+  scheduler.wait_idle(camera.hevc.get());
+  scheduler.wait_idle(camera.h264.get());
+}
+
+ReplayStats ReplayRecording(const std::string &stream_name,
+                            const FrameRecording &recording,
+                            const ReplaySettings &settings,
+                            const std::atomic_bool &stop) {
+  using Clock = std::chrono::steady_clock;
+
+  ReplayStats stats;
+  if (recording.size() == 0)
+    return stats;
+  const auto camera = GetOrCreateCamera(stream_name);
+
+  // Passes are a frame apart, as if the recording had gone on
+  const int64_t frame_us =
+      recording.size() > 1
+          ? recording.duration_us() / static_cast<int64_t>(recording.size() - 1)
+          : 33'333;
+  const int64_t pass_us = recording.duration_us() + frame_us;
+  const int64_t first_us = recording[0].timestamp_us;
+  const int64_t start_us = av_gettime();
+  const auto start = Clock::now();
+
+  for (int64_t pass = 0; !stop; pass++) {
+    for (size_t i = 0; i < recording.size() && !stop; i++) {
+      const RecordedFrame frame = recording[i];
+      const int64_t offset_us = pass * pass_us + frame.timestamp_us - first_us;
+
+      if (settings.real_time) {
+        const auto due = start + std::chrono::microseconds(offset_us);
+        if (Clock::now() > due + std::chrono::microseconds(frame_us))
+          stats.late++;
+        std::this_thread::sleep_until(due);
+      }
+      if (frame.image.empty()) {
+        PublishEncodedFrame(stream_name, frame.codec, frame.encoded,
+                            frame.size.width, frame.size.height,
+                            start_us + offset_us);
+      } else {
+        PublishCameraFrame(stream_name, frame.image, frame.rois,
+                           start_us + offset_us);
+      }
+      stats.frames++;
+      if (!settings.real_time)
+        WaitForEncodes(camera);
+    }
+    if (!settings.loop)
+      break;
+  }
+
+  WaitForEncodes(camera);
+  stats.seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  return stats;
+}
+
+struct Replay {
+  std::shared_ptr<std::atomic_bool> stop;
+  std::thread thread;
+};
+
+// Replays started from Java, by stream name
+std::map<std::string, Replay> camera_replays;
+std::mutex camera_replays_mutex;
+
+bool StartCameraStreamReplay(const std::string &stream_name,
+                             const std::string &path,
+                             const ReplaySettings &settings) {
+  std::shared_ptr<FrameRecording> recording;
+  try {
+    recording = std::make_shared<FrameRecording>(path);
+  } catch (const std::exception &e) {
+    LOG_WARN("not replaying to {}: {}", stream_name, e.what());
+    return false;
+  }
+
+  StopCameraStreamReplay(stream_name);
+  auto stop = std::make_shared<std::atomic_bool>(false);
+  std::thread thread([stream_name, recording, settings, stop] {
+    pthread_setname_np(pthread_self(), "replay");
+    const auto stats =
+        ReplayRecording(stream_name, *recording, settings, *stop);
+    LOG_INFO("Replayed {} frames to {} in {:.1f} s ({:.1f} fps), {} late",
+             stats.frames, stream_name, stats.seconds,
+             stats.seconds > 0 ? stats.frames / stats.seconds : 0.0,
+             stats.late);
+  });
+
+  std::scoped_lock lock{camera_replays_mutex};
+  camera_replays[stream_name] = {std::move(stop), std::move(thread)};
+  return true;
+}
+
+void StopCameraStreamReplay(const std::string &stream_name) {
+  Replay replay;
+  {
+    std::scoped_lock lock{camera_replays_mutex};
+    auto it = camera_replays.find(stream_name);
+    if (it == camera_replays.end())
+      return;
+    replay = std::move(it->second);
+    camera_replays.erase(it);
+  }
+  *replay.stop = true;
+  replay.thread.join();
+}
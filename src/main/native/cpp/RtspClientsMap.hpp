@@ -5,31 +5,182 @@
 
 #pragma once
 
+#include "CameraStream.hpp"
+#include "EncodeScheduler.hpp"
+#include "FrameRecording.hpp"
+#include "Pacer.hpp"
+#include "TextOverlay.hpp"
 #include "rtsp_server.hpp"
+#include <atomic>
+#include <functional>
 #include <map>
+#include <memory>
 #include <opencv2/core/mat.hpp>
+#include <optional>
+#include <span>
 #include <string>
 #include <wpinet/EventLoopRunner.h>
 
-struct CameraStreamInfo {
-  // globally unique name for this stream, used in RTSP URL. Should
-  // differentiate between input and output
-  std::string unique_name;
+// I/O loops the RTSP server runs if not told otherwise
+constexpr int DEFAULT_RTSP_LOOPS = 2;
 
-  int width;
-  int height;
-  int fps;
+/**
+ * Called once by Java to bind to our socket and start the server, on `loops`
+ * I/O threads that each accept a share of the connections (SO_REUSEPORT).
+ * A connection's requests are handled, and its media sent, by the loop that
+ * accepted it.
+ */
+void StartRtspServerLoop(int loops = DEFAULT_RTSP_LOOPS);
+
+/** Run func on one of the RTSP server's loop threads, from any other thread */
+void RunOnRtspLoop(int loop, std::function<void()> func);
+
+/**
+ * Send a frame to everyone watching stream_name. rois, if any, are parts of
+ * the frame (targets, game pieces) to favor with bits at the expense of the
+ * rest. The frame is copied and encoded in the background (see
+ * EncodeScheduler), so this returns false if the stream's previous frame
+ * couldn't be encoded. captured_us (av_gettime() clock) is when the frame was
+ * taken, if not just now.
+ */
+bool PublishCameraFrame(const std::string &stream_name, const cv::Mat &frame,
+                        std::span<const RegionOfInterest> rois = {},
+                        int64_t captured_us = -1);
+
+/**
+ * Send an access unit from a camera that encodes for itself (a hardware
+ * encoder, an IP camera) to everyone watching stream_name, as is: no encoder
+ * of ours runs for it, and encoder settings don't apply. au is Annex-B, one
+ * whole picture; width and height are its size. The stream's parameter sets
+ * are picked out of the bitstream for the SDP, and new watchers are caught
+ * up from the last keyframe. Sent on the caller's thread, so this is false
+ * only if it couldn't be sent at all. Publishing frames to the stream again
+ * with PublishCameraFrame starts its encoder back up.
+ */
+bool PublishEncodedFrame(const std::string &stream_name, VideoCodec codec,
+                         std::span<const uint8_t> au, int width, int height,
+                         int64_t captured_us = -1);
+
+/**
+ * Change a stream's encoder settings. Applied live to everyone watching: see
+ * FfmpegRtpPipeline::reconfigure. The stream doesn't need to have been
+ * published yet.
+ */
+void ConfigureCameraStream(const std::string &stream_name,
+                           const EncoderSettings &settings);
 
-  // TODO should we specify bitrate
+/**
+ * Split each encoded frame of this stream into `slices` slices, which are
+ * sent as soon as they're packetized (see EncoderSettings::slices).
+ */
+void SetCameraStreamSlices(const std::string &stream_name, int slices);
+
+/**
+ * Encode this stream in `layers` temporal layers, so clients on bad links can
+ * be sent a lower frame rate (see EncoderSettings::temporal_layers).
+ */
+void SetCameraStreamTemporalLayers(const std::string &stream_name,
+                                   int layers);
+
+/**
+ * Protect this stream with FlexFEC (see FecSettings). Advertised in the SDP,
+ * and takes effect for clients that connect after this call.
+ */
+void SetCameraStreamFec(const std::string &stream_name,
+                        const FecSettings &fec);
+
+/**
+ * Burn these lines of text (timestamps, labels) into every frame of the
+ * stream, replacing any set before. Drawn on an encode worker rather than the
+ * publishing thread; see TextOverlay. An empty list turns the overlay off.
+ */
+void SetCameraStreamOverlay(const std::string &stream_name,
+                            std::vector<OverlayText> lines);
+
+/**
+ * Encode this stream ahead of lower priority ones when there are more frames
+ * waiting than encode workers (see EncodeScheduler). Defaults to 0.
+ */
+void SetCameraStreamPriority(const std::string &stream_name, int priority);
+
+/**
+ * Set up the encode workers shared by every stream: how many, and which
+ * cores to pin them to. See EncodeScheduler.
+ */
+void ConfigureEncodeWorkers(const EncodeSchedulerSettings &settings);
+
+/**
+ * Share this stream with other processes on this machine through shared
+ * memory (see ShmRing.hpp). Only the HEVC stream is shared encoded, since it's
+ * the one kept warm.
+ */
+void SetCameraStreamLocalSharing(const std::string &stream_name,
+                                 const LocalSharing &local);
+
+/**
+ * Write every frame published to this stream from now on, with its ROIs and
+ * timestamp, to path (see FrameRecording.hpp), before any overlay is drawn.
+ * Access units given to PublishEncodedFrame are recorded as they are.
+ * Replaces any recording the stream already had going. False if path can't
+ * be written.
+ */
+bool StartCameraStreamRecording(const std::string &stream_name,
+                                const std::string &path);
+
+/** Finish the stream's recording, if it has one */
+void StopCameraStreamRecording(const std::string &stream_name);
+
+struct ReplaySettings {
+  // Publish frames as far apart as they were recorded. Otherwise each one
+  // goes as soon as the one before it has been encoded and sent, for
+  // measuring throughput.
+  bool real_time = true;
+  // Start over from the first frame at the end, until stopped
+  bool loop = false;
+};
+
+struct ReplayStats {
+  uint64_t frames = 0;
+  // Until the last frame had been encoded and sent
+  double seconds = 0;
+  // Real time only: frames published more than a frame interval after they
+  // were due
+  uint64_t late = 0;
 };
 
 /**
- * Called once by Java to bind to our socket and start the server. Happens on
- * some sort of global thread
+ * Publish a recording to stream_name through PublishCameraFrame (or
+ * PublishEncodedFrame, for its encoded frames), on this
+ * thread, until it ends or stop is set. Frames are timestamped as if they'd
+ * just been captured, as far apart as they were recorded, so the encoder sees
+ * the recorded frame rate even when not playing in real time. Every frame is
+ * encoded either way, unless the encoders can't keep up in real time.
  */
-void StartRtspServerLoop();
+ReplayStats ReplayRecording(const std::string &stream_name,
+                            const FrameRecording &recording,
+                            const ReplaySettings &settings,
+                            const std::atomic_bool &stop);
 
-bool PublishCameraFrame(const std::string &stream_name, const cv::Mat &frame);
+/**
+ * ReplayRecording on a thread of its own, replacing any replay this stream
+ * already had going. False if path isn't a recording.
+ */
+bool StartCameraStreamReplay(const std::string &stream_name,
+                             const std::string &path,
+                             const ReplaySettings &settings = {});
+
+/** Stop the stream's replay, if it has one, and wait for it to finish */
+void StopCameraStreamReplay(const std::string &stream_name);
 
+/** Info for a stream that's been published at least once */
 std::optional<CameraStreamInfo>
-GetCameraStreamInfo(const std::string &stream_name);
+GetCameraStreamInfo(const std::string &stream_name,
+                    VideoCodec codec = VideoCodec::HEVC);
+
+/**
+ * The stream itself, in the given codec, for subscribing to it. Null if never
+ * published or configured.
+ */
+std::shared_ptr<CameraStream>
+GetCameraStream(const std::string &stream_name,
+                VideoCodec codec = VideoCodec::HEVC);
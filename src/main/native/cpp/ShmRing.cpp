@@ -0,0 +1,407 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "ShmRing.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+
+// "HMRG", and bumped whenever the layout below changes
+constexpr uint32_t SHM_RING_MAGIC = 0x47524D48;
+constexpr uint32_t SHM_RING_VERSION = 1;
+
+// Both sides of the ring may be different processes, or differently built
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futexes need a plain 32-bit word");
+
+// ── Shared layout ──────────────────────────────────────────────────────────
+// [ header | slot_count slots | data_size bytes of entry data ]
+//
+// Entry n goes in slot n % slot_count, with its data at `position`, which
+// counts bytes since the ring was created (so a reader can tell from
+// `reserved` whether it's been written over). Data never wraps: an entry that
+// won't fit before the end of the ring starts over at the beginning instead.
+
+struct alignas(64) ShmRingHeader {
+  // Set last, once everything else is
+  std::atomic<uint32_t> magic{0};
+  uint32_t version = SHM_RING_VERSION;
+  uint32_t kind = 0;
+  uint32_t slot_count = 0;
+  uint64_t data_size = 0;
+  char codec[16] = {};
+
+  // Written by the writer
+  // Entries committed so far, i.e. the seq of the next one
+  alignas(64) std::atomic<uint64_t> head{0};
+  // Data bytes handed out so far. Anything older than reserved - data_size
+  // has been (or is being) overwritten.
+  std::atomic<uint64_t> reserved{0};
+  // Futex word, bumped on every commit and on close
+  std::atomic<uint32_t> wake{0};
+  std::atomic<uint32_t> closed{0};
+
+  // Written by readers, kept off the writer's cache line
+  alignas(64) std::atomic<uint32_t> sleepers{0};
+  std::atomic<uint32_t> keyframe_requests{0};
+};
+
+struct alignas(64) ShmRingSlot {
+  // Seqlock for the fields below: 2 * seq + 1 while entry seq is being
+  // written to the slot, 2 * seq + 2 once it's done
+  std::atomic<uint64_t> lock{0};
+  uint64_t position = 0;
+  uint32_t size = 0;
+  uint32_t keyframe = 0;
+  int64_t timestamp_us = 0;
+  int32_t width = 0;
+  int32_t height = 0;
+  int32_t stride = 0;
+  int32_t cv_type = 0;
+};
+
+static size_t MapSize(uint32_t slots, size_t data_size) {
+  return sizeof(ShmRingHeader) + slots * sizeof(ShmRingSlot) + data_size;
+}
+
+static std::runtime_error SysError(const std::string &what,
+                                   const std::string &name) {
+  return std::runtime_error(what + " " + name + ": " + std::strerror(errno));
+}
+
+static void FutexWait(std::atomic<uint32_t> &word, uint32_t expected,
+                      std::chrono::milliseconds timeout) {
+  const auto ns = std::chrono::nanoseconds(timeout).count();
+  timespec ts{.tv_sec = static_cast<time_t>(ns / 1'000'000'000),
+              .tv_nsec = static_cast<long>(ns % 1'000'000'000)};
+  // Not FUTEX_PRIVATE: the other side may be another process
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected,
+          &ts, nullptr, 0);
+}
+
+static void FutexWakeAll(std::atomic<uint32_t> &word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+// Tell readers of a ring that it's going away, so they attach again
+static void CloseRing(ShmRingHeader *header) {
+  header->closed.store(1, std::memory_order_release);
+  header->wake.fetch_add(1);
+  FutexWakeAll(header->wake);
+}
+
+std::string ShmRingName(const std::string &stream_name, ShmRingKind kind,
+                        const std::string &codec) {
+  std::string name = "/hevc-meme." + stream_name + "." +
+                     (kind == ShmRingKind::RAW ? "raw" : codec);
+  // Has to be a single path component
+  std::replace(name.begin() + 1, name.end(), '/', '_');
+  return name;
+}
+
+// ── Writer ─────────────────────────────────────────────────────────────────
+
+ShmRingWriter::ShmRingWriter(const std::string &name, ShmRingKind kind,
+                             size_t data_size, uint32_t slots,
+                             const std::string &codec, mode_t mode)
+    : name_(name), data_size_(data_size), slot_count_(std::max(slots, 1u)) {
+  // Readers still attached to a ring by this name (from before a restart,
+  // say) would otherwise wait on it forever
+  int fd = shm_open(name_.c_str(), O_RDWR, 0);
+  if (fd >= 0) {
+    struct stat st{};
+    if (fstat(fd, &st) == 0 &&
+        st.st_size >= static_cast<off_t>(sizeof(ShmRingHeader))) {
+      void *old = mmap(nullptr, sizeof(ShmRingHeader), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+      if (old != MAP_FAILED) {
+        CloseRing(static_cast<ShmRingHeader *>(old));
+        munmap(old, sizeof(ShmRingHeader));
+      }
+    }
+    close(fd);
+  }
+  shm_unlink(name_.c_str());
+
+  fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+  if (fd < 0)
+    throw SysError("shm_open", name_);
+  // Exactly what was asked for, whatever our umask
+  if (fchmod(fd, mode) != 0) {
+    close(fd);
+    shm_unlink(name_.c_str());
+    throw SysError("fchmod", name_);
+  }
+  map_size_ = MapSize(slot_count_, data_size_);
+  if (ftruncate(fd, static_cast<off_t>(map_size_)) != 0) {
+    close(fd);
+    shm_unlink(name_.c_str());
+    throw SysError("ftruncate", name_);
+  }
+  void *mem =
+      mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    shm_unlink(name_.c_str());
+    throw SysError("mmap", name_);
+  }
+
+  header_ = new (mem) ShmRingHeader{};
+  header_->kind = static_cast<uint32_t>(kind);
+  header_->slot_count = slot_count_;
+  header_->data_size = data_size_;
+  std::strncpy(header_->codec, codec.c_str(), sizeof(header_->codec) - 1);
+  slots_ = new (header_ + 1) ShmRingSlot[slot_count_];
+  data_ = reinterpret_cast<uint8_t *>(slots_ + slot_count_);
+  header_->magic.store(SHM_RING_MAGIC, std::memory_order_release);
+}
+
+ShmRingWriter::~ShmRingWriter() {
+  CloseRing(header_);
+  munmap(header_, map_size_);
+  shm_unlink(name_.c_str());
+}
+
+std::span<uint8_t> ShmRingWriter::reserve(size_t size) {
+  if (size > data_size_)
+    return {};
+
+  uint64_t position = position_;
+  const size_t offset = position % data_size_;
+  if (offset + size > data_size_)
+    position += data_size_ - offset;
+
+  // Seqlock style: readers check `reserved` after reading data, so it has to
+  // be visible before any of the data it covers gets overwritten
+  header_->reserved.store(position + size, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  reserved_at_ = position;
+  reserved_size_ = size;
+  position_ = position + size;
+  return {data_ + position % data_size_, size};
+}
+
+void ShmRingWriter::commit(const ShmRingEntry &entry) {
+  const uint64_t seq = header_->head.load(std::memory_order_relaxed);
+  ShmRingSlot &slot = slots_[seq % slot_count_];
+
+  slot.lock.store(2 * seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.position = reserved_at_;
+  slot.size = static_cast<uint32_t>(reserved_size_);
+  slot.keyframe = entry.keyframe;
+  slot.timestamp_us = entry.timestamp_us;
+  slot.width = entry.width;
+  slot.height = entry.height;
+  slot.stride = entry.stride;
+  slot.cv_type = entry.cv_type;
+  slot.lock.store(2 * seq + 2, std::memory_order_release);
+
+  header_->head.store(seq + 1, std::memory_order_release);
+  header_->wake.fetch_add(1);
+  if (header_->sleepers.load() > 0)
+    FutexWakeAll(header_->wake);
+}
+
+bool ShmRingWriter::write(const ShmRingEntry &entry) {
+  auto dest = reserve(entry.data.size());
+  if (dest.size() != entry.data.size())
+    return false;
+  std::memcpy(dest.data(), entry.data.data(), entry.data.size());
+  commit(entry);
+  return true;
+}
+
+bool ShmRingWriter::keyframe_requested() {
+  const uint32_t requests =
+      header_->keyframe_requests.load(std::memory_order_relaxed);
+  return std::exchange(keyframe_requests_seen_, requests) != requests;
+}
+
+// ── Reader ─────────────────────────────────────────────────────────────────
+
+ShmRingReader::ShmRingReader(const std::string &name) {
+  const int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0)
+    throw SysError("shm_open", name);
+  struct stat st{};
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < static_cast<off_t>(sizeof(ShmRingHeader))) {
+    close(fd);
+    throw std::runtime_error("shm ring " + name + " isn't ready");
+  }
+  map_size_ = static_cast<size_t>(st.st_size);
+  void *mem =
+      mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    throw SysError("mmap", name);
+
+  header_ = static_cast<ShmRingHeader *>(mem);
+  if (header_->magic.load(std::memory_order_acquire) != SHM_RING_MAGIC ||
+      header_->version != SHM_RING_VERSION ||
+      MapSize(header_->slot_count, header_->data_size) != map_size_) {
+    release();
+    throw std::runtime_error("shm ring " + name +
+                             " isn't ready, or is from another version");
+  }
+  slots_ = reinterpret_cast<const ShmRingSlot *>(header_ + 1);
+  data_ = reinterpret_cast<const uint8_t *>(slots_ + header_->slot_count);
+  seek_to_newest();
+}
+
+ShmRingReader::~ShmRingReader() { release(); }
+
+ShmRingReader::ShmRingReader(ShmRingReader &&other) noexcept {
+  *this = std::move(other);
+}
+
+ShmRingReader &ShmRingReader::operator=(ShmRingReader &&other) noexcept {
+  if (this != &other) {
+    release();
+    map_size_ = std::exchange(other.map_size_, 0);
+    header_ = std::exchange(other.header_, nullptr);
+    slots_ = std::exchange(other.slots_, nullptr);
+    data_ = std::exchange(other.data_, nullptr);
+    next_seq_ = other.next_seq_;
+    dropped_ = other.dropped_;
+    need_keyframe_ = other.need_keyframe_;
+  }
+  return *this;
+}
+
+void ShmRingReader::release() {
+  if (header_)
+    munmap(header_, map_size_);
+  header_ = nullptr;
+}
+
+bool ShmRingReader::slot_matches(uint64_t seq, ShmRingEntry *entry) const {
+  const ShmRingSlot &slot = slots_[seq % header_->slot_count];
+  const uint64_t lock = slot.lock.load(std::memory_order_acquire);
+  if (lock != 2 * seq + 2)
+    return false;
+
+  entry->seq = seq;
+  entry->position = slot.position;
+  entry->data = {data_ + slot.position % header_->data_size, slot.size};
+  entry->keyframe = slot.keyframe != 0;
+  entry->timestamp_us = slot.timestamp_us;
+  entry->width = slot.width;
+  entry->height = slot.height;
+  entry->stride = slot.stride;
+  entry->cv_type = slot.cv_type;
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.lock.load(std::memory_order_relaxed) == lock;
+}
+
+bool ShmRingReader::still_valid(const ShmRingEntry &entry) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return header_->reserved.load(std::memory_order_relaxed) <=
+         entry.position + header_->data_size;
+}
+
+void ShmRingReader::seek_to_newest() {
+  const uint64_t head = header_->head.load(std::memory_order_acquire);
+  next_seq_ = head;
+  if (kind() != ShmRingKind::ENCODED)
+    return;
+
+  // Start from the latest IDR that's still intact, so there's something to
+  // decode straight away. Failing that, wait for the next one.
+  need_keyframe_ = true;
+  const uint64_t slots = header_->slot_count;
+  const uint64_t oldest = head > slots ? head - slots : 0;
+  for (uint64_t seq = head; seq-- > oldest;) {
+    ShmRingEntry entry;
+    if (!slot_matches(seq, &entry) || !still_valid(entry))
+      break; // Older ones will have been overwritten too
+    if (entry.keyframe) {
+      next_seq_ = seq;
+      return;
+    }
+  }
+  request_keyframe();
+}
+
+ShmRingReader::Status ShmRingReader::next(ShmRingEntry &entry) {
+  if (!header_)
+    return Status::CLOSED;
+
+  for (;;) {
+    const uint64_t head = header_->head.load(std::memory_order_acquire);
+    if (next_seq_ >= head) {
+      return header_->closed.load(std::memory_order_acquire) ? Status::CLOSED
+                                                             : Status::EMPTY;
+    }
+
+    ShmRingEntry candidate;
+    if (head - next_seq_ > header_->slot_count ||
+        !slot_matches(next_seq_, &candidate) || !still_valid(candidate)) {
+      const uint64_t lapped_at = next_seq_;
+      seek_to_newest();
+      dropped_ += std::max(next_seq_, lapped_at) - lapped_at;
+      return Status::OVERRUN;
+    }
+    next_seq_++;
+
+    // Nothing's decodable until an IDR
+    if (need_keyframe_) {
+      if (!candidate.keyframe)
+        continue;
+      need_keyframe_ = false;
+    }
+    entry = candidate;
+    return Status::OK;
+  }
+}
+
+bool ShmRingReader::wait(std::chrono::milliseconds timeout) {
+  if (!header_)
+    return true;
+  auto ready = [this] {
+    return header_->head.load(std::memory_order_acquire) > next_seq_ ||
+           header_->closed.load(std::memory_order_acquire);
+  };
+
+  // Read the futex word first, so a commit between here and FutexWait makes
+  // the wait return straight away rather than being missed
+  const uint32_t wake = header_->wake.load();
+  if (ready())
+    return true;
+  header_->sleepers.fetch_add(1);
+  FutexWait(header_->wake, wake, timeout);
+  header_->sleepers.fetch_sub(1);
+  return ready();
+}
+
+void ShmRingReader::request_keyframe() {
+  if (header_)
+    header_->keyframe_requests.fetch_add(1, std::memory_order_relaxed);
+}
+
+ShmRingKind ShmRingReader::kind() const {
+  return static_cast<ShmRingKind>(header_->kind);
+}
+
+std::string ShmRingReader::codec() const {
+  return {header_->codec, strnlen(header_->codec, sizeof(header_->codec))};
+}
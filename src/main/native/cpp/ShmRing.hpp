@@ -0,0 +1,186 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * Shared-memory transport for consumers on the same host (a recorder, a second
+ * vision process), which would otherwise pull the stream over RTSP on loopback
+ * and pay for packetizing, kernel copies and depacketizing for nothing.
+ *
+ * Each ring is a POSIX shared memory object named after the stream (see
+ * ShmRingName), holding the most recent entries: encoded access units, or raw
+ * frames. There's exactly one writer, which never waits for anybody. Readers
+ * attach by name, get views straight into the shared mapping, and find out
+ * from sequence numbers when the writer has lapped them, instead of holding it
+ * up. A reader can be in another process and only needs this file and
+ * ShmRing.cpp.
+ *
+ * Views are only good until the writer comes back round to that part of the
+ * ring, so check ShmRingReader::still_valid after using one (or after copying
+ * out of it), seqlock style.
+ */
+
+enum class ShmRingKind : uint32_t {
+  // Annex-B access units, as sent over RTP
+  ENCODED = 0,
+  // Uncompressed frames, as handed to PublishCameraFrame
+  RAW = 1,
+};
+
+/**
+ * Name of the shared memory object for a stream's ring, e.g.
+ * "/hevc-meme.lifecam.hevc" for codec "hevc". Raw frames ignore codec and go
+ * in "/hevc-meme.lifecam.raw".
+ */
+std::string ShmRingName(const std::string &stream_name, ShmRingKind kind,
+                        const std::string &codec = "hevc");
+
+struct ShmRingEntry {
+  std::span<const uint8_t> data;
+  // Numbers every entry ever written to the ring, without gaps
+  uint64_t seq = 0;
+  // Capture time, microseconds of wall clock (av_gettime)
+  int64_t timestamp_us = 0;
+  // Encoded only: starts with an IDR and its parameter sets
+  bool keyframe = false;
+
+  // Raw only: geometry and OpenCV type (CV_8UC3 etc.) of data
+  int width = 0;
+  int height = 0;
+  int stride = 0;
+  int cv_type = 0;
+
+  // Where data sits in the ring, for still_valid
+  uint64_t position = 0;
+};
+
+struct ShmRingHeader;
+struct ShmRingSlot;
+
+/** The publishing side. Only one per ring, and only used from one thread. */
+class ShmRingWriter {
+public:
+  /**
+   * Create (or replace) the ring for a stream: `slots` entries at most, with
+   * `data_size` bytes between them. codec is just passed on to readers. mode
+   * is the shared memory object's permissions; by default only processes
+   * running as our user can attach. Throws std::runtime_error on failure.
+   */
+  ShmRingWriter(const std::string &name, ShmRingKind kind, size_t data_size,
+                uint32_t slots, const std::string &codec = {},
+                mode_t mode = 0600);
+  ~ShmRingWriter();
+  ShmRingWriter(const ShmRingWriter &) = delete;
+  ShmRingWriter &operator=(const ShmRingWriter &) = delete;
+
+  /**
+   * Space for the next entry's data, to fill in and then commit. Whatever was
+   * there is invalidated for readers straight away. Empty if size is more
+   * than the ring holds.
+   */
+  std::span<uint8_t> reserve(size_t size);
+
+  /** Publish the entry just reserved. entry.data and seq are ignored. */
+  void commit(const ShmRingEntry &entry);
+
+  /** reserve, copy entry.data in, and commit. False if it doesn't fit. */
+  bool write(const ShmRingEntry &entry);
+
+  /** True (once per request) if a reader has asked for an IDR */
+  bool keyframe_requested();
+
+  size_t data_size() const { return data_size_; }
+  const std::string &name() const { return name_; }
+
+private:
+  std::string name_;
+  size_t data_size_;
+  uint32_t slot_count_;
+  size_t map_size_ = 0;
+
+  ShmRingHeader *header_ = nullptr;
+  ShmRingSlot *slots_ = nullptr;
+  uint8_t *data_ = nullptr;
+
+  // Next free byte, counting from when the ring was created
+  uint64_t position_ = 0;
+  uint64_t reserved_at_ = 0;
+  size_t reserved_size_ = 0;
+  uint32_t keyframe_requests_seen_ = 0;
+};
+
+/** The consuming side. Use from one thread; make one per thread if need be. */
+class ShmRingReader {
+public:
+  enum class Status {
+    // Got an entry
+    OK,
+    // Caught up with the writer
+    EMPTY,
+    // Lapped by the writer; skipped to the newest entry we can start from
+    // (the latest IDR, for encoded rings). See dropped().
+    OVERRUN,
+    // The writer has gone away or replaced the ring. Attach again.
+    CLOSED,
+  };
+
+  /**
+   * Attach to a ring by name, starting from the newest entry (the latest
+   * keyframe still in the ring, if encoded). Throws std::runtime_error if
+   * there's no such ring.
+   */
+  explicit ShmRingReader(const std::string &name);
+  ~ShmRingReader();
+  ShmRingReader(ShmRingReader &&other) noexcept;
+  ShmRingReader &operator=(ShmRingReader &&other) noexcept;
+
+  /** Take the next entry, if there is one. Doesn't block. */
+  Status next(ShmRingEntry &entry);
+
+  /**
+   * Whether entry's data is still intact. Anything read from it is only
+   * trustworthy if this is true afterwards.
+   */
+  bool still_valid(const ShmRingEntry &entry) const;
+
+  /**
+   * Block until there's something for next() (including CLOSED), or timeout.
+   * Returns false on timeout.
+   */
+  bool wait(std::chrono::milliseconds timeout);
+
+  /** Ask the writer for an IDR, e.g. after a decode error */
+  void request_keyframe();
+
+  ShmRingKind kind() const;
+  /** Codec name the ring was created with ("hevc", "h264"), for encoded */
+  std::string codec() const;
+  /** Entries skipped because of overruns, in total */
+  uint64_t dropped() const { return dropped_; }
+
+private:
+  void release();
+  void seek_to_newest();
+  bool slot_matches(uint64_t seq, ShmRingEntry *entry) const;
+
+  size_t map_size_ = 0;
+  // Readers write to the header too: keyframe requests and wait()
+  ShmRingHeader *header_ = nullptr;
+  const ShmRingSlot *slots_ = nullptr;
+  const uint8_t *data_ = nullptr;
+
+  uint64_t next_seq_ = 0;
+  uint64_t dropped_ = 0;
+  // Encoded: skip ahead to an IDR before handing anything out
+  bool need_keyframe_ = false;
+};
@@ -0,0 +1,225 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "TextOverlay.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <opencv2/imgproc.hpp>
+#include <utility>
+
+constexpr int FONT = cv::FONT_HERSHEY_SIMPLEX;
+constexpr const char *TIME_PLACEHOLDER = "{time}";
+
+// Written with GCC vector extensions, which become SSE2/AVX2 on x86 and NEON
+// on ARM, 16 bytes at a time. Runs that are fully transparent (most of a text
+// box) are skipped.
+void BlendRow(uint8_t *dst, const uint8_t *alpha, const uint8_t *premul,
+              size_t n) {
+  size_t i = 0;
+#if defined(__GNUC__)
+  using u8x16 = uint8_t __attribute__((vector_size(16)));
+  using u16x16 = uint16_t __attribute__((vector_size(32)));
+  for (; i + 16 <= n; i += 16) {
+    uint64_t any[2];
+    std::memcpy(any, alpha + i, 16);
+    if ((any[0] | any[1]) == 0)
+      continue;
+
+    u8x16 d, a, p;
+    std::memcpy(&d, dst + i, 16);
+    std::memcpy(&a, alpha + i, 16);
+    std::memcpy(&p, premul + i, 16);
+    const u8x16 inverse = 255 - a;
+    u16x16 x = __builtin_convertvector(d, u16x16) *
+                   __builtin_convertvector(inverse, u16x16) +
+               128;
+    x = (x + (x >> 8)) >> 8; // x / 255, rounded
+    const u8x16 out = __builtin_convertvector(x, u8x16) + p;
+    std::memcpy(dst + i, &out, 16);
+  }
+#endif
+  for (; i < n; i++) {
+    const unsigned x = dst[i] * (255u - alpha[i]) + 128;
+    dst[i] = static_cast<uint8_t>(((x + (x >> 8)) >> 8) + premul[i]);
+  }
+}
+
+// ── Atlas ──────────────────────────────────────────────────────────────────
+
+TextOverlay::Atlas::Atlas(double scale, int thickness)
+    : scale(scale), thickness(thickness), pad(thickness + 2) {
+  int baseline = 0;
+  const cv::Size tall =
+      cv::getTextSize("|Agy", FONT, scale, thickness, &baseline);
+  ascent = pad + tall.height;
+  cell_height = ascent + baseline + pad;
+
+  for (char c = FIRST_GLYPH; c <= LAST_GLYPH; c++) {
+    const std::string one(1, c);
+    const int width =
+        cv::getTextSize(one, FONT, scale, thickness, &baseline).width;
+    // Hershey fonts have no kerning, so this is how far putText moves along
+    // for this character
+    const int i = c - FIRST_GLYPH;
+    advance[i] =
+        cv::getTextSize(one + one, FONT, scale, thickness, &baseline).width -
+        width;
+    glyphs[i] = cv::Mat::zeros(cell_height, width + 2 * pad, CV_8UC1);
+    cv::putText(glyphs[i], one, cv::Point(pad, ascent), FONT, scale,
+                cv::Scalar(255), thickness, cv::LINE_AA);
+  }
+}
+
+const cv::Mat &TextOverlay::Atlas::glyph(char c) const {
+  if (c < FIRST_GLYPH || c > LAST_GLYPH)
+    c = '?';
+  return glyphs[c - FIRST_GLYPH];
+}
+
+int TextOverlay::Atlas::advance_of(char c) const {
+  if (c < FIRST_GLYPH || c > LAST_GLYPH)
+    c = '?';
+  return advance[c - FIRST_GLYPH];
+}
+
+const TextOverlay::Atlas &TextOverlay::atlas_for(double scale,
+                                                 int thickness) {
+  for (const auto &atlas : atlases_) {
+    if (atlas->scale == scale && atlas->thickness == thickness)
+      return *atlas;
+  }
+  return *atlases_.emplace_back(std::make_unique<Atlas>(scale, thickness));
+}
+
+// ── Overlay ────────────────────────────────────────────────────────────────
+
+void TextOverlay::set(std::vector<OverlayText> lines) {
+  for (auto &line : lines)
+    line.thickness = std::max(line.thickness, 1);
+  std::scoped_lock lock{mutex_};
+  pending_ = std::move(lines);
+  changed_ = true;
+}
+
+bool TextOverlay::empty() const {
+  std::scoped_lock lock{mutex_};
+  return pending_.empty();
+}
+
+/**
+ * Bring a line's mask up to date with `text`, redoing only what's to the right
+ * of the first character that changed.
+ */
+void TextOverlay::render(Line &line, const std::string &text) {
+  const Atlas &atlas = *line.atlas;
+
+  size_t from = 0;
+  while (from < text.size() && from < line.shown.size() &&
+         text[from] == line.shown[from])
+    from++;
+  if (text == line.shown && !line.alpha.empty())
+    return;
+
+  const size_t n = text.size();
+  line.x.resize(n + 1);
+  line.x[0] = 0;
+  for (size_t i = 1; i <= n; i++)
+    line.x[i] = line.x[i - 1] + atlas.advance_of(text[i - 1]);
+  const int width = line.x[n] + 2 * atlas.pad + atlas.thickness;
+
+  if (line.alpha.cols != width) {
+    line.alpha = cv::Mat::zeros(atlas.cell_height, width, CV_8UC1);
+    line.alpha3.create(atlas.cell_height, width, CV_8UC3);
+    line.premul.create(atlas.cell_height, width, CV_8UC3);
+    from = 0;
+  }
+
+  // Clear from the changed character on, then redraw every glyph reaching
+  // into that (neighbours' anti-aliasing and strokes overlap a little)
+  const int clear_x = from < n ? line.x[from] : line.x[n];
+  line.alpha.colRange(clear_x, width).setTo(0);
+  for (size_t i = 0; i < n; i++) {
+    const cv::Mat &glyph = atlas.glyph(text[i]);
+    const int left = line.x[i];
+    const int right = std::min(left + glyph.cols, width);
+    if (right <= clear_x)
+      continue;
+    cv::Mat cell = line.alpha.colRange(left, right);
+    cv::max(cell, glyph.colRange(0, right - left), cell);
+  }
+
+  uint8_t color[3];
+  for (int k = 0; k < 3; k++)
+    color[k] = cv::saturate_cast<uint8_t>(line.spec.color[k]);
+  for (int y = 0; y < line.alpha.rows; y++) {
+    const uint8_t *a = line.alpha.ptr<uint8_t>(y);
+    uint8_t *a3 = line.alpha3.ptr<uint8_t>(y);
+    uint8_t *p = line.premul.ptr<uint8_t>(y);
+    for (int x = clear_x; x < width; x++) {
+      for (int k = 0; k < 3; k++) {
+        a3[3 * x + k] = a[x];
+        p[3 * x + k] = static_cast<uint8_t>((color[k] * a[x] + 127) / 255);
+      }
+    }
+  }
+  line.shown = text;
+}
+
+void TextOverlay::draw(cv::Mat &bgr, int64_t captured_us) {
+  if (bgr.type() != CV_8UC3)
+    return;
+
+  {
+    std::scoped_lock lock{mutex_};
+    if (std::exchange(changed_, false)) {
+      lines_.clear();
+      for (const auto &spec : pending_) {
+        Line line;
+        line.spec = spec;
+        line.atlas = &atlas_for(spec.scale, spec.thickness);
+        lines_.push_back(std::move(line));
+      }
+    }
+  }
+  if (lines_.empty())
+    return;
+
+  const time_t seconds = captured_us / 1'000'000;
+  tm local{};
+  localtime_r(&seconds, &local);
+  char timestamp[32];
+  std::snprintf(timestamp, sizeof(timestamp), "%02d:%02d:%02d.%03d",
+                local.tm_hour, local.tm_min, local.tm_sec,
+                static_cast<int>(captured_us / 1000 % 1000));
+
+  const cv::Rect frame_rect{0, 0, bgr.cols, bgr.rows};
+  std::string text;
+  for (auto &line : lines_) {
+    text = line.spec.text;
+    for (size_t at = text.find(TIME_PLACEHOLDER); at != std::string::npos;
+         at = text.find(TIME_PLACEHOLDER, at)) {
+      text.replace(at, std::strlen(TIME_PLACEHOLDER), timestamp);
+    }
+    render(line, text);
+
+    // Where the mask goes, so its baseline lands on origin
+    const cv::Rect box{line.spec.origin.x - line.atlas->pad,
+                       line.spec.origin.y - line.atlas->ascent,
+                       line.alpha.cols, line.alpha.rows};
+    const cv::Rect visible = box & frame_rect;
+    if (visible.empty())
+      continue;
+    const size_t bytes = 3 * visible.width;
+    for (int y = visible.y; y < visible.y + visible.height; y++) {
+      const int mask_y = y - box.y;
+      const int mask_x = 3 * (visible.x - box.x);
+      BlendRow(bgr.ptr<uint8_t>(y) + 3 * visible.x,
+               line.alpha3.ptr<uint8_t>(mask_y) + mask_x,
+               line.premul.ptr<uint8_t>(mask_y) + mask_x, bytes);
+    }
+  }
+}
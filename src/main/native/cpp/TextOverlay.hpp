@@ -0,0 +1,100 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+/** A line of text burnt into every frame of a stream */
+struct OverlayText {
+  // "{time}" is replaced by the frame's capture time, as HH:MM:SS.mmm
+  std::string text;
+  // Bottom left of the text, as for cv::putText
+  cv::Point origin;
+  // BGR
+  cv::Scalar color{255, 255, 255};
+  // FONT_HERSHEY_SIMPLEX, like cv::putText with LINE_AA
+  double scale = 1.0;
+  int thickness = 2;
+};
+
+/**
+ * dst = premul + dst * (255 - alpha) / 255, byte by byte, where premul is the
+ * text color times alpha / 255, rounded. Within one of the exact result.
+ */
+void BlendRow(uint8_t *dst, const uint8_t *alpha, const uint8_t *premul,
+              size_t n);
+
+/**
+ * Draws text into frames far cheaper than cv::putText does. Each glyph is
+ * rasterized once (with cv::putText, so it looks the same) into an atlas,
+ * glyphs are put together into a cached alpha mask per line of text, and the
+ * masks are alpha blended into the frame with SIMD. A line is only put back
+ * together from the first character that changed, so a ticking timestamp
+ * costs a few glyph copies a frame.
+ *
+ * set() may be called from any thread. draw() is only called from one thread
+ * at a time.
+ */
+class TextOverlay {
+public:
+  void set(std::vector<OverlayText> lines);
+  bool empty() const;
+
+  /** Blend the text into a CV_8UC3 frame. Anything off the frame is clipped. */
+  void draw(cv::Mat &bgr, int64_t captured_us);
+
+private:
+  static constexpr char FIRST_GLYPH = ' ';
+  static constexpr char LAST_GLYPH = '~';
+
+  // Every printable ASCII character at one scale and thickness
+  struct Atlas {
+    double scale;
+    int thickness;
+    // Room around each glyph for anti-aliasing and stroke width
+    int pad;
+    // Baseline's distance from the top of a glyph cell
+    int ascent;
+    int cell_height;
+    std::array<cv::Mat, LAST_GLYPH - FIRST_GLYPH + 1> glyphs; // CV_8UC1 alpha
+    std::array<int, LAST_GLYPH - FIRST_GLYPH + 1> advance;
+
+    Atlas(double scale, int thickness);
+    const cv::Mat &glyph(char c) const;
+    int advance_of(char c) const;
+  };
+
+  struct Line {
+    OverlayText spec;
+    const Atlas *atlas = nullptr;
+    // What's rendered in the mask, and where each character of it starts
+    std::string shown;
+    std::vector<int> x;
+    cv::Mat alpha;  // CV_8UC1
+    // Blend inputs, per byte of BGR: alpha repeated for each channel, and
+    // color premultiplied by alpha
+    cv::Mat alpha3; // CV_8UC3
+    cv::Mat premul; // CV_8UC3
+  };
+
+  const Atlas &atlas_for(double scale, int thickness);
+  void render(Line &line, const std::string &text);
+
+  mutable std::mutex mutex_;
+  std::vector<OverlayText> pending_;
+  bool changed_ = false;
+
+  // Only touched from draw()
+  std::vector<std::unique_ptr<Atlas>> atlases_;
+  std::vector<Line> lines_;
+};
@@ -12,15 +12,17 @@
 // Open Source Software; you can modify and/or share it under the terms of
 // the WPILib BSD license file in the root directory of this project.
 
-#include <cstdio>
+#include <charconv>
 #include <memory>
 
+#include "Logging.hpp"
 #include "RtspClientsMap.hpp"
 #include "rtsp_server.hpp"
 #include <random>
 #include <regex>
 #include <span>
 #include <string>
+#include <fmt/format.h>
 #include <wpi/SmallVector.h>
 #include <wpi/print.h>
 #include <wpinet/EventLoopRunner.h>
@@ -29,10 +31,18 @@
 #include <wpinet/raw_uv_ostream.h>
 #include <wpinet/uv/Loop.h>
 #include <wpinet/uv/Tcp.h>
+#include <wpinet/uv/Timer.h>
 #include <wpinet/uv/util.h>
 
 namespace uv = wpi::uv;
 
+// Longest we'll hold a SETUP waiting for the stream's encoder to open
+static constexpr uv::Timer::Time SETUP_TIMEOUT{3000};
+// Largest request we'll buffer, headers and body (SET_PARAMETER's) each, so
+// a client can't have us wait on and hold however much it claims to send
+static constexpr size_t MAX_REQUEST_HEADERS = 8192;
+static constexpr size_t MAX_REQUEST_BODY = 4096;
+
 std::string GenerateSessionID() {
   std::random_device rd;
   std::mt19937_64 gen(rd());
@@ -41,18 +51,115 @@ std::string GenerateSessionID() {
   return std::to_string(dis(gen));
 }
 
-// Serve this DUMMY_SDP, a generic H265 SDP which relies on SPS/VPS/PPS
-// transmitted in-band in the RTP stream
-static std::string DUMMY_SDP =
-    "v=0\r\n"
-    "o=- 0 0 IN IP4 127.0.0.1\r\n"
-    "s=No Name\r\n"
-    "c=IN IP4 0.0.0.0\r\n" // overridden by SETUP/PLAY anyway
-    "t=0 0\r\n"
-    "m=video 0 RTP/AVP 96\r\n" // port 0 = unicast placeholder
-    "a=rtpmap:96 H265/90000\r\n"
-    "a=control:trackID=0\r\n"; // needed by some clients to SETUP the right
-                               // track
+// Lowest H.264 level (table A-1) that covers this size and frame rate, as the
+// level_idc byte of profile-level-id
+static int H264LevelIdc(int width, int height, int fps) {
+  struct Level {
+    int idc, max_frame_mbs, max_mbs_per_sec;
+  };
+  static constexpr Level levels[] = {
+      {30, 1620, 40500},   {31, 3600, 108000},  {32, 5120, 216000},
+      {40, 8192, 245760},  {42, 8704, 522240},  {50, 22080, 589824},
+      {51, 36864, 983040}, {52, 36864, 2073600},
+  };
+  const int frame_mbs = ((width + 15) / 16) * ((height + 15) / 16);
+  const int mbs_per_sec = frame_mbs * std::max(fps, 1);
+  for (const auto &level : levels) {
+    if (frame_mbs <= level.max_frame_mbs &&
+        mbs_per_sec <= level.max_mbs_per_sec)
+      return level.idc;
+  }
+  return levels[std::size(levels) - 1].idc;
+}
+
+// For sprop-* parameter sets (RFC 4648, with padding)
+static std::string Base64(std::span<const uint8_t> data) {
+  static constexpr char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((data.size() + 2) / 3 * 4);
+  for (size_t i = 0; i < data.size(); i += 3) {
+    const size_t left = data.size() - i;
+    const uint32_t n = data[i] << 16 | (left > 1 ? data[i + 1] << 8 : 0) |
+                       (left > 2 ? data[i + 2] : 0);
+    out += digits[n >> 18 & 63];
+    out += digits[n >> 12 & 63];
+    out += left > 1 ? digits[n >> 6 & 63] : '=';
+    out += left > 2 ? digits[n & 63] : '=';
+  }
+  return out;
+}
+
+// Serve a generic SDP which relies on parameter sets (VPS/SPS/PPS) transmitted
+// in-band in the RTP stream, and also lists them once we've seen them (always,
+// for streams published already encoded, which may only repeat them every few
+// seconds). If the stream is FEC protected, the FlexFEC repair
+// packets ride along in the same session under their own payload type and
+// SSRC (RFC 8627 section 5.1), so receivers that don't know about it just drop
+// them, and those that do can tell which media SSRC they repair.
+static std::string MakeSdp(const std::optional<CameraStreamInfo> &info,
+                           VideoCodec codec, const RtpSsrcs &ssrcs) {
+  const bool fec = info && info->fec.group_size > 0;
+
+  std::string sdp = "v=0\r\n"
+                    "o=- 0 0 IN IP4 127.0.0.1\r\n"
+                    "s=No Name\r\n"
+                    "c=IN IP4 0.0.0.0\r\n" // overridden by SETUP/PLAY anyway
+                    "t=0 0\r\n";
+  // port 0 = unicast placeholder
+  sdp += fec ? "m=video 0 RTP/AVP 96 97\r\n" : "m=video 0 RTP/AVP 96\r\n";
+  const ParameterSets none;
+  const ParameterSets &params = info ? info->parameter_sets : none;
+  if (codec == VideoCodec::H264) {
+    // Non-interleaved, so FU-A is allowed
+    sdp += "a=rtpmap:96 H264/90000\r\n";
+    if (params.sps.size() >= 4 && !params.pps.empty()) {
+      // profile_idc, constraint flags and level_idc, straight from the SPS
+      sdp += fmt::format("a=fmtp:96 packetization-mode=1;"
+                         "profile-level-id={:02x}{:02x}{:02x};"
+                         "sprop-parameter-sets={},{}\r\n",
+                         params.sps[1], params.sps[2], params.sps[3],
+                         Base64(params.sps), Base64(params.pps));
+    } else {
+      // Constrained baseline, what the encoder is asked for
+      const int level = info ? H264LevelIdc(info->width, info->height,
+                                            info->fps > 0 ? info->fps : 30)
+                             : 31;
+      sdp += fmt::format(
+          "a=fmtp:96 packetization-mode=1;profile-level-id=42e0{:02x}\r\n",
+          level);
+    }
+  } else {
+    sdp += "a=rtpmap:96 H265/90000\r\n";
+    if (!params.vps.empty() && !params.sps.empty() && !params.pps.empty()) {
+      sdp += fmt::format(
+          "a=fmtp:96 sprop-vps={};sprop-sps={};sprop-pps={}\r\n",
+          Base64(params.vps), Base64(params.sps), Base64(params.pps));
+    }
+  }
+  if (info && info->fps > 0) {
+    // What we're actually encoding at, after any decimation
+    int fps = info->fps;
+    if (info->encoder.fps > 0)
+      fps = std::min(fps, info->encoder.fps);
+    sdp += fmt::format("a=framerate:{}\r\n", fps);
+  }
+  if (fec) {
+    // Repair window in microseconds; we never protect across more than one
+    // block, which is well under a frame
+    sdp += "a=rtpmap:97 flexfec/90000\r\n"
+           "a=fmtp:97 repair-window=200000\r\n";
+    sdp += fmt::format("a=ssrc-group:FEC-FR {} {}\r\n", ssrcs.media,
+                       ssrcs.fec);
+  }
+  // Same CNAME as our RTCP SDES
+  sdp += fmt::format("a=ssrc:{} cname:photonvision\r\n", ssrcs.media);
+  if (fec)
+    sdp += fmt::format("a=ssrc:{} cname:photonvision\r\n", ssrcs.fec);
+  // needed by some clients to SETUP the right track
+  sdp += "a=control:trackID=0\r\n";
+  return sdp;
+}
 
 static std::string extractCameraName(const std::string &rtspRequest) {
   static const std::regex pattern(
@@ -69,6 +176,27 @@ static std::string extractCameraName(const std::string &rtspRequest) {
   return {};
 }
 
+// Codec asked for in the request URL, e.g. rtsp://host:5801/lifecam?codec=h264.
+// Clients append the track's control path to the DESCRIBE URL for SETUP, so
+// the query can come before more path.
+static std::optional<VideoCodec> extractCodec(const std::string &rtspRequest) {
+  static const std::regex pattern(
+      R"(^\w+\s+rtsp://[^\s?]*\?(?:[^\s]*&)?codec=(\w+))",
+      std::regex::ECMAScript);
+
+  std::smatch match;
+  if (!std::regex_search(rtspRequest, match, pattern))
+    return std::nullopt;
+
+  const std::string codec = RtspServerConnectionHandler::to_lowercase(
+      match[1].str());
+  if (codec == "h264" || codec == "avc")
+    return VideoCodec::H264;
+  if (codec == "h265" || codec == "hevc")
+    return VideoCodec::HEVC;
+  return std::nullopt;
+}
+
 // From HttpServerConnection.cpp
 void RtspServerConnectionHandler::SendData(std::span<const uv::Buffer> bufs,
                                            bool closeAfter) {
@@ -77,7 +205,7 @@ void RtspServerConnectionHandler::SendData(std::span<const uv::Buffer> bufs,
       buf.Deallocate();
     }
     if (closeAfter) {
-      std::puts("Closing stream after sending response...\n");
+      LOG_VERBOSE("Closing stream after sending response");
       stream->Close();
     }
   });
@@ -95,7 +223,7 @@ void RtspServerConnectionHandler::SendResponse(
   resp += "\r\n";
   resp += body;
 
-  wpi::print(stderr, "\nSending response:>>>>\n{}\n<<<<\n", resp);
+  LOG_VERBOSE("Sending response:>>>>\n{}<<<<", resp);
 
   wpi::SmallVector<uv::Buffer, 4> toSend;
   wpi::raw_uv_ostream os{toSend, 4096};
@@ -120,6 +248,10 @@ RtspState RtspServerConnectionHandler::requestTypeFromRequest(
     return RtspState::PLAY;
   if (request.starts_with("TEARDOWN"))
     return RtspState::TEARDOWN;
+  if (request.starts_with("SET_PARAMETER"))
+    return RtspState::SET_PARAMETER;
+  if (request.starts_with("GET_PARAMETER"))
+    return RtspState::GET_PARAMETER;
   return RtspState::OPTIONS; // default to something
 }
 
@@ -142,6 +274,21 @@ RtspServerConnectionHandler::cseqFromRequest(const std::string_view request) {
   return std::string{request.substr(cseqPos, cseqEnd - cseqPos)};
 }
 
+size_t RtspServerConnectionHandler::contentLengthFromRequest(
+    const std::string_view request) {
+  static const std::string header = "Content-Length:";
+  auto pos = request.find(header);
+  if (pos == std::string_view::npos)
+    return 0;
+
+  pos += header.size();
+  while (pos < request.size() && request[pos] == ' ')
+    ++pos;
+  size_t len = 0;
+  std::from_chars(request.data() + pos, request.data() + request.size(), len);
+  return len;
+}
+
 void RtspServerConnectionHandler::HandleSetup(std::string_view request,
                                               const std::string &cseq) {
   m_session = GenerateSessionID();
@@ -151,23 +298,70 @@ void RtspServerConnectionHandler::HandleSetup(std::string_view request,
     return;
   }
 
-  std::string transport =
-      "RTP/AVP;unicast;client_port=" + std::to_string(m_destPort) + "-" +
-      std::to_string(m_destPort + 1);
-
-  auto info = GetCameraStreamInfo(m_streamPath);
+  // Whatever the SETUP URL says, or failing that whatever we DESCRIBEd
+  const VideoCodec codec =
+      extractCodec(std::string{request}).value_or(m_codec);
+  auto info = GetCameraStreamInfo(m_streamPath, codec);
   if (!info) {
     SendResponse(404, "Not Found", cseq, {});
     return;
   }
 
-  // Time to make our stream!
-  m_ffmpegStreamer.emplace(info->width, info->height,
-                           std::string("rtp://") + m_destIp + ":" +
-                               std::to_string(m_destPort));
+  auto cameraStream = GetCameraStream(m_streamPath, codec);
+  if (!cameraStream) {
+    SendResponse(404, "Not Found", cseq, {});
+    return;
+  }
+
+  // Time to make our stream! A second SETUP replaces the first
+  Stop();
+  try {
+    m_sender = std::make_shared<RtpSender>(m_destIp, m_destPort, info->fec,
+                                           codec, m_pacer, m_ssrcs);
+  } catch (const std::exception &e) {
+    // Out of ports, say. Nothing may escape into the event loop.
+    LOG_WARN("couldn't set up RTP to {}:{}: {}", m_destIp, m_destPort,
+             e.what());
+    SendResponse(500, "Internal Server Error", cseq, {});
+    return;
+  }
+  m_cameraStream = std::move(cameraStream);
 
-  SendResponse(200, "OK", cseq,
-               {{"Session", m_session}, {"Transport", transport}});
+  // Tell the client where we send from, so its receiver reports come back to
+  // a socket we're reading
+  std::string transport =
+      fmt::format("RTP/AVP;unicast;client_port={}-{};server_port={}-{};"
+                  "ssrc={:08X}",
+                  m_destPort, m_destPort + 1, m_sender->local_rtp_port(),
+                  m_sender->local_rtcp_port(), m_sender->ssrc());
+
+  // Answer once the stream's encoder is open. It's normally already open and
+  // idling, but right after the camera starts publishing it may still be
+  // opening on a worker, and waiting for it here would stall every other
+  // connection on this loop.
+  auto answered = std::make_shared<bool>(false);
+  auto answer = [weak = weak_from_this(), sender = m_sender, cseq, transport,
+                 answered](bool ready) {
+    auto self = weak.lock();
+    // Gone, torn down, or set up again since
+    if (!self || self->m_sender != sender || *answered)
+      return;
+    *answered = true;
+
+    if (ready) {
+      self->SendResponse(
+          200, "OK", cseq,
+          {{"Session", self->m_session}, {"Transport", transport}});
+    } else {
+      self->Stop();
+      self->SendResponse(503, "Service Unavailable", cseq, {});
+    }
+  };
+  m_cameraStream->subscribe(m_sender, [answer, loop = m_loop] {
+    RunOnRtspLoop(loop, [answer] { answer(true); });
+  });
+  uv::Timer::SingleShot(m_stream->GetLoopRef(), SETUP_TIMEOUT,
+                        [answer] { answer(false); });
 }
 
 /**
@@ -210,9 +404,16 @@ bool RtspServerConnectionHandler::ExtractSetupDest(
     auto dashPos = clientPortStrVal.find('-');
     if (dashPos == std::string::npos)
       return false;
-    std::string clientPortStrVal1 = clientPortStrVal.substr(0, dashPos);
-
-    m_destPort = std::stoul(clientPortStrVal1);
+    // RTP goes to an even port and RTCP to the one above it (RFC 3550), so
+    // both have to fit
+    int port = 0;
+    const char *first = clientPortStrVal.data();
+    const char *last = first + dashPos;
+    auto [end, ec] = std::from_chars(first, last, port);
+    if (ec != std::errc{} || end != last || port <= 0 || port > 65534 ||
+        port % 2 != 0)
+      return false;
+    m_destPort = port;
   }
 
   // Dest IP from peer address of the connection
@@ -235,9 +436,111 @@ bool RtspServerConnectionHandler::ExtractSetupDest(
   return true;
 }
 
+/**
+ * Change encoder settings for the stream, from a text/parameters body of
+ * "key: value" lines. Keys are bitrate (bps), gop (frames), fps (0 to follow
+ * the camera), rate_control (cbr, vbr or cq), quality (QP/CRF, 0-51), slices
+ * and temporal_layers (1-3). Applies to everyone watching the stream, in
+ * either codec, not just this client.
+ */
+void RtspServerConnectionHandler::HandleSetParameter(std::string_view request,
+                                                     const std::string &cseq) {
+  auto bodyPos = request.find("\r\n\r\n");
+  std::string_view body = bodyPos == std::string_view::npos
+                              ? std::string_view{}
+                              : request.substr(bodyPos + 4);
+
+  // Empty SET_PARAMETER is a keepalive
+  if (body.find_first_not_of(" \r\n") == std::string_view::npos) {
+    SendResponse(200, "OK", cseq, {{"Session", m_session}});
+    return;
+  }
+
+  std::string name = extractCameraName(std::string{request});
+  if (name.empty())
+    name = m_streamPath;
+  auto info = GetCameraStreamInfo(name);
+  if (!info) {
+    SendResponse(404, "Not Found", cseq, {});
+    return;
+  }
+
+  auto settings = info->encoder;
+  while (!body.empty()) {
+    auto eol = body.find_first_of("\r\n");
+    std::string_view line = body.substr(0, eol);
+    body = eol == std::string_view::npos ? std::string_view{}
+                                         : body.substr(eol + 1);
+    if (line.empty())
+      continue;
+
+    auto colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      SendResponse(400, "Bad Request", cseq, {});
+      return;
+    }
+    std::string key = to_lowercase(line.substr(0, colon));
+    std::string_view value = line.substr(colon + 1);
+    while (!value.empty() && value.front() == ' ')
+      value.remove_prefix(1);
+    while (!value.empty() && value.back() == ' ')
+      value.remove_suffix(1);
+
+    if (key == "rate_control") {
+      std::string rc = to_lowercase(value);
+      if (rc == "cbr") {
+        settings.rate_control = RateControl::CBR;
+      } else if (rc == "vbr") {
+        settings.rate_control = RateControl::VBR;
+      } else if (rc == "cq") {
+        settings.rate_control = RateControl::CONSTANT_QUALITY;
+      } else {
+        SendResponse(400, "Bad Request", cseq, {});
+        return;
+      }
+      continue;
+    }
+
+    int number = 0;
+    auto [end, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), number);
+    if (ec != std::errc{} || end != value.data() + value.size() ||
+        number < 0) {
+      SendResponse(400, "Bad Request", cseq, {});
+      return;
+    }
+
+    if (key == "bitrate" && number > 0) {
+      settings.bitrate = number;
+    } else if (key == "gop" && number > 0) {
+      settings.gop = number;
+    } else if (key == "fps") {
+      settings.fps = number;
+    } else if (key == "quality" && number <= 51) {
+      settings.quality = number;
+    } else if (key == "slices" && number > 0) {
+      settings.slices = number;
+    } else if (key == "temporal_layers" && number > 0 &&
+               number <= EncoderSettings::MAX_TEMPORAL_LAYERS) {
+      settings.temporal_layers = number;
+    } else if (key == "bitrate" || key == "gop" || key == "quality" ||
+               key == "slices" || key == "temporal_layers") {
+      SendResponse(400, "Bad Request", cseq, {});
+      return;
+    } else {
+      SendResponse(451, "Parameter Not Understood", cseq, {});
+      return;
+    }
+  }
+
+  // Both codecs, so switching between them doesn't lose the settings
+  ConfigureCameraStream(name, settings);
+  SendResponse(200, "OK", cseq, {{"Session", m_session}});
+}
+
 void RtspServerConnectionHandler::HandleRequest(
     const std::string_view request) {
-  wpi::print(stderr, "Got request:>>>>\n{}\n<<<<\n", request);
+  LOG_VERBOSE("Got request:>>>>\n{}<<<<", request);
 
   auto reqType = requestTypeFromRequest(request);
   auto cseq = cseqFromRequest(request);
@@ -246,12 +549,24 @@ void RtspServerConnectionHandler::HandleRequest(
   switch (reqType) {
   case RtspState::OPTIONS:
     SendResponse(200, "OK", cseq,
-                 {{"Public", "OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN"}}, "");
+                 {{"Public", "OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, "
+                             "GET_PARAMETER, SET_PARAMETER"}}, "");
     break;
-  case RtspState::DESCRIBE:
+  case RtspState::DESCRIBE: {
+    // HEVC unless the URL asks for something else, or the camera's only
+    // published already encoded H.264. Remembered for SETUP, in case the
+    // client drops the query from the URL it sets up with.
+    const std::string name = extractCameraName(std::string{request});
+    m_codec = extractCodec(std::string{request})
+                  .value_or(!GetCameraStreamInfo(name, VideoCodec::HEVC) &&
+                                    GetCameraStreamInfo(name, VideoCodec::H264)
+                                ? VideoCodec::H264
+                                : VideoCodec::HEVC);
     SendResponse(200, "OK", cseq, {{"Content-Type", "application/sdp"}},
-                 DUMMY_SDP);
+                 MakeSdp(GetCameraStreamInfo(name, m_codec), m_codec,
+                         m_ssrcs));
     break;
+  }
   case RtspState::SETUP: {
     HandleSetup(request, cseq);
     break;
@@ -263,19 +578,26 @@ void RtspServerConnectionHandler::HandleRequest(
                  "");
     break;
   case RtspState::TEARDOWN:
-    m_ffmpegStreamer.reset();
+    Stop();
 
     // Send OK, and close after
     SendResponse(200, "OK", cseq, {{"Session", m_session}}, "", true);
     break;
+  case RtspState::SET_PARAMETER:
+    HandleSetParameter(request, cseq);
+    break;
+  case RtspState::GET_PARAMETER:
+    // We don't expose anything to read, but clients send these as keepalives
+    SendResponse(200, "OK", cseq, {{"Session", m_session}});
+    break;
   default:
     break;
   }
 }
 
 RtspServerConnectionHandler::RtspServerConnectionHandler(
-    std::shared_ptr<uv::Tcp> stream)
-    : m_stream(stream) {}
+    std::shared_ptr<uv::Tcp> stream, int loop, Pacer &pacer)
+    : m_stream(stream), m_loop(loop), m_pacer(pacer) {}
 
 void RtspServerConnectionHandler::Start() {
   // Keep ourselves alive as long as the stream is alive.
@@ -288,11 +610,27 @@ void RtspServerConnectionHandler::Start() {
     for (;;) {
       auto pos = self->m_buf.find("\r\n\r\n");
       if (pos == std::string::npos) {
-        break; // Haven't seen the terminator yet — wait for more data.
+        // Haven't seen the terminator yet — wait for more data.
+        if (self->m_buf.size() > MAX_REQUEST_HEADERS)
+          self->RejectTooLarge(self->m_buf);
+        break;
       }
 
-      std::string request = self->m_buf.substr(0, pos + 4);
-      self->m_buf.erase(0, pos + 4);
+      // Wait for the body too, if there is one (SET_PARAMETER)
+      const std::string_view headers =
+          std::string_view{self->m_buf}.substr(0, pos);
+      const size_t body = contentLengthFromRequest(headers);
+      if (pos > MAX_REQUEST_HEADERS || body > MAX_REQUEST_BODY) {
+        self->RejectTooLarge(headers);
+        break;
+      }
+      size_t len = pos + 4 + body;
+      if (self->m_buf.size() < len) {
+        break;
+      }
+
+      std::string request = self->m_buf.substr(0, len);
+      self->m_buf.erase(0, len);
       self->HandleRequest(request);
     }
   });
@@ -306,3 +644,20 @@ void RtspServerConnectionHandler::Start() {
 
   m_stream->StartRead();
 }
+
+void RtspServerConnectionHandler::RejectTooLarge(std::string_view headers) {
+  LOG_WARN("refusing an oversized RTSP request on loop {}", m_loop);
+  SendResponse(413, "Request Entity Too Large", cseqFromRequest(headers), {},
+               "", true);
+  // Nothing more from this client is worth reading
+  m_stream->StopRead();
+  m_buf.clear();
+}
+
+void RtspServerConnectionHandler::Stop() {
+  if (m_cameraStream && m_sender) {
+    m_cameraStream->unsubscribe(m_sender);
+  }
+  m_cameraStream.reset();
+  m_sender.reset();
+}
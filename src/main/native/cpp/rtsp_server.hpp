@@ -5,7 +5,9 @@
 
 #pragma once
 
-#include "FfmpegRtpPipe.hpp"
+#include "CameraStream.hpp"
+#include "Pacer.hpp"
+#include "RtpSender.hpp"
 #include <memory>
 #include <optional>
 #include <string>
@@ -18,12 +20,19 @@ enum class RtspState {
   SETUP,
   PLAY,
   TEARDOWN,
+  SET_PARAMETER,
+  GET_PARAMETER,
 };
 
 class RtspServerConnectionHandler
     : public std::enable_shared_from_this<RtspServerConnectionHandler> {
 public:
-  explicit RtspServerConnectionHandler(std::shared_ptr<wpi::uv::Tcp> stream);
+  /**
+   * A connection accepted by I/O loop `loop` (see StartRtspServerLoop). Its
+   * media is sent from that loop, by its pacer.
+   */
+  RtspServerConnectionHandler(std::shared_ptr<wpi::uv::Tcp> stream, int loop,
+                              Pacer &pacer);
 
   ~RtspServerConnectionHandler() = default;
 
@@ -38,18 +47,8 @@ public:
     return s;
   }
 
-  /**
-   * Called by Java code, unsycnronized with all libuv EventLoop land code.
-   * TODO I need a mutex on m_ffmpegStreamer at the very least
-   */
-  bool OfferFrame(std::string_view stream_name, const cv::Mat &frame) {
-    if (m_ffmpegStreamer && to_lowercase(stream_name) == m_streamPath) {
-      m_ffmpegStreamer->handle_frame(frame);
-      return true;
-    }
-
-    return false;
-  }
+  /** Stop sending media. Safe to call more than once. */
+  void Stop();
 
 private:
   void SendData(std::span<const wpi::uv::Buffer> bufs, bool closeAfter);
@@ -60,14 +59,22 @@ private:
   void SendError(int code, const std::string &reason, const std::string &cseq);
   RtspState requestTypeFromRequest(const std::string_view request);
   std::string cseqFromRequest(const std::string_view request);
+  static size_t contentLengthFromRequest(const std::string_view request);
   void HandleRequest(const std::string_view request);
+  /** Answer 413 and close the connection */
+  void RejectTooLarge(std::string_view headers);
 
   void HandleSetup(std::string_view request, const std::string &cseq);
   bool ExtractSetupDest(const std::string_view request);
+  void HandleSetParameter(std::string_view request, const std::string &cseq);
 
   std::shared_ptr<wpi::uv::Tcp> m_stream;
   std::string m_buf{};
 
+  // The I/O loop this connection lives on, and its pacer
+  int m_loop;
+  Pacer &m_pacer;
+
   RtspState state = RtspState::OPTIONS;
   std::string m_session;
 
@@ -79,7 +86,15 @@ private:
   std::string m_destIp;
   int m_destPort;
 
-  // TODO for now this is one pipeline per RTSP connection
-  // Created when we get a SETUP, destroyed when we get a TEARDOWN
-  std::optional<FfmpegRtpPipeline> m_ffmpegStreamer;
+  // Codec this client asked for in DESCRIBE
+  VideoCodec m_codec = VideoCodec::HEVC;
+
+  // What we send media and FEC under, as told to the client in DESCRIBE.
+  // Kept across SETUPs, so the SDP stays right.
+  RtpSsrcs m_ssrcs = RtpSsrcs::Random();
+
+  // Created when we get a SETUP, dropped when we get a TEARDOWN. The encoder
+  // lives in the CameraStream and is shared with everyone else watching it
+  std::shared_ptr<CameraStream> m_cameraStream;
+  std::shared_ptr<RtpSender> m_sender;
 };
@@ -0,0 +1,58 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "EncodeScheduler.hpp"
+#include "Test.hpp"
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Queue up jobs behind one that holds the only worker, so they're all
+// waiting when it picks the next, then let them run and see in what order
+TEST(EncodeSchedulerRunsByPriorityThenDeadline) {
+  EncodeSchedulerSettings settings;
+  settings.workers = 1;
+  EncodeScheduler scheduler(settings);
+  int streams[5];
+
+  std::promise<void> started, release;
+  std::shared_future<void> released = release.get_future().share();
+  scheduler.submit({.key = &streams[0], .run = [&] {
+                      started.set_value();
+                      released.wait();
+                    }});
+  started.get_future().wait();
+
+  std::mutex mutex;
+  std::vector<std::string> order;
+  auto job = [&](int stream, int priority, int64_t deadline_us,
+                 std::string name) {
+    return EncodeScheduler::Job{.key = &streams[stream],
+                                .priority = priority,
+                                .deadline_us = deadline_us,
+                                .run = [&, name] {
+                                  std::scoped_lock lock{mutex};
+                                  order.push_back(name);
+                                }};
+  };
+  scheduler.submit(job(1, 0, 100, "logging"));
+  scheduler.submit(job(2, 10, 300, "driver late"));
+  scheduler.submit(job(3, 10, 200, "driver early"));
+  scheduler.submit(job(4, 0, 50, "logging early"));
+  // Replaces the frame waiting for stream 1, which is never encoded
+  scheduler.submit(job(1, 0, 100, "logging newer"));
+
+  release.set_value();
+  for (auto &stream : streams)
+    scheduler.wait_idle(&stream);
+
+  std::scoped_lock lock{mutex};
+  const std::vector<std::string> expected = {
+      "driver early", "driver late", "logging early", "logging newer"};
+  REQUIRE(CHECK_EQ(order.size(), expected.size()));
+  for (size_t i = 0; i < expected.size(); i++)
+    CHECK_EQ(order[i], expected[i]);
+}
@@ -0,0 +1,231 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "FlexFec.hpp"
+#include "Test.hpp"
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+using Packet = std::vector<uint8_t>;
+
+constexpr uint8_t FEC_PT = 97;
+constexpr uint32_t MEDIA_SSRC = 0x11223344;
+constexpr uint32_t FEC_SSRC = 0x55667788;
+constexpr size_t RTP_HEADER_SIZE = 12;
+
+static uint16_t get_u16(const uint8_t *p) { return p[0] << 8 | p[1]; }
+
+static uint32_t get_u32(const uint8_t *p) {
+  return uint32_t{p[0]} << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// A media packet with a payload of its own length and contents
+static Packet MediaPacket(uint16_t seq, uint32_t timestamp, bool marker,
+                          size_t payload_size) {
+  Packet pkt(RTP_HEADER_SIZE + payload_size);
+  pkt[0] = 0x80;
+  pkt[1] = (marker ? 0x80 : 0) | 96;
+  pkt[2] = seq >> 8;
+  pkt[3] = seq & 0xFF;
+  for (int i = 0; i < 4; i++) {
+    pkt[4 + i] = timestamp >> (24 - 8 * i);
+    pkt[8 + i] = MEDIA_SSRC >> (24 - 8 * i);
+  }
+  for (size_t i = 0; i < payload_size; i++)
+    pkt[RTP_HEADER_SIZE + i] = static_cast<uint8_t>(seq * 31 + i * 7);
+  return pkt;
+}
+
+struct Repair {
+  uint16_t sn_base;
+  // Offsets from sn_base it protects
+  std::vector<int> offsets;
+  const uint8_t *fec_header;
+  std::span<const uint8_t> payload;
+};
+
+// Parse the FlexFEC header (RFC 8627 4.2.2, F=0) out of a repair packet
+static std::optional<Repair> ParseRepair(const Packet &pkt) {
+  if (pkt.size() < RTP_HEADER_SIZE + 12)
+    return std::nullopt;
+  const uint8_t *p = pkt.data() + RTP_HEADER_SIZE;
+  // R and F both clear
+  if (p[0] & 0xC0)
+    return std::nullopt;
+
+  Repair repair{get_u16(p + 8), {}, p, {}};
+  const uint8_t *mask = p + 10;
+  const uint16_t chunk0 = get_u16(mask);
+  for (int i = 0; i < 15; i++)
+    if (chunk0 & (1 << (14 - i)))
+      repair.offsets.push_back(i);
+  size_t mask_size = 2;
+  if (!(chunk0 & 0x8000)) {
+    const uint32_t chunk1 = get_u32(mask + 2);
+    for (int i = 0; i < 31; i++)
+      if (chunk1 & (uint32_t{1} << (30 - i)))
+        repair.offsets.push_back(15 + i);
+    mask_size = 6;
+    // Three chunk masks are never sent
+    if (!(chunk1 & 0x80000000u))
+      return std::nullopt;
+  }
+  repair.payload = std::span(pkt).subspan(RTP_HEADER_SIZE + 10 + mask_size);
+  return repair;
+}
+
+// Rebuild the one packet missing from what a repair packet protects, the way
+// a receiver would (RFC 8627 6.3.2)
+static Packet Recover(const Repair &repair, const std::vector<Packet> &have,
+                      uint16_t missing_seq) {
+  uint8_t hdr0 = repair.fec_header[0], hdr1 = repair.fec_header[1];
+  uint16_t length = get_u16(repair.fec_header + 2);
+  uint32_t timestamp = get_u32(repair.fec_header + 4);
+  std::vector<uint8_t> payload(repair.payload.begin(), repair.payload.end());
+  for (const auto &pkt : have) {
+    hdr0 ^= pkt[0];
+    hdr1 ^= pkt[1];
+    length ^= pkt.size() - RTP_HEADER_SIZE;
+    timestamp ^= get_u32(pkt.data() + 4);
+    for (size_t i = RTP_HEADER_SIZE; i < pkt.size(); i++)
+      payload[i - RTP_HEADER_SIZE] ^= pkt[i];
+  }
+
+  Packet out(RTP_HEADER_SIZE + length);
+  out[0] = 0x80 | (hdr0 & 0x3F);
+  out[1] = hdr1;
+  out[2] = missing_seq >> 8;
+  out[3] = missing_seq & 0xFF;
+  for (int i = 0; i < 4; i++) {
+    out[4 + i] = timestamp >> (24 - 8 * i);
+    out[8 + i] = MEDIA_SSRC >> (24 - 8 * i);
+  }
+  std::copy_n(payload.begin(), length, out.begin() + RTP_HEADER_SIZE);
+  return out;
+}
+
+struct Sent {
+  std::vector<Packet> media;
+  std::vector<Packet> repair;
+};
+
+// Send count media packets of varying sizes through an encoder, the last one
+// ending the frame
+static Sent Protect(int group_size, int interleave, int count,
+                    uint16_t first_seq = 65530) {
+  Sent sent;
+  FlexFecEncoder fec(FEC_PT, FEC_SSRC, [&](std::span<const uint8_t> pkt) {
+    sent.repair.emplace_back(pkt.begin(), pkt.end());
+  });
+  fec.configure(group_size, interleave);
+  for (int i = 0; i < count; i++) {
+    const bool last = i + 1 == count;
+    sent.media.push_back(MediaPacket(static_cast<uint16_t>(first_seq + i),
+                                     90000 + 3000 * (i / 4), last,
+                                     100 + 97 * i % 1200));
+    fec.add_packet(sent.media.back());
+    if (last)
+      fec.flush();
+  }
+  return sent;
+}
+
+TEST(FlexFecRepairHeader) {
+  const Sent sent = Protect(4, 1, 4);
+  REQUIRE(CHECK_EQ(sent.repair.size(), size_t{1}));
+  const Packet &pkt = sent.repair[0];
+
+  // Its own RTP stream, under the SSRC the SDP groups with the media
+  CHECK_EQ(pkt[0], 0x80);
+  CHECK_EQ(pkt[1], FEC_PT);
+  CHECK_EQ(get_u32(pkt.data() + 8), FEC_SSRC);
+  // Timestamped like the last packet it protects
+  CHECK_EQ(get_u32(pkt.data() + 4), get_u32(sent.media.back().data() + 4));
+
+  auto repair = ParseRepair(pkt);
+  REQUIRE(CHECK(repair.has_value()));
+  CHECK_EQ(repair->sn_base, 65530);
+  CHECK(repair->offsets == std::vector<int>({0, 1, 2, 3}));
+  // Short mask, k bit set
+  CHECK_EQ(get_u16(pkt.data() + RTP_HEADER_SIZE + 10) & 0x8000, 0x8000);
+
+  size_t longest = 0;
+  for (const auto &media : sent.media)
+    longest = std::max(longest, media.size() - RTP_HEADER_SIZE);
+  CHECK_EQ(repair->payload.size(), longest);
+}
+
+TEST(FlexFecLongMask) {
+  // Offsets past 14 need the second mask chunk
+  const Sent sent = Protect(20, 1, 20);
+  REQUIRE(CHECK_EQ(sent.repair.size(), size_t{1}));
+  auto repair = ParseRepair(sent.repair[0]);
+  REQUIRE(CHECK(repair.has_value()));
+  CHECK_EQ(repair->offsets.size(), size_t{20});
+  CHECK_EQ(repair->offsets.back(), 19);
+}
+
+TEST(FlexFecInterleavedMasks) {
+  // Two columns of three: even offsets in one repair packet, odd in the other
+  const Sent sent = Protect(3, 2, 6);
+  REQUIRE(CHECK_EQ(sent.repair.size(), size_t{2}));
+  auto even = ParseRepair(sent.repair[0]);
+  auto odd = ParseRepair(sent.repair[1]);
+  REQUIRE(CHECK(even && odd));
+  CHECK(even->offsets == std::vector<int>({0, 2, 4}));
+  CHECK(odd->offsets == std::vector<int>({1, 3, 5}));
+  // Numbered consecutively in their own sequence space
+  CHECK_EQ(static_cast<uint16_t>(get_u16(sent.repair[1].data() + 2) -
+                                 get_u16(sent.repair[0].data() + 2)),
+           1);
+}
+
+TEST(FlexFecShortBlockAtEndOfFrame) {
+  // The marker closes the block even though it's not full
+  const Sent sent = Protect(8, 1, 3);
+  REQUIRE(CHECK_EQ(sent.repair.size(), size_t{1}));
+  auto repair = ParseRepair(sent.repair[0]);
+  REQUIRE(CHECK(repair.has_value()));
+  CHECK(repair->offsets == std::vector<int>({0, 1, 2}));
+}
+
+TEST(FlexFecRecoversAnyOneLoss) {
+  for (auto [group_size, interleave, count] :
+       {std::tuple{4, 1, 4}, {20, 1, 20}, {3, 2, 6}, {5, 3, 13}}) {
+    const Sent sent = Protect(group_size, interleave, count);
+    for (const auto &pkt : sent.repair) {
+      auto repair = ParseRepair(pkt);
+      REQUIRE(CHECK(repair.has_value()));
+      for (int lost : repair->offsets) {
+        std::vector<Packet> have;
+        for (int offset : repair->offsets) {
+          const size_t index = static_cast<uint16_t>(
+              repair->sn_base + offset - get_u16(sent.media[0].data() + 2));
+          if (offset != lost)
+            have.push_back(sent.media.at(index));
+        }
+        const uint16_t seq = repair->sn_base + lost;
+        const size_t index =
+            static_cast<uint16_t>(seq - get_u16(sent.media[0].data() + 2));
+        CHECK(Recover(*repair, have, seq) == sent.media.at(index));
+      }
+    }
+  }
+}
+
+TEST(XorBytesMatchesBytewise) {
+  // Every size around the 16 and 64 byte strides
+  for (size_t n = 0; n < 200; n++) {
+    std::vector<uint8_t> a(n), b(n), expected(n);
+    for (size_t i = 0; i < n; i++) {
+      a[i] = static_cast<uint8_t>(i * 13 + n);
+      b[i] = static_cast<uint8_t>(i * 101 + 7);
+      expected[i] = a[i] ^ b[i];
+    }
+    XorBytes(a.data(), b.data(), n);
+    CHECK(a == expected);
+  }
+}
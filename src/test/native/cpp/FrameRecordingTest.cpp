@@ -0,0 +1,202 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "FrameRecording.hpp"
+#include "RtspClientsMap.hpp"
+#include "Test.hpp"
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Unique to this process, so tests running side by side don't collide
+static std::string TempPath(const char *test) {
+  return (std::filesystem::temp_directory_path() /
+          (std::string(test) + "-" + std::to_string(getpid()) + ".rec"))
+      .string();
+}
+
+constexpr int FRAMES = 10;
+constexpr int64_t FRAME_US = 33'333;
+
+// Frame i is filled with bytes counting up from i, and has i % 3 ROIs
+static cv::Mat FrameImage(int i) {
+  cv::Mat image(6, 10, CV_8UC3);
+  for (int y = 0; y < image.rows; y++) {
+    uint8_t *row = image.ptr<uint8_t>(y);
+    for (int x = 0; x < image.cols * 3; x++)
+      row[x] = static_cast<uint8_t>(i + y * image.cols * 3 + x);
+  }
+  return image;
+}
+
+static std::vector<RegionOfInterest> FrameRois(int i) {
+  std::vector<RegionOfInterest> rois;
+  for (int r = 0; r < i % 3; r++)
+    rois.push_back({cv::Rect(r, i, 3, 4), -0.25f * r});
+  return rois;
+}
+
+// An H.264 access unit of `size` bytes, its last byte set to i
+static std::vector<uint8_t> EncodedFrame(int i, size_t size = 40) {
+  std::vector<uint8_t> au = {0, 0, 0, 1, 0x65, 0x88};
+  au.resize(size, 0xA5);
+  au.back() = static_cast<uint8_t>(i);
+  return au;
+}
+
+static bool SameImage(const cv::Mat &a, const cv::Mat &b) {
+  if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type())
+    return false;
+  for (int y = 0; y < a.rows; y++) {
+    if (std::memcmp(a.ptr(y), b.ptr(y), a.cols * a.elemSize()) != 0)
+      return false;
+  }
+  return true;
+}
+
+static void Record(const std::string &path) {
+  FrameRecorder recorder(path);
+  for (int i = 0; i < FRAMES; i++) {
+    if (i == 4) {
+      // One that isn't continuous, cut out of a wider image
+      cv::Mat wide(6, 12, CV_8UC3);
+      cv::Mat view = wide(cv::Rect(0, 0, 10, 6));
+      FrameImage(i).copyTo(view);
+      CHECK(recorder.record(view, FrameRois(i), i * FRAME_US));
+    } else if (i == 7) {
+      const auto au = EncodedFrame(i);
+      CHECK(recorder.record_encoded(VideoCodec::H264, au, cv::Size(640, 480),
+                                    i * FRAME_US));
+    } else {
+      CHECK(recorder.record(FrameImage(i), FrameRois(i), i * FRAME_US));
+    }
+  }
+}
+
+static void CheckFrames(const FrameRecording &recording, size_t expected) {
+  REQUIRE(CHECK_EQ(recording.size(), expected));
+  for (size_t n = 0; n < recording.size(); n++) {
+    const int i = static_cast<int>(n);
+    const RecordedFrame frame = recording[n];
+    CHECK_EQ(frame.timestamp_us, i * FRAME_US);
+    if (i == 7) {
+      const auto au = EncodedFrame(i);
+      CHECK(frame.image.empty());
+      CHECK(frame.codec == VideoCodec::H264);
+      CHECK(frame.size == cv::Size(640, 480));
+      CHECK(std::equal(frame.encoded.begin(), frame.encoded.end(), au.begin(),
+                       au.end()));
+      continue;
+    }
+    CHECK(SameImage(frame.image, FrameImage(i)));
+    CHECK_EQ(reinterpret_cast<uintptr_t>(frame.image.data) % 64, 0u);
+    const auto rois = FrameRois(i);
+    REQUIRE(CHECK_EQ(frame.rois.size(), rois.size()));
+    for (size_t r = 0; r < rois.size(); r++) {
+      CHECK(frame.rois[r].rect == rois[r].rect);
+      CHECK_EQ(frame.rois[r].quality_offset, rois[r].quality_offset);
+    }
+  }
+}
+
+TEST(FrameRecordingRoundTrip) {
+  const std::string path = TempPath("round-trip");
+  Record(path);
+  {
+    const FrameRecording recording(path);
+    CheckFrames(recording, FRAMES);
+    CHECK_EQ(recording.duration_us(), (FRAMES - 1) * FRAME_US);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST(FrameRecordingUnfinished) {
+  const std::string path = TempPath("unfinished");
+  Record(path);
+
+  // Cut off the index and its footer (a frame offset each, then 24 bytes),
+  // as if the recorder had been killed before finishing
+  const auto full = std::filesystem::file_size(path);
+  const auto frames_end = full - FRAMES * sizeof(uint64_t) - 24;
+  std::filesystem::resize_file(path, frames_end);
+  {
+    const FrameRecording recording(path);
+    CheckFrames(recording, FRAMES);
+  }
+
+  // And part way through the last frame
+  std::filesystem::resize_file(path, frames_end - 100);
+  {
+    const FrameRecording recording(path);
+    CheckFrames(recording, FRAMES - 1);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST(FrameRecordingRejectsOtherFiles) {
+  const std::string path = TempPath("not-a-recording");
+  {
+    FILE *file = std::fopen(path.c_str(), "wb");
+    REQUIRE(CHECK(file != nullptr));
+    const std::vector<char> junk(4096, 'x');
+    std::fwrite(junk.data(), 1, junk.size(), file);
+    std::fclose(file);
+  }
+  bool threw = false;
+  try {
+    FrameRecording recording(path);
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+  std::filesystem::remove(path);
+}
+
+// Replay a recording of encoded frames (so no encoder's needed) into a
+// stream that's itself being recorded, and count what comes out
+TEST(ReplayPublishesEveryFrame) {
+  const std::string in_path = TempPath("replay-in");
+  {
+    FrameRecorder recorder(in_path);
+    for (int i = 0; i < FRAMES; i++) {
+      const auto au = EncodedFrame(i);
+      recorder.record_encoded(VideoCodec::H264, au, cv::Size(320, 240),
+                              i * FRAME_US);
+    }
+  }
+  const FrameRecording in(in_path);
+  REQUIRE(CHECK_EQ(in.size(), static_cast<size_t>(FRAMES)));
+
+  const std::string stream = "replay-test-" + std::to_string(getpid());
+  const std::string out_path = TempPath("replay-out");
+  REQUIRE(CHECK(StartCameraStreamRecording(stream, out_path)));
+  std::atomic_bool stop{false};
+  const ReplayStats stats =
+      ReplayRecording(stream, in, {.real_time = false, .loop = false}, stop);
+  StopCameraStreamRecording(stream);
+  CHECK_EQ(stats.frames, static_cast<uint64_t>(FRAMES));
+
+  {
+    const FrameRecording out(out_path);
+    REQUIRE(CHECK_EQ(out.size(), static_cast<size_t>(FRAMES)));
+    for (int i = 0; i < FRAMES; i++) {
+      const auto au = EncodedFrame(i);
+      CHECK(std::equal(out[i].encoded.begin(), out[i].encoded.end(),
+                       au.begin(), au.end()));
+    }
+    // Restamped as if just captured, but as far apart as recorded
+    CHECK_EQ(out.duration_us(), in.duration_us());
+  }
+
+  // Nothing at all once stopped
+  stop = true;
+  CHECK_EQ(ReplayRecording(stream, in, {}, stop).frames, 0u);
+
+  std::filesystem::remove(in_path);
+  std::filesystem::remove(out_path);
+}
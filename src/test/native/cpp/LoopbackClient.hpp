@@ -0,0 +1,98 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include "RtpSender.hpp"
+#include <arpa/inet.h>
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * An RTP client on loopback, with an RtpSender streaming to it. Reports sent
+ * with report() are read by the sender the next time it sends a frame.
+ */
+class LoopbackClient {
+public:
+  explicit LoopbackClient(Pacer &pacer = Pacer::Default()) {
+    // An even/odd pair, like a real client asks for
+    for (int port = 40000; port < 41000 && !sender_; port += 2) {
+      rtp_fd_ = bind_local(port);
+      rtcp_fd_ = bind_local(port + 1);
+      if (rtp_fd_ >= 0 && rtcp_fd_ >= 0)
+        sender_ = std::make_unique<RtpSender>("127.0.0.1", port, FecSettings{},
+                                              VideoCodec::HEVC, pacer);
+      else
+        close_sockets();
+    }
+  }
+  ~LoopbackClient() {
+    sender_.reset();
+    close_sockets();
+  }
+  LoopbackClient(const LoopbackClient &) = delete;
+  LoopbackClient &operator=(const LoopbackClient &) = delete;
+
+  RtpSender *sender() { return sender_.get(); }
+
+  void report(const std::vector<uint8_t> &packet) {
+    sockaddr_in to{};
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    to.sin_port = htons(sender_->local_rtcp_port());
+    sendto(rtcp_fd_, packet.data(), packet.size(), 0,
+           reinterpret_cast<sockaddr *>(&to), sizeof(to));
+  }
+
+  // Have the sender send a frame, which is when it reads reports
+  void send_frame() {
+    static const uint8_t idr[] = {0, 0, 0, 1, 0x26, 0x01, 0xAF, 0x00};
+    send_frame(idr);
+  }
+
+  void send_frame(std::span<const uint8_t> au) {
+    sender_->send_access_unit(au, pts_ += 3000);
+  }
+
+  // Every RTP packet that's arrived since last time
+  std::vector<std::vector<uint8_t>> received() {
+    std::vector<std::vector<uint8_t>> packets;
+    uint8_t buf[2048];
+    ssize_t len;
+    while ((len = recv(rtp_fd_, buf, sizeof(buf), MSG_DONTWAIT)) >= 0)
+      packets.emplace_back(buf, buf + len);
+    return packets;
+  }
+
+private:
+  static int bind_local(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  void close_sockets() {
+    if (rtp_fd_ >= 0)
+      close(rtp_fd_);
+    if (rtcp_fd_ >= 0)
+      close(rtcp_fd_);
+    rtp_fd_ = rtcp_fd_ = -1;
+  }
+
+  int rtp_fd_ = -1, rtcp_fd_ = -1;
+  std::unique_ptr<RtpSender> sender_;
+  int64_t pts_ = 0;
+};
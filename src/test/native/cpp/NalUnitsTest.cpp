@@ -0,0 +1,130 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "NalUnits.hpp"
+#include "Test.hpp"
+#include <cstdint>
+#include <span>
+#include <vector>
+
+using Bytes = std::vector<uint8_t>;
+
+static Bytes ToBytes(std::span<const uint8_t> nal) {
+  return Bytes(nal.begin(), nal.end());
+}
+
+// What libx264 puts in front of its first IDR: SPS, PPS and an IDR slice,
+// with 4-byte start codes
+static const Bytes H264_SPS = {0x67, 0x42, 0xe0, 0x1f, 0xda, 0x01, 0x40};
+static const Bytes H264_PPS = {0x68, 0xce, 0x3c, 0x80};
+static const Bytes H264_IDR = {0x65, 0x88, 0x84, 0x21};
+
+static Bytes AnnexB(std::initializer_list<Bytes> nals, bool long_codes) {
+  Bytes out;
+  for (const auto &nal : nals) {
+    if (long_codes)
+      out.push_back(0);
+    out.insert(out.end(), {0, 0, 1});
+    out.insert(out.end(), nal.begin(), nal.end());
+  }
+  return out;
+}
+
+TEST(SplitAnnexBStripsStartCodes) {
+  for (const bool long_codes : {false, true}) {
+    const Bytes stream = AnnexB({H264_SPS, H264_PPS, H264_IDR}, long_codes);
+    const auto nals = SplitAnnexB(stream);
+    REQUIRE(CHECK_EQ(nals.size(), 3u));
+    CHECK(ToBytes(nals[0]) == H264_SPS);
+    CHECK(ToBytes(nals[1]) == H264_PPS);
+    CHECK(ToBytes(nals[2]) == H264_IDR);
+    // Pointing into the stream, not copies
+    CHECK(nals[0].data() == stream.data() + (long_codes ? 4 : 3));
+  }
+}
+
+TEST(SplitAnnexBDropsTrailingZerosAndJunk) {
+  // Junk before the first start code, trailing_zero_8bits after a NAL, and
+  // an empty NAL between two start codes
+  Bytes stream = {0xff, 0x12};
+  const Bytes body = AnnexB({H264_SPS}, true);
+  stream.insert(stream.end(), body.begin(), body.end());
+  stream.insert(stream.end(), {0, 0, 0, 0, 0, 1, 0, 0, 1});
+  stream.insert(stream.end(), H264_PPS.begin(), H264_PPS.end());
+  stream.insert(stream.end(), {0, 0});
+
+  const auto nals = SplitAnnexB(stream);
+  REQUIRE(CHECK_EQ(nals.size(), 2u));
+  CHECK(ToBytes(nals[0]) == H264_SPS);
+  CHECK(ToBytes(nals[1]) == H264_PPS);
+
+  CHECK(SplitAnnexB({}).empty());
+  CHECK(SplitAnnexB(Bytes{0, 0, 1}).empty());
+  CHECK(SplitAnnexB(Bytes{0x40, 0x01, 0x0c}).empty());
+}
+
+TEST(ScanAccessUnitH264) {
+  ParameterSets params;
+  const Bytes idr = AnnexB({H264_SPS, H264_PPS, H264_IDR}, true);
+  AccessUnitInfo info = ScanAccessUnit(VideoCodec::H264, idr, params);
+  CHECK(info.keyframe);
+  CHECK(info.new_parameter_sets);
+  CHECK(params.sps == H264_SPS);
+  CHECK(params.pps == H264_PPS);
+  CHECK(params.vps.empty());
+
+  // The same parameter sets again aren't new
+  info = ScanAccessUnit(VideoCodec::H264, idr, params);
+  CHECK(info.keyframe);
+  CHECK(!info.new_parameter_sets);
+
+  // A non-IDR slice
+  info = ScanAccessUnit(VideoCodec::H264, AnnexB({{0x41, 0x9a, 0x02}}, false),
+                        params);
+  CHECK(!info.keyframe);
+  CHECK(!info.new_parameter_sets);
+
+  // A changed PPS on its own replaces just that
+  const Bytes pps2 = {0x68, 0xce, 0x3c, 0x81};
+  info = ScanAccessUnit(VideoCodec::H264, AnnexB({pps2}, false), params);
+  CHECK(!info.keyframe);
+  CHECK(info.new_parameter_sets);
+  CHECK(params.sps == H264_SPS);
+  CHECK(params.pps == pps2);
+}
+
+TEST(ScanAccessUnitHevc) {
+  // Two byte NAL headers: type << 1, then TemporalId + 1
+  const Bytes vps = {HEVC_NAL_VPS << 1, 0x01, 0x0c, 0x01};
+  const Bytes sps = {HEVC_NAL_SPS << 1, 0x01, 0x01, 0x60};
+  const Bytes pps = {HEVC_NAL_PPS << 1, 0x01, 0xc1, 0x72};
+  const Bytes idr = {HEVC_NAL_IDR_W_RADL << 1, 0x01, 0xaf, 0x1c};
+  const Bytes cra = {21 << 1, 0x01, 0xaf, 0x1c};
+  const Bytes trail = {1 << 1, 0x02, 0xd0, 0x04};
+
+  ParameterSets params;
+  AccessUnitInfo info =
+      ScanAccessUnit(VideoCodec::HEVC, AnnexB({vps, sps, pps, idr}, true),
+                     params);
+  CHECK(info.keyframe);
+  CHECK(info.new_parameter_sets);
+  CHECK(params.vps == vps);
+  CHECK(params.sps == sps);
+  CHECK(params.pps == pps);
+
+  // Any IRAP picture will do to start decoding from
+  info = ScanAccessUnit(VideoCodec::HEVC, AnnexB({cra}, false), params);
+  CHECK(info.keyframe);
+  CHECK(!info.new_parameter_sets);
+
+  const Bytes trail_au = AnnexB({trail}, false);
+  const auto nals = SplitAnnexB(trail_au);
+  REQUIRE(CHECK_EQ(nals.size(), 1u));
+  CHECK_EQ(HevcNalType(nals[0]), 1);
+  CHECK_EQ(HevcTemporalId(nals[0]), 1);
+  info = ScanAccessUnit(VideoCodec::HEVC, trail_au, params);
+  CHECK(!info.keyframe);
+  CHECK(!info.new_parameter_sets);
+}
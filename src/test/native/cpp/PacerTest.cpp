@@ -0,0 +1,69 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "LoopbackClient.hpp"
+#include "Pacer.hpp"
+#include "Test.hpp"
+#include <chrono>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+// Wait up to timeout for the pacer's timer, like an I/O loop polling it
+static bool WaitReadable(const Pacer &pacer,
+                         std::chrono::milliseconds timeout) {
+  pollfd fd{.fd = pacer.fd(), .events = POLLIN, .revents = 0};
+  return poll(&fd, 1, static_cast<int>(timeout.count())) == 1;
+}
+
+TEST(PolledPacerSendsOnlyWhenDue) {
+  Pacer pacer{Pacer::Polled{}};
+  REQUIRE(CHECK(pacer.polled()));
+
+  int pair[2];
+  REQUIRE(CHECK(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, pair) == 0));
+  auto sock = std::make_shared<PacedSocket>(pair[0]);
+  uint8_t buf[16];
+
+  const uint8_t byte = 42;
+  const auto start = Pacer::Clock::now();
+  pacer.schedule(sock, {&byte, 1}, start + 20ms);
+  CHECK_EQ(sock->queued.load(), 1);
+
+  // Not before it's due, even if asked
+  pacer.send_due();
+  CHECK(recv(pair[1], buf, sizeof(buf), MSG_DONTWAIT) < 0);
+
+  REQUIRE(CHECK(WaitReadable(pacer, 1s)));
+  CHECK(Pacer::Clock::now() - start >= 20ms);
+  pacer.send_due();
+  CHECK_EQ(recv(pair[1], buf, sizeof(buf), MSG_DONTWAIT), 1);
+  CHECK_EQ(buf[0], byte);
+  CHECK_EQ(sock->queued.load(), 0);
+
+  // Nothing left, so it stays quiet
+  CHECK(!WaitReadable(pacer, 50ms));
+  close(pair[1]);
+}
+
+// With a polled pacer, whoever polls it sends a client's media, even packets
+// that were due straight away
+TEST(RtpSenderLeavesEverythingToPolledPacer) {
+  Pacer pacer{Pacer::Polled{}};
+  LoopbackClient client(pacer);
+  REQUIRE(CHECK(client.sender()));
+
+  client.send_frame();
+  std::this_thread::sleep_for(20ms);
+  CHECK(client.received().empty());
+
+  REQUIRE(CHECK(WaitReadable(pacer, 1s)));
+  pacer.send_due();
+  std::this_thread::sleep_for(20ms);
+  CHECK_EQ(client.received().size(), 1u);
+}
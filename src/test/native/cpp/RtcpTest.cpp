@@ -0,0 +1,133 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "LoopbackClient.hpp"
+#include "Test.hpp"
+#include <vector>
+
+constexpr uint32_t CLIENT_SSRC = 0xC0FFEE;
+
+static void put_u16(std::vector<uint8_t> &out, uint16_t v) {
+  out.push_back(v >> 8);
+  out.push_back(v & 0xFF);
+}
+
+static void put_u32(std::vector<uint8_t> &out, uint32_t v) {
+  put_u16(out, v >> 16);
+  put_u16(out, v & 0xFFFF);
+}
+
+struct Block {
+  uint32_t ssrc;
+  uint8_t fraction_lost; // in 1/256ths
+};
+
+// Append an RTCP RR, or an SR if sender_info, carrying these report blocks
+static void AppendReport(std::vector<uint8_t> &out,
+                         std::initializer_list<Block> blocks,
+                         bool sender_info = false) {
+  const size_t words = 1 + (sender_info ? 5 : 0) + 6 * blocks.size();
+  out.push_back(0x80 | blocks.size());
+  out.push_back(sender_info ? 200 : 201);
+  put_u16(out, words);
+  put_u32(out, CLIENT_SSRC);
+  if (sender_info)
+    out.insert(out.end(), 20, 0);
+  for (const auto &block : blocks) {
+    put_u32(out, block.ssrc);
+    out.push_back(block.fraction_lost);
+    out.insert(out.end(), 3 + 4 * 4, 0);
+  }
+}
+
+TEST(RtcpReceiverReportLoss) {
+  LoopbackClient client;
+  REQUIRE(CHECK(client.sender()));
+  CHECK_EQ(client.sender()->reported_loss(), 0.0);
+
+  std::vector<uint8_t> rr;
+  AppendReport(rr, {{client.sender()->ssrc(), 64}});
+  client.report(rr);
+  client.send_frame();
+  CHECK_EQ(client.sender()->reported_loss(), 0.25);
+}
+
+TEST(RtcpIgnoresOtherSsrcs) {
+  LoopbackClient client;
+  REQUIRE(CHECK(client.sender()));
+
+  // About some other stream, and about our repair stream
+  std::vector<uint8_t> rr;
+  AppendReport(rr, {{client.sender()->ssrc() + 1, 128},
+                    {client.sender()->fec_ssrc(), 128}});
+  client.report(rr);
+  client.send_frame();
+  CHECK_EQ(client.sender()->reported_loss(), 0.0);
+}
+
+TEST(RtcpCompoundPacket) {
+  LoopbackClient client;
+  REQUIRE(CHECK(client.sender()));
+
+  // SR with the block second, then an SDES-less RR about someone else: the
+  // SR's block is found past the sender info
+  std::vector<uint8_t> compound;
+  AppendReport(compound, {{1234, 200}, {client.sender()->ssrc(), 32}}, true);
+  AppendReport(compound, {{5678, 255}});
+  client.report(compound);
+  client.send_frame();
+  CHECK_EQ(client.sender()->reported_loss(), 32 / 256.0);
+}
+
+TEST(RtcpTruncatedReport) {
+  LoopbackClient client;
+  REQUIRE(CHECK(client.sender()));
+
+  // Claims two blocks but only has room for one: the one is still read,
+  // and nothing past the end
+  std::vector<uint8_t> rr;
+  AppendReport(rr, {{client.sender()->ssrc(), 16}});
+  rr[0] = 0x82;
+  client.report(rr);
+  client.send_frame();
+  CHECK_EQ(client.sender()->reported_loss(), 16 / 256.0);
+
+  // Length past the end of the datagram: ignored altogether
+  rr.clear();
+  AppendReport(rr, {{client.sender()->ssrc(), 100}});
+  rr[3] += 6;
+  client.report(rr);
+  client.send_frame();
+  CHECK_EQ(client.sender()->reported_loss(), 16 / 256.0);
+}
+
+TEST(RtcpLossDropsTemporalLayers) {
+  LoopbackClient client;
+  REQUIRE(CHECK(client.sender()));
+  client.sender()->set_temporal_layers(3);
+  CHECK_EQ(client.sender()->max_temporal_id(), 2);
+
+  auto report = [&](uint8_t fraction_lost) {
+    std::vector<uint8_t> rr;
+    AppendReport(rr, {{client.sender()->ssrc(), fraction_lost}});
+    client.report(rr);
+    client.send_frame();
+  };
+
+  // 10% loss, a layer per report
+  report(26);
+  CHECK_EQ(client.sender()->max_temporal_id(), 1);
+  report(26);
+  CHECK_EQ(client.sender()->max_temporal_id(), 0);
+  report(26);
+  CHECK_EQ(client.sender()->max_temporal_id(), 0);
+
+  // Back up a layer after three clean reports in a row
+  report(0);
+  report(0);
+  CHECK_EQ(client.sender()->max_temporal_id(), 0);
+  report(0);
+  CHECK_EQ(client.sender()->max_temporal_id(), 1);
+}
@@ -0,0 +1,247 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "ShmRing.hpp"
+#include "Test.hpp"
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+// Unique to this process, so tests running side by side don't collide
+static std::string RingName(const char *test) {
+  return ShmRingName(std::string(test) + "-" + std::to_string(getpid()),
+                     ShmRingKind::ENCODED);
+}
+
+// Entry i is filled with the byte i, its size varies, and every 30th is a
+// keyframe. timestamp_us is i too, so readers can tell what they should see.
+static std::vector<uint8_t> EntryData(int i) {
+  return std::vector<uint8_t>(1000 + (i * 37) % 5000, static_cast<uint8_t>(i));
+}
+
+static void WriteEntry(ShmRingWriter &writer, int i) {
+  const auto data = EntryData(i);
+  writer.write({.data = data, .timestamp_us = i, .keyframe = i % 30 == 0});
+}
+
+static bool Intact(const ShmRingEntry &entry) {
+  const auto expected = EntryData(static_cast<int>(entry.timestamp_us));
+  return entry.data.size() == expected.size() &&
+         std::memcmp(entry.data.data(), expected.data(), expected.size()) == 0;
+}
+
+TEST(ShmRingPrivateByDefault) {
+  const std::string name = RingName("mode");
+  {
+    ShmRingWriter writer(name, ShmRingKind::ENCODED, 4096, 4, "hevc");
+    const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    REQUIRE(CHECK(fd >= 0));
+    struct stat st{};
+    CHECK(fstat(fd, &st) == 0);
+    CHECK_EQ(st.st_mode & 0777, 0600u);
+    close(fd);
+  }
+  {
+    // Whatever the umask would have taken off
+    const mode_t umask_was = umask(0077);
+    ShmRingWriter writer(name, ShmRingKind::ENCODED, 4096, 4, "hevc", 0660);
+    umask(umask_was);
+    const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    REQUIRE(CHECK(fd >= 0));
+    struct stat st{};
+    CHECK(fstat(fd, &st) == 0);
+    CHECK_EQ(st.st_mode & 0777, 0660u);
+    close(fd);
+  }
+}
+
+TEST(ShmRingReaderStartsAtLatestKeyframe) {
+  const std::string name = RingName("start");
+  ShmRingWriter writer(name, ShmRingKind::ENCODED, 64 << 10, 16, "hevc");
+  for (int i = 0; i < 40; i++)
+    WriteEntry(writer, i);
+
+  ShmRingReader reader(name);
+  CHECK_EQ(reader.codec(), std::string("hevc"));
+  ShmRingEntry entry;
+  REQUIRE(CHECK(reader.next(entry) == ShmRingReader::Status::OK));
+  CHECK(entry.keyframe);
+  CHECK_EQ(entry.timestamp_us, 30);
+  CHECK(Intact(entry));
+  for (int i = 31; i < 40; i++) {
+    REQUIRE(CHECK(reader.next(entry) == ShmRingReader::Status::OK));
+    CHECK_EQ(entry.timestamp_us, i);
+  }
+  CHECK(reader.next(entry) == ShmRingReader::Status::EMPTY);
+}
+
+TEST(ShmRingViewInvalidatedWhenOverwritten) {
+  const std::string name = RingName("seqlock");
+  ShmRingWriter writer(name, ShmRingKind::ENCODED, 16 << 10, 64, "hevc");
+  WriteEntry(writer, 0);
+
+  ShmRingReader reader(name);
+  ShmRingEntry entry;
+  REQUIRE(CHECK(reader.next(entry) == ShmRingReader::Status::OK));
+  CHECK(reader.still_valid(entry));
+
+  // Not yet come back round to it
+  WriteEntry(writer, 1);
+  CHECK(reader.still_valid(entry));
+  // Past the 16 KiB of data, so it's been written over
+  for (int i = 2; i < 20; i++)
+    WriteEntry(writer, i);
+  CHECK(!reader.still_valid(entry));
+}
+
+TEST(ShmRingOverrunResyncsOnKeyframe) {
+  const std::string name = RingName("overrun");
+  ShmRingWriter writer(name, ShmRingKind::ENCODED, 64 << 10, 16, "hevc");
+  WriteEntry(writer, 0);
+  ShmRingReader reader(name);
+
+  // Lap the reader: far more than the ring holds, ending mid-GOP
+  for (int i = 1; i < 100; i++)
+    WriteEntry(writer, i);
+
+  ShmRingEntry entry;
+  CHECK(reader.next(entry) == ShmRingReader::Status::OVERRUN);
+  CHECK(reader.dropped() > 0);
+  REQUIRE(CHECK(reader.next(entry) == ShmRingReader::Status::OK));
+  CHECK(entry.keyframe);
+  CHECK_EQ(entry.timestamp_us, 90);
+  CHECK(Intact(entry));
+}
+
+TEST(ShmRingClosedWhenWriterGoes) {
+  const std::string name = RingName("closed");
+  auto writer = std::make_unique<ShmRingWriter>(name, ShmRingKind::ENCODED,
+                                                4096, 4, "hevc");
+  ShmRingReader reader(name);
+  writer.reset();
+  ShmRingEntry entry;
+  CHECK(reader.next(entry) == ShmRingReader::Status::CLOSED);
+  CHECK(reader.wait(0ms));
+}
+
+struct ReaderResult {
+  uint64_t ok = 0;
+  uint64_t overruns = 0;
+  uint64_t dropped = 0;
+  // Entries out of order, other than straight after an overrun
+  uint64_t out_of_order = 0;
+  // Resyncs that didn't land on a keyframe
+  uint64_t bad_resyncs = 0;
+  // Views that were torn but still_valid said were fine
+  uint64_t torn = 0;
+  // Views still_valid caught being overwritten
+  uint64_t invalidated = 0;
+  bool closed = false;
+};
+
+// A reader in another process, slower than the writer every so often
+static ReaderResult ReadUntilClosed(const std::string &name, int ready_fd) {
+  ReaderResult result;
+  ShmRingReader reader(name);
+  const char go = 1;
+  if (write(ready_fd, &go, 1) != 1)
+    return result;
+
+  int64_t last = -1;
+  bool resyncing = false;
+  const auto give_up = std::chrono::steady_clock::now() + 20s;
+  while (std::chrono::steady_clock::now() < give_up) {
+    ShmRingEntry entry;
+    switch (reader.next(entry)) {
+    case ShmRingReader::Status::OK:
+      break;
+    case ShmRingReader::Status::EMPTY:
+      reader.wait(100ms);
+      continue;
+    case ShmRingReader::Status::OVERRUN:
+      result.overruns++;
+      resyncing = true;
+      continue;
+    case ShmRingReader::Status::CLOSED:
+      result.closed = true;
+      result.dropped = reader.dropped();
+      return result;
+    }
+
+    result.ok++;
+    if (resyncing && !entry.keyframe)
+      result.bad_resyncs++;
+    else if (!resyncing && last >= 0 && entry.timestamp_us != last + 1)
+      result.out_of_order++;
+    resyncing = false;
+    last = entry.timestamp_us;
+
+    // Check the data, taking long enough now and then to get lapped
+    const bool intact = Intact(entry);
+    if (entry.timestamp_us % 7 == 0)
+      std::this_thread::sleep_for(2ms);
+    if (!reader.still_valid(entry))
+      result.invalidated++;
+    else if (!intact)
+      result.torn++;
+  }
+  return result;
+}
+
+TEST(ShmRingForkedReaderLapped) {
+  const std::string name = RingName("forked");
+  auto writer = std::make_unique<ShmRingWriter>(name, ShmRingKind::ENCODED,
+                                                64 << 10, 16, "hevc");
+  WriteEntry(*writer, 0);
+
+  int ready[2], results[2];
+  REQUIRE(CHECK(pipe(ready) == 0 && pipe(results) == 0));
+  const pid_t pid = fork();
+  REQUIRE(CHECK(pid >= 0));
+  if (pid == 0) {
+    const ReaderResult result = ReadUntilClosed(name, ready[1]);
+    const bool sent =
+        write(results[1], &result, sizeof(result)) == sizeof(result);
+    _exit(sent ? 0 : 1);
+  }
+
+  char go;
+  CHECK(read(ready[0], &go, 1) == 1);
+  for (int i = 1; i < 20000; i++) {
+    WriteEntry(*writer, i);
+    if (i % 100 == 0)
+      std::this_thread::sleep_for(1ms);
+  }
+  // Let it catch up before closing, so it sees the end of the stream
+  std::this_thread::sleep_for(50ms);
+  writer.reset();
+
+  ReaderResult result;
+  CHECK(read(results[0], &result, sizeof(result)) == sizeof(result));
+  int status = 0;
+  waitpid(pid, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  for (int fd : {ready[0], ready[1], results[0], results[1]})
+    close(fd);
+
+  CHECK(result.closed);
+  CHECK(result.ok > 0);
+  // It was lapped, caught it, and picked up again from keyframes
+  CHECK(result.overruns > 0);
+  CHECK(result.dropped > 0);
+  CHECK_EQ(result.bad_resyncs, uint64_t{0});
+  CHECK_EQ(result.out_of_order, uint64_t{0});
+  // Never handed out anything torn without saying so
+  CHECK_EQ(result.torn, uint64_t{0});
+}
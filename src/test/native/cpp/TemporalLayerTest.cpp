@@ -0,0 +1,136 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "LoopbackClient.hpp"
+#include "Test.hpp"
+#include <chrono>
+#include <fcntl.h>
+#include <set>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+// An HEVC access unit holding one picture in temporal layer tid: an IDR for
+// the base layer, a trailing picture otherwise
+static std::vector<uint8_t> Picture(int tid, size_t size = 64) {
+  std::vector<uint8_t> au = {0, 0, 0, 1};
+  au.push_back(tid == 0 ? 19 << 1 : 1 << 1);
+  au.push_back(tid + 1);
+  au.resize(au.size() + size, 0xA5);
+  return au;
+}
+
+// TemporalIds of the pictures in a batch of RTP packets, from the HEVC
+// payload header, which single NAL and fragmentation unit packets both keep
+static std::set<int> TemporalIds(
+    const std::vector<std::vector<uint8_t>> &packets) {
+  std::set<int> tids;
+  for (const auto &pkt : packets) {
+    if (pkt.size() > 13)
+      tids.insert((pkt[13] & 0x07) - 1);
+  }
+  return tids;
+}
+
+static void ReportLoss(LoopbackClient &client, uint8_t fraction_lost) {
+  const uint32_t ssrc = client.sender()->ssrc();
+  const std::vector<uint8_t> rr = {
+      0x81, 201, 0, 7, 0, 0, 0, 1,
+      uint8_t(ssrc >> 24), uint8_t(ssrc >> 16), uint8_t(ssrc >> 8),
+      uint8_t(ssrc), fraction_lost, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0};
+  client.report(rr);
+}
+
+TEST(TemporalLayersAllSentByDefault) {
+  LoopbackClient client;
+  REQUIRE(CHECK(client.sender()));
+  client.sender()->set_temporal_layers(3);
+  for (int tid : {0, 2, 1, 2})
+    client.send_frame(Picture(tid));
+  std::this_thread::sleep_for(50ms);
+  CHECK(TemporalIds(client.received()) == std::set<int>({0, 1, 2}));
+}
+
+TEST(TemporalLayersDroppedForLoss) {
+  LoopbackClient client;
+  REQUIRE(CHECK(client.sender()));
+  client.sender()->set_temporal_layers(3);
+
+  // Read along with the next frame, so it's already left out of that one
+  ReportLoss(client, 26);
+  for (int tid : {0, 2, 1, 2})
+    client.send_frame(Picture(tid));
+  std::this_thread::sleep_for(50ms);
+  CHECK(TemporalIds(client.received()) == std::set<int>({0, 1}));
+
+  ReportLoss(client, 26);
+  for (int tid : {0, 2, 1, 2})
+    client.send_frame(Picture(tid));
+  std::this_thread::sleep_for(50ms);
+  CHECK(TemporalIds(client.received()) == std::set<int>({0}));
+}
+
+TEST(TemporalLayersOneLayerKeepsEverything) {
+  // A stream encoded without layers has nothing droppable, however bad it
+  // gets
+  LoopbackClient client;
+  REQUIRE(CHECK(client.sender()));
+  client.sender()->set_temporal_layers(1);
+  ReportLoss(client, 128);
+  for (int tid : {0, 2, 1, 2})
+    client.send_frame(Picture(tid));
+  std::this_thread::sleep_for(50ms);
+  CHECK(TemporalIds(client.received()) == std::set<int>({0, 1, 2}));
+}
+
+TEST(TemporalLayersDroppedForSendBacklog) {
+  Pacer pacer;
+
+  // A socket nobody's reading, full up, for the pacer to get stuck sending
+  // to, like it would on a link that can't keep up
+  int pair[2];
+  REQUIRE(CHECK(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, pair) == 0));
+  const int flags = fcntl(pair[0], F_GETFL);
+  fcntl(pair[0], F_SETFL, flags | O_NONBLOCK);
+  const uint8_t byte = 0;
+  while (send(pair[0], &byte, 1, 0) == 1) {
+  }
+  fcntl(pair[0], F_SETFL, flags);
+  auto stuck = std::make_shared<PacedSocket>(pair[0]);
+
+  {
+    LoopbackClient client(pacer);
+    REQUIRE(CHECK(client.sender()));
+    client.sender()->set_temporal_layers(3);
+
+    pacer.schedule(stuck, {&byte, 1}, Pacer::Clock::now());
+    // Big enough that most of its packets are left to the pacer
+    client.send_frame(Picture(0, 30'000));
+    // Well after they were all due to have gone
+    std::this_thread::sleep_for(100ms);
+
+    client.send_frame(Picture(2));
+    CHECK_EQ(client.sender()->max_temporal_id(), 1);
+    // Still stuck, but one drop at a time
+    client.send_frame(Picture(1));
+    CHECK_EQ(client.sender()->max_temporal_id(), 1);
+
+    // Unstuck, and everything we did send gets there
+    uint8_t buf[16];
+    while (recv(pair[1], buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+    std::this_thread::sleep_for(50ms);
+    CHECK(TemporalIds(client.received()) == std::set<int>({0, 1}));
+
+    // Caught up, so no more drops
+    std::this_thread::sleep_for(600ms);
+    client.send_frame(Picture(1));
+    CHECK_EQ(client.sender()->max_temporal_id(), 1);
+  }
+  close(pair[1]);
+}
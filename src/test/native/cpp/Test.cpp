@@ -0,0 +1,56 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "Test.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace test {
+
+struct Case {
+  const char *name;
+  TestFn fn;
+};
+
+static std::vector<Case> &Cases() {
+  static std::vector<Case> cases;
+  return cases;
+}
+
+static int failures = 0;
+
+Registration::Registration(const char *name, TestFn fn) {
+  Cases().push_back({name, fn});
+}
+
+void Fail(const char *file, int line, const std::string &what) {
+  std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what.c_str());
+  failures++;
+}
+
+} // namespace test
+
+int main(int argc, char **argv) {
+  int run = 0, failed = 0;
+  for (const auto &c : test::Cases()) {
+    bool wanted = argc < 2;
+    for (int i = 1; i < argc; i++)
+      wanted |= std::strcmp(argv[i], c.name) == 0;
+    if (!wanted)
+      continue;
+
+    const int before = test::failures;
+    std::fprintf(stderr, "[ RUN  ] %s\n", c.name);
+    c.fn();
+    const bool ok = test::failures == before;
+    std::fprintf(stderr, "[ %s ] %s\n", ok ? " OK " : "FAIL", c.name);
+    run++;
+    failed += !ok;
+  }
+  std::fprintf(stderr, "%d of %d tests passed\n", run - failed, run);
+  return failed > 0 || run == 0;
+}
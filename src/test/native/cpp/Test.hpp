@@ -0,0 +1,58 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#pragma once
+
+#include <fmt/format.h>
+#include <string>
+
+/**
+ * Just enough of a test framework for the native tests, which run under ctest
+ * as one executable (see CMakeLists.txt):
+ *
+ *   TEST(FlexFecRecoversOneLoss) {
+ *     CHECK_EQ(recovered.size(), sent.size());
+ *   }
+ *
+ * A failed CHECK reports itself and lets the test carry on; a failed
+ * REQUIRE returns from it. Pass test names on the command line to run only
+ * those.
+ */
+
+namespace test {
+
+using TestFn = void (*)();
+
+struct Registration {
+  Registration(const char *name, TestFn fn);
+};
+
+/** Report a failed check in the running test */
+void Fail(const char *file, int line, const std::string &what);
+
+} // namespace test
+
+#define TEST(name)                                                             \
+  static void name();                                                          \
+  static ::test::Registration name##_registration{#name, name};                \
+  static void name()
+
+#define CHECK(cond)                                                            \
+  ((cond) ? true : (::test::Fail(__FILE__, __LINE__, #cond), false))
+
+#define CHECK_EQ(a, b)                                                         \
+  [&](const auto &a_, const auto &b_) {                                        \
+    if (a_ == b_)                                                              \
+      return true;                                                             \
+    ::test::Fail(__FILE__, __LINE__,                                           \
+                 fmt::format("{} == {} ({} vs {})", #a, #b, a_, b_));          \
+    return false;                                                              \
+  }((a), (b))
+
+#define REQUIRE(cond)                                                          \
+  do {                                                                         \
+    if (!CHECK(cond))                                                          \
+      return;                                                                  \
+  } while (0)
@@ -0,0 +1,193 @@
+// Copyright (c) PhotonVision contributors.
+// Open Source Software; you can modify and/or share it under the terms of
+// the GNU General Public License Version 3 in the root directory of this
+// project.
+
+#include "Test.hpp"
+#include "TextOverlay.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+// As TextOverlay::render makes it
+static uint8_t Premultiply(uint8_t color, uint8_t alpha) {
+  return static_cast<uint8_t>((color * alpha + 127) / 255);
+}
+
+static double ExactBlend(uint8_t dst, uint8_t alpha, uint8_t color) {
+  return (color * alpha + dst * (255.0 - alpha)) / 255.0;
+}
+
+// Every destination value at once, at each alpha and color. Rows of 256 go
+// entirely through the vector loop.
+TEST(BlendRowWithinOneOfExact) {
+  std::vector<uint8_t> dst(256), alpha(256), premul(256);
+  int failures = 0;
+  for (int a = 0; a < 256; a++) {
+    for (int c = 0; c < 256; c++) {
+      for (int d = 0; d < 256; d++)
+        dst[d] = static_cast<uint8_t>(d);
+      std::fill(alpha.begin(), alpha.end(), static_cast<uint8_t>(a));
+      std::fill(premul.begin(), premul.end(), Premultiply(c, a));
+      BlendRow(dst.data(), alpha.data(), premul.data(), dst.size());
+
+      for (int d = 0; d < 256 && failures < 10; d++) {
+        const double exact = ExactBlend(d, a, c);
+        if (std::abs(dst[d] - exact) > 1.0) {
+          failures++;
+          test::Fail(__FILE__, __LINE__,
+                     fmt::format("dst {} alpha {} color {}: got {}, exact {}",
+                                 d, a, c, dst[d], exact));
+        }
+      }
+    }
+  }
+}
+
+TEST(BlendRowTransparentLeavesPixel) {
+  // 16 for the vector loop, 3 for the scalar tail
+  std::vector<uint8_t> dst(19), alpha(19, 0), premul(19, 0);
+  for (size_t i = 0; i < dst.size(); i++)
+    dst[i] = static_cast<uint8_t>(i * 13 + 7);
+  const std::vector<uint8_t> before = dst;
+  BlendRow(dst.data(), alpha.data(), premul.data(), dst.size());
+  CHECK(dst == before);
+
+  // Transparent bytes next to opaque ones in the same vector
+  std::vector<uint8_t> mixed_alpha(19, 0);
+  mixed_alpha[3] = 255;
+  mixed_alpha[17] = 255;
+  std::vector<uint8_t> mixed_premul(19, 0);
+  mixed_premul[3] = mixed_premul[17] = 200;
+  BlendRow(dst.data(), mixed_alpha.data(), mixed_premul.data(), dst.size());
+  for (size_t i = 0; i < dst.size(); i++) {
+    if (mixed_alpha[i] == 0)
+      CHECK_EQ(dst[i], before[i]);
+  }
+}
+
+TEST(BlendRowOpaqueGivesTextColor) {
+  std::vector<uint8_t> dst(19), alpha(19, 255), premul(19), color(19);
+  for (size_t i = 0; i < dst.size(); i++) {
+    dst[i] = static_cast<uint8_t>(255 - i * 11);
+    color[i] = static_cast<uint8_t>(i * 13);
+    premul[i] = Premultiply(color[i], 255);
+  }
+  BlendRow(dst.data(), alpha.data(), premul.data(), dst.size());
+  CHECK(dst == color);
+}
+
+static const cv::Scalar BACKGROUND{40, 80, 120};
+static const cv::Scalar TEXT_COLOR{255, 200, 0};
+
+struct ImageDiff {
+  int inked = 0;   // Pixels either image changed from the background
+  int largest = 0; // Largest difference in any byte
+  int over = 0;    // Pixels differing by more than the allowed rounding
+};
+
+static ImageDiff Compare(const cv::Mat &a, const cv::Mat &b) {
+  ImageDiff diff;
+  for (int y = 0; y < a.rows; y++) {
+    const uint8_t *pa = a.ptr<uint8_t>(y);
+    const uint8_t *pb = b.ptr<uint8_t>(y);
+    for (int x = 0; x < a.cols; x++) {
+      int largest = 0;
+      bool inked = false;
+      for (int k = 0; k < 3; k++) {
+        const int i = 3 * x + k;
+        largest = std::max(largest, std::abs(pa[i] - pb[i]));
+        inked |= pa[i] != BACKGROUND[k] || pb[i] != BACKGROUND[k];
+      }
+      diff.inked += inked;
+      diff.largest = std::max(diff.largest, largest);
+      diff.over += largest > 2;
+    }
+  }
+  return diff;
+}
+
+static cv::Mat Background() {
+  return cv::Mat(200, 900, CV_8UC3, BACKGROUND);
+}
+
+// The glyphs are cv::putText's own, blended per pixel rather than drawn as one
+// string, so the only real differences are where neighbouring glyphs' strokes
+// overlap
+TEST(TextOverlayMatchesPutText) {
+  const std::vector<std::string> texts = {"12:34:56.789 cam0",
+                                          "Hello, World! {}", "AVWAyjq|_"};
+  for (const auto &[scale, thickness] :
+       std::vector<std::pair<double, int>>{{1.0, 2}, {0.6, 1}, {2.0, 3}}) {
+    for (const auto &text : texts) {
+      const cv::Point origin{20, 100};
+      TextOverlay overlay;
+      overlay.set({{.text = text,
+                    .origin = origin,
+                    .color = TEXT_COLOR,
+                    .scale = scale,
+                    .thickness = thickness}});
+      cv::Mat ours = Background();
+      overlay.draw(ours, 0);
+
+      cv::Mat theirs = Background();
+      cv::putText(theirs, text, origin, cv::FONT_HERSHEY_SIMPLEX, scale,
+                  TEXT_COLOR, thickness, cv::LINE_AA);
+
+      const ImageDiff diff = Compare(ours, theirs);
+      if (diff.inked < 100 || diff.largest > 32 ||
+          diff.over * 100 > diff.inked) {
+        test::Fail(__FILE__, __LINE__,
+                   fmt::format("\"{}\" at scale {} thickness {}: {} pixels "
+                               "inked, {} off by more than 2, largest {}",
+                               text, scale, thickness, diff.inked, diff.over,
+                               diff.largest));
+      }
+    }
+  }
+}
+
+// A ticking timestamp only re-renders from the digit that changed, which has
+// to come out the same as rendering the whole line afresh
+TEST(TextOverlayIncrementalMatchesFullRender) {
+  const OverlayText spec{
+      .text = "cam0 {time}", .origin = {20, 100}, .color = TEXT_COLOR};
+  const int64_t before_us = 1'700'000'000'123'000;
+  const int64_t after_us = before_us + 1000; // Just the last digit
+
+  TextOverlay ticking;
+  ticking.set({spec});
+  cv::Mat scratch = Background();
+  ticking.draw(scratch, before_us);
+  cv::Mat incremental = Background();
+  ticking.draw(incremental, after_us);
+
+  TextOverlay fresh;
+  fresh.set({spec});
+  cv::Mat full = Background();
+  fresh.draw(full, after_us);
+
+  const ImageDiff diff = Compare(incremental, full);
+  CHECK(diff.inked > 100);
+  CHECK_EQ(diff.largest, 0);
+
+  // And {time} became the capture time
+  const time_t seconds = after_us / 1'000'000;
+  tm local{};
+  localtime_r(&seconds, &local);
+  char expected[64];
+  std::snprintf(expected, sizeof(expected), "cam0 %02d:%02d:%02d.124",
+                local.tm_hour, local.tm_min, local.tm_sec);
+  cv::Mat theirs = Background();
+  cv::putText(theirs, expected, spec.origin, cv::FONT_HERSHEY_SIMPLEX,
+              spec.scale, TEXT_COLOR, spec.thickness, cv::LINE_AA);
+  const ImageDiff text_diff = Compare(full, theirs);
+  CHECK(text_diff.over * 100 < text_diff.inked);
+}